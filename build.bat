@@ -34,4 +34,7 @@ if not exist assimp.dll (
     robocopy %ASSIMP_BIN% . *.dll
 )
 cl %CommonCompilerFlags% ..\src\main.cpp -link -subsystem:console %CommonLinkerFlags% -out:opengl_foobar.exe
+if "%1"=="microbench" (
+    cl %CommonCompilerFlags% -O2 ..\src\microbench.cpp -link -subsystem:console %CommonLinkerFlags% -out:microbench.exe
+)
 popd
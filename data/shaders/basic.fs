@@ -3,9 +3,10 @@ out vec4 FragColor;
 
 in vec2 TexCoords;
 
-uniform sampler2D texture_diffuse1;
+uniform sampler2DArray texture_diffuse;
+uniform int texture_diffuse_layer;
 
 void main()
 {
-    FragColor = texture(texture_diffuse1, TexCoords);
+    FragColor = texture(texture_diffuse, vec3(TexCoords, texture_diffuse_layer));
 }
\ No newline at end of file
@@ -5,9 +5,14 @@ layout (location = 2) in vec2 aTexCoords;
 
 out vec2 TexCoords;
 
+layout (std140) uniform CameraBlock
+{
+    mat4 projection;
+    mat4 view;
+    vec4 cameraPosition;
+};
+
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
 
 void main()
 {
@@ -0,0 +1,11 @@
+#version 330 core
+layout (location = 0) out uvec2 id;
+
+uniform uint entityId; // Entity index + 1, zero is the background
+uniform uint meshId;
+
+void main()
+{
+    // Triangle within the drawn LOD, 24 bits of it
+    id = uvec2(entityId, (meshId << 24) | (uint(gl_PrimitiveID) & 0xffffffu));
+}
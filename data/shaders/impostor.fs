@@ -0,0 +1,29 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+in vec3 WorldPosition;
+flat in vec3 WorldDepthAxis;
+
+layout (std140) uniform CameraBlock
+{
+    mat4 projection;
+    mat4 view;
+    vec4 cameraPosition;
+};
+
+uniform sampler2D impostorColor;
+uniform sampler2D impostorNormalDepth;
+
+void main()
+{
+    vec4 color = texture(impostorColor, TexCoords);
+    if (color.a < 0.5) discard;
+
+    // Baked depth goes from the front (0) to the back (1) of the bounding sphere
+    float depth = texture(impostorNormalDepth, TexCoords).a;
+    vec4 clip = projection * view * vec4(WorldPosition + WorldDepthAxis * (1.0 - 2.0 * depth), 1.0);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+    FragColor = vec4(color.rgb, 1.0);
+}
@@ -0,0 +1,58 @@
+#version 330 core
+layout (location = 0) in vec2 aCorner;
+layout (location = 1) in mat4 aModel;
+
+out vec2 TexCoords;
+out vec3 WorldPosition;
+flat out vec3 WorldDepthAxis;
+
+layout (std140) uniform CameraBlock
+{
+    mat4 projection;
+    mat4 view;
+    vec4 cameraPosition;
+};
+
+uniform vec3 impostorCenter;
+uniform float impostorRadius;
+uniform float framesPerSide;
+
+vec2 signNotZero(vec2 v)
+{
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// Octahedral mapping of the sphere of view directions, y is up
+vec2 octEncode(vec3 n)
+{
+    vec2 p = n.xz / (abs(n.x) + abs(n.y) + abs(n.z));
+    if (n.y < 0.0) p = (1.0 - abs(p.yx)) * signNotZero(p);
+    return p * 0.5 + 0.5;
+}
+
+vec3 octDecode(vec2 uv)
+{
+    vec2 p = uv * 2.0 - 1.0;
+    vec3 n = vec3(p.x, 1.0 - abs(p.x) - abs(p.y), p.y);
+    if (n.y < 0.0) n.xz = (1.0 - abs(n.zx)) * signNotZero(n.xz);
+    return normalize(n);
+}
+
+void main()
+{
+    vec3 worldCenter = (aModel * vec4(impostorCenter, 1.0)).xyz;
+    vec3 localView = normalize(inverse(mat3(aModel)) * (cameraPosition.xyz - worldCenter));
+
+    // Snap to the nearest baked view and orient the quad the way it was baked
+    vec2 frame = clamp(floor(octEncode(localView) * framesPerSide), vec2(0.0), vec2(framesPerSide - 1.0));
+    vec3 frameDir = octDecode((frame + 0.5) / framesPerSide);
+    vec3 upHint = abs(frameDir.y) > 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+    vec3 right = normalize(cross(-frameDir, upHint));
+    vec3 up = cross(right, -frameDir);
+
+    vec3 localPosition = impostorCenter + (right * aCorner.x + up * aCorner.y) * impostorRadius;
+    WorldPosition = (aModel * vec4(localPosition, 1.0)).xyz;
+    WorldDepthAxis = (aModel * vec4(frameDir * impostorRadius, 0.0)).xyz;
+    TexCoords = (frame + aCorner * 0.5 + 0.5) / framesPerSide;
+    gl_Position = projection * view * vec4(WorldPosition, 1.0);
+}
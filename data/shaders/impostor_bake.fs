@@ -0,0 +1,15 @@
+#version 330 core
+layout (location = 0) out vec4 Color;
+layout (location = 1) out vec4 NormalDepth;
+
+in vec2 TexCoords;
+in vec3 Normal;
+
+uniform sampler2DArray texture_diffuse;
+uniform int texture_diffuse_layer;
+
+void main()
+{
+    Color = vec4(texture(texture_diffuse, vec3(TexCoords, texture_diffuse_layer)).rgb, 1.0);
+    NormalDepth = vec4(normalize(Normal) * 0.5 + 0.5, gl_FragCoord.z);
+}
@@ -0,0 +1,24 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aCenter; // Per instance, world space
+
+layout (std140) uniform CameraBlock
+{
+    mat4 projection;
+    mat4 view;
+    vec4 cameraPosition;
+};
+
+uniform vec3 meshCenter;
+uniform float meshRadius;
+uniform float pixelRadius;
+uniform float viewportHeight;
+
+void main()
+{
+    // Scaled in view space by the distance, so every indicator covers the same number of pixels
+    vec4 center = view * vec4(aCenter, 1.0);
+    float worldPerPixel = 2.0 * -center.z / (projection[1][1] * viewportHeight);
+    float scale = pixelRadius * worldPerPixel / meshRadius;
+    gl_Position = projection * vec4(center.xyz + (aPos - meshCenter) * scale, 1.0);
+}
@@ -0,0 +1,416 @@
+// Batch math on structure-of-arrays data.
+//
+// The math elsewhere works on one glm matrix or vector at a time. These
+// functions instead take every component as its own array, so one instruction
+// handles the same component of 4 objects with SSE2, 8 with AVX or 16 with
+// AVX-512. The kernels are written once in batch_math_kernels.cpp against a
+// small lane type, and that file is included once per lane type, each compiled
+// for its own instruction set. selectBatchMathKernels picks the widest one the
+// CPU has, which does the full groups, and the scalar one does what's left.
+//
+// The kernels do the same operations in the same order as the glm code they
+// stand in for, without reciprocal approximations, so as long as neither side is
+// built with fused multiply-adds the results are bit-identical: the matrix
+// products, decomposeTransform and intersectRaySphere. transformAABBBatch
+// uses the absolute matrix instead of transforming all 8 corners, which only
+// matches within rounding. microbench checks both against glm.
+//
+// Arrays are read and written unaligned, so batches can start anywhere. The
+// outputs can be the same arrays as the inputs.
+
+#define BATCH_MAX_WIDTH 16
+#define BATCH_FRUSTUM_PLANES 6
+
+// Column major like glm, m[column * 4 + row]
+struct Mat4Soa {
+    float* m[16];
+};
+
+struct Vec3Soa {
+    float* x;
+    float* y;
+    float* z;
+};
+
+struct QuatSoa {
+    float* x;
+    float* y;
+    float* z;
+    float* w;
+};
+
+struct SphereSoa {
+    Vec3Soa center;
+    float* radius;
+};
+
+struct AABBSoa {
+    Vec3Soa min;
+    Vec3Soa max;
+};
+
+struct ScalarLanes {
+    float v;
+    static inline ScalarLanes load(const float* p) { return { *p }; }
+    static inline ScalarLanes splat(float x) { return { x }; }
+    inline void store(float* p) const { *p = v; }
+};
+
+struct ScalarMask {
+    bool v;
+};
+
+static inline ScalarLanes operator+(ScalarLanes a, ScalarLanes b) { return { a.v + b.v }; }
+static inline ScalarLanes operator-(ScalarLanes a, ScalarLanes b) { return { a.v - b.v }; }
+static inline ScalarLanes operator*(ScalarLanes a, ScalarLanes b) { return { a.v * b.v }; }
+static inline ScalarLanes operator/(ScalarLanes a, ScalarLanes b) { return { a.v / b.v }; }
+static inline ScalarLanes operator-(ScalarLanes a) { return { -a.v }; }
+static inline ScalarMask operator<(ScalarLanes a, ScalarLanes b) { return { a.v < b.v }; }
+static inline ScalarMask operator>(ScalarLanes a, ScalarLanes b) { return { a.v > b.v }; }
+static inline ScalarMask operator<=(ScalarLanes a, ScalarLanes b) { return { a.v <= b.v }; }
+static inline ScalarMask operator>=(ScalarLanes a, ScalarLanes b) { return { a.v >= b.v }; }
+static inline ScalarMask operator!=(ScalarLanes a, ScalarLanes b) { return { a.v != b.v }; }
+static inline ScalarMask operator&(ScalarMask a, ScalarMask b) { return { a.v && b.v }; }
+static inline ScalarMask operator|(ScalarMask a, ScalarMask b) { return { a.v || b.v }; }
+static inline ScalarMask operator!(ScalarMask a) { return { !a.v }; }
+// Same operand order as minps and maxps, so NaNs come out the same
+static inline ScalarLanes lanesMin(ScalarLanes a, ScalarLanes b) { return { a.v < b.v ? a.v : b.v }; }
+static inline ScalarLanes lanesMax(ScalarLanes a, ScalarLanes b) { return { a.v > b.v ? a.v : b.v }; }
+static inline ScalarLanes lanesSqrt(ScalarLanes a) { return { sqrtf(a.v) }; }
+static inline ScalarLanes lanesSelect(ScalarMask m, ScalarLanes a, ScalarLanes b) { return { m.v ? a.v : b.v }; }
+static inline void storeLanesMask(unsigned char* p, ScalarMask m) { *p = m.v; }
+
+#if CPU_X86
+CPU_TARGET_BEGIN("sse2")
+struct Sse2Lanes {
+    __m128 v;
+    static inline Sse2Lanes load(const float* p) { return { _mm_loadu_ps(p) }; }
+    static inline Sse2Lanes splat(float x) { return { _mm_set1_ps(x) }; }
+    inline void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+struct Sse2Mask {
+    __m128 v;
+};
+
+static inline Sse2Lanes operator+(Sse2Lanes a, Sse2Lanes b) { return { _mm_add_ps(a.v, b.v) }; }
+static inline Sse2Lanes operator-(Sse2Lanes a, Sse2Lanes b) { return { _mm_sub_ps(a.v, b.v) }; }
+static inline Sse2Lanes operator*(Sse2Lanes a, Sse2Lanes b) { return { _mm_mul_ps(a.v, b.v) }; }
+static inline Sse2Lanes operator/(Sse2Lanes a, Sse2Lanes b) { return { _mm_div_ps(a.v, b.v) }; }
+static inline Sse2Lanes operator-(Sse2Lanes a) { return { _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)) }; }
+static inline Sse2Mask operator<(Sse2Lanes a, Sse2Lanes b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+static inline Sse2Mask operator>(Sse2Lanes a, Sse2Lanes b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+static inline Sse2Mask operator<=(Sse2Lanes a, Sse2Lanes b) { return { _mm_cmple_ps(a.v, b.v) }; }
+static inline Sse2Mask operator>=(Sse2Lanes a, Sse2Lanes b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+static inline Sse2Mask operator!=(Sse2Lanes a, Sse2Lanes b) { return { _mm_cmpneq_ps(a.v, b.v) }; }
+static inline Sse2Mask operator&(Sse2Mask a, Sse2Mask b) { return { _mm_and_ps(a.v, b.v) }; }
+static inline Sse2Mask operator|(Sse2Mask a, Sse2Mask b) { return { _mm_or_ps(a.v, b.v) }; }
+static inline Sse2Mask operator!(Sse2Mask a) { return { _mm_xor_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(-1))) }; }
+static inline Sse2Lanes lanesMin(Sse2Lanes a, Sse2Lanes b) { return { _mm_min_ps(a.v, b.v) }; }
+static inline Sse2Lanes lanesMax(Sse2Lanes a, Sse2Lanes b) { return { _mm_max_ps(a.v, b.v) }; }
+static inline Sse2Lanes lanesSqrt(Sse2Lanes a) { return { _mm_sqrt_ps(a.v) }; }
+static inline Sse2Lanes lanesSelect(Sse2Mask m, Sse2Lanes a, Sse2Lanes b) { return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) }; }
+
+static inline void
+storeLanesMask(unsigned char* p, Sse2Mask m) {
+    int bits = _mm_movemask_ps(m.v);
+    for (int i = 0; i < 4; i++) p[i] = (bits >> i) & 1;
+}
+CPU_TARGET_END
+
+CPU_TARGET_BEGIN("avx")
+struct AvxLanes {
+    __m256 v;
+    static inline AvxLanes load(const float* p) { return { _mm256_loadu_ps(p) }; }
+    static inline AvxLanes splat(float x) { return { _mm256_set1_ps(x) }; }
+    inline void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+struct AvxMask {
+    __m256 v;
+};
+
+static inline AvxLanes operator+(AvxLanes a, AvxLanes b) { return { _mm256_add_ps(a.v, b.v) }; }
+static inline AvxLanes operator-(AvxLanes a, AvxLanes b) { return { _mm256_sub_ps(a.v, b.v) }; }
+static inline AvxLanes operator*(AvxLanes a, AvxLanes b) { return { _mm256_mul_ps(a.v, b.v) }; }
+static inline AvxLanes operator/(AvxLanes a, AvxLanes b) { return { _mm256_div_ps(a.v, b.v) }; }
+static inline AvxLanes operator-(AvxLanes a) { return { _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)) }; }
+static inline AvxMask operator<(AvxLanes a, AvxLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+static inline AvxMask operator>(AvxLanes a, AvxLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+static inline AvxMask operator<=(AvxLanes a, AvxLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+static inline AvxMask operator>=(AvxLanes a, AvxLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+static inline AvxMask operator!=(AvxLanes a, AvxLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ) }; }
+static inline AvxMask operator&(AvxMask a, AvxMask b) { return { _mm256_and_ps(a.v, b.v) }; }
+static inline AvxMask operator|(AvxMask a, AvxMask b) { return { _mm256_or_ps(a.v, b.v) }; }
+static inline AvxMask operator!(AvxMask a) { return { _mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1))) }; }
+static inline AvxLanes lanesMin(AvxLanes a, AvxLanes b) { return { _mm256_min_ps(a.v, b.v) }; }
+static inline AvxLanes lanesMax(AvxLanes a, AvxLanes b) { return { _mm256_max_ps(a.v, b.v) }; }
+static inline AvxLanes lanesSqrt(AvxLanes a) { return { _mm256_sqrt_ps(a.v) }; }
+static inline AvxLanes lanesSelect(AvxMask m, AvxLanes a, AvxLanes b) { return { _mm256_blendv_ps(b.v, a.v, m.v) }; }
+
+static inline void
+storeLanesMask(unsigned char* p, AvxMask m) {
+    int bits = _mm256_movemask_ps(m.v);
+    for (int i = 0; i < 8; i++) p[i] = (bits >> i) & 1;
+}
+CPU_TARGET_END
+
+// Comparisons give a mask register, one bit per lane
+CPU_TARGET_BEGIN("avx512f")
+struct Avx512Lanes {
+    __m512 v;
+    static inline Avx512Lanes load(const float* p) { return { _mm512_loadu_ps(p) }; }
+    static inline Avx512Lanes splat(float x) { return { _mm512_set1_ps(x) }; }
+    inline void store(float* p) const { _mm512_storeu_ps(p, v); }
+};
+
+struct Avx512Mask {
+    __mmask16 v;
+};
+
+static inline Avx512Lanes operator+(Avx512Lanes a, Avx512Lanes b) { return { _mm512_add_ps(a.v, b.v) }; }
+static inline Avx512Lanes operator-(Avx512Lanes a, Avx512Lanes b) { return { _mm512_sub_ps(a.v, b.v) }; }
+static inline Avx512Lanes operator*(Avx512Lanes a, Avx512Lanes b) { return { _mm512_mul_ps(a.v, b.v) }; }
+static inline Avx512Lanes operator/(Avx512Lanes a, Avx512Lanes b) { return { _mm512_div_ps(a.v, b.v) }; }
+// Float xor needs AVX-512DQ
+static inline Avx512Lanes operator-(Avx512Lanes a) { return { _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.v), _mm512_set1_epi32((int)0x80000000))) }; }
+static inline Avx512Mask operator<(Avx512Lanes a, Avx512Lanes b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+static inline Avx512Mask operator>(Avx512Lanes a, Avx512Lanes b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+static inline Avx512Mask operator<=(Avx512Lanes a, Avx512Lanes b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+static inline Avx512Mask operator>=(Avx512Lanes a, Avx512Lanes b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+static inline Avx512Mask operator!=(Avx512Lanes a, Avx512Lanes b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_NEQ_UQ) }; }
+static inline Avx512Mask operator&(Avx512Mask a, Avx512Mask b) { return { (__mmask16)(a.v & b.v) }; }
+static inline Avx512Mask operator|(Avx512Mask a, Avx512Mask b) { return { (__mmask16)(a.v | b.v) }; }
+static inline Avx512Mask operator!(Avx512Mask a) { return { (__mmask16)~a.v }; }
+static inline Avx512Lanes lanesMin(Avx512Lanes a, Avx512Lanes b) { return { _mm512_min_ps(a.v, b.v) }; }
+static inline Avx512Lanes lanesMax(Avx512Lanes a, Avx512Lanes b) { return { _mm512_max_ps(a.v, b.v) }; }
+static inline Avx512Lanes lanesSqrt(Avx512Lanes a) { return { _mm512_sqrt_ps(a.v) }; }
+static inline Avx512Lanes lanesSelect(Avx512Mask m, Avx512Lanes a, Avx512Lanes b) { return { _mm512_mask_blend_ps(m.v, b.v, a.v) }; }
+
+static inline void
+storeLanesMask(unsigned char* p, Avx512Mask m) {
+    for (int i = 0; i < 16; i++) p[i] = (m.v >> i) & 1;
+}
+CPU_TARGET_END
+#endif
+
+#define BATCH_PASTE_(a, b) a##b
+#define BATCH_PASTE(a, b) BATCH_PASTE_(a, b)
+#define BATCH_KERNEL(name) BATCH_PASTE(name, BATCH_SUFFIX)
+
+#define LANES ScalarLanes
+#define LANES_MASK ScalarMask
+#define BATCH_WIDTH 1
+#define BATCH_SUFFIX Scalar
+#include "batch_math_kernels.cpp"
+#undef LANES
+#undef LANES_MASK
+#undef BATCH_WIDTH
+#undef BATCH_SUFFIX
+
+#if CPU_X86
+CPU_TARGET_BEGIN("sse2")
+#define LANES Sse2Lanes
+#define LANES_MASK Sse2Mask
+#define BATCH_WIDTH 4
+#define BATCH_SUFFIX Sse2
+#include "batch_math_kernels.cpp"
+#undef LANES
+#undef LANES_MASK
+#undef BATCH_WIDTH
+#undef BATCH_SUFFIX
+CPU_TARGET_END
+
+CPU_TARGET_BEGIN("avx")
+#define LANES AvxLanes
+#define LANES_MASK AvxMask
+#define BATCH_WIDTH 8
+#define BATCH_SUFFIX Avx
+#include "batch_math_kernels.cpp"
+#undef LANES
+#undef LANES_MASK
+#undef BATCH_WIDTH
+#undef BATCH_SUFFIX
+CPU_TARGET_END
+
+CPU_TARGET_BEGIN("avx512f")
+#define LANES Avx512Lanes
+#define LANES_MASK Avx512Mask
+#define BATCH_WIDTH 16
+#define BATCH_SUFFIX Avx512
+#include "batch_math_kernels.cpp"
+#undef LANES
+#undef LANES_MASK
+#undef BATCH_WIDTH
+#undef BATCH_SUFFIX
+CPU_TARGET_END
+#endif
+
+struct BatchMathKernels {
+    CpuIsa isa;
+    uint width;
+    void (*multiplyMat4)(const Mat4Soa* a, const Mat4Soa* b, Mat4Soa* out, uint first, uint last);
+    void (*premultiplyMat4)(const float* a, const Mat4Soa* b, Mat4Soa* out, uint first, uint last);
+    void (*transformAABB)(const Mat4Soa* matrices, const AABBSoa* bounds, AABBSoa* out, uint first, uint last);
+    void (*spheresInFrustum)(const float* planes, const SphereSoa* spheres, unsigned char* inside, uint first, uint last);
+    void (*intersectRaySphere)(const float* origin, const float* direction, const SphereSoa* spheres, unsigned char* hits, uint first, uint last);
+    void (*intersectRayAABB)(const float* origin, const float* inverseDirection, const AABBSoa* bounds, float* distances, uint first, uint last);
+    void (*decomposeMat4)(const Mat4Soa* matrices, Vec3Soa* positions, QuatSoa* rotations, Vec3Soa* scales, uint first, uint last);
+};
+
+#define BATCH_MATH_KERNELS(suffix, isa, width) { isa, width, \
+    multiplyMat4##suffix, premultiplyMat4##suffix, transformAABB##suffix, spheresInFrustum##suffix, \
+    intersectRaySphere##suffix, intersectRayAABB##suffix, decomposeMat4##suffix }
+
+// The scalar ones until selectBatchMathKernels is called
+static BatchMathKernels g_batchMath = BATCH_MATH_KERNELS(Scalar, CPU_ISA_SCALAR, 1);
+
+static void
+selectBatchMathKernels(CpuIsa isa) {
+    BatchMathKernels kernels = BATCH_MATH_KERNELS(Scalar, CPU_ISA_SCALAR, 1);
+#if CPU_X86
+    if (isa >= CPU_ISA_AVX512) {
+        kernels = BATCH_MATH_KERNELS(Avx512, CPU_ISA_AVX512, 16);
+    } else if (isa >= CPU_ISA_AVX) {
+        kernels = BATCH_MATH_KERNELS(Avx, CPU_ISA_AVX, 8);
+    } else if (isa >= CPU_ISA_SSE2) {
+        kernels = BATCH_MATH_KERNELS(Sse2, CPU_ISA_SSE2, 4);
+    }
+#endif
+    g_batchMath = kernels;
+}
+
+// Allocations have room for a whole group past count, and start on a 64 byte boundary
+static inline float*
+pushBatchFloats(MemoryArena* arena, uint count) {
+    uint padded = (count + BATCH_MAX_WIDTH - 1) / BATCH_MAX_WIDTH * BATCH_MAX_WIDTH;
+    return (float*)pushSize(arena, padded * sizeof(float), 64);
+}
+
+static Mat4Soa
+pushMat4Soa(MemoryArena* arena, uint count) {
+    Mat4Soa result;
+    for (int i = 0; i < 16; i++) result.m[i] = pushBatchFloats(arena, count);
+    return result;
+}
+
+static Vec3Soa
+pushVec3Soa(MemoryArena* arena, uint count) {
+    Vec3Soa result;
+    result.x = pushBatchFloats(arena, count);
+    result.y = pushBatchFloats(arena, count);
+    result.z = pushBatchFloats(arena, count);
+    return result;
+}
+
+static QuatSoa
+pushQuatSoa(MemoryArena* arena, uint count) {
+    QuatSoa result;
+    result.x = pushBatchFloats(arena, count);
+    result.y = pushBatchFloats(arena, count);
+    result.z = pushBatchFloats(arena, count);
+    result.w = pushBatchFloats(arena, count);
+    return result;
+}
+
+static SphereSoa
+pushSphereSoa(MemoryArena* arena, uint count) {
+    SphereSoa result;
+    result.center = pushVec3Soa(arena, count);
+    result.radius = pushBatchFloats(arena, count);
+    return result;
+}
+
+static AABBSoa
+pushAABBSoa(MemoryArena* arena, uint count) {
+    AABBSoa result;
+    result.min = pushVec3Soa(arena, count);
+    result.max = pushVec3Soa(arena, count);
+    return result;
+}
+
+static inline void
+setMat4Soa(Mat4Soa* soa, uint index, const glm::mat4& matrix) {
+    for (int i = 0; i < 16; i++) soa->m[i][index] = matrix[i / 4][i % 4];
+}
+
+static inline glm::mat4
+getMat4Soa(const Mat4Soa* soa, uint index) {
+    glm::mat4 matrix;
+    for (int i = 0; i < 16; i++) matrix[i / 4][i % 4] = soa->m[i][index];
+    return matrix;
+}
+
+// Normalized, pointing inwards: left, right, bottom, top, near, far
+static void
+extractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4* planes) {
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        planes[i * 2 + 0] = rows[3] + rows[i];
+        planes[i * 2 + 1] = rows[3] - rows[i];
+    }
+    for (int i = 0; i < BATCH_FRUSTUM_PLANES; i++) {
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+    }
+}
+
+// out = a * b for every matrix
+static void
+multiplyMat4Batch(const Mat4Soa* a, const Mat4Soa* b, Mat4Soa* out, uint count) {
+    uint wideCount = count - count % g_batchMath.width;
+    g_batchMath.multiplyMat4(a, b, out, 0, wideCount);
+    multiplyMat4Scalar(a, b, out, wideCount, count);
+}
+
+// out = a * b with the same a for every matrix, like the view projection
+static void
+premultiplyMat4Batch(const glm::mat4& a, const Mat4Soa* b, Mat4Soa* out, uint count) {
+    uint wideCount = count - count % g_batchMath.width;
+    g_batchMath.premultiplyMat4(&a[0][0], b, out, 0, wideCount);
+    premultiplyMat4Scalar(&a[0][0], b, out, wideCount, count);
+}
+
+// World space bounds of boxes under affine matrices
+static void
+transformAABBBatch(const Mat4Soa* matrices, const AABBSoa* bounds, AABBSoa* out, uint count) {
+    uint wideCount = count - count % g_batchMath.width;
+    g_batchMath.transformAABB(matrices, bounds, out, 0, wideCount);
+    transformAABBScalar(matrices, bounds, out, wideCount, count);
+}
+
+// inside is 1 for spheres that are at least partly inside all the planes
+static void
+spheresInFrustumBatch(const glm::vec4* planes, const SphereSoa* spheres, unsigned char* inside, uint count) {
+    uint wideCount = count - count % g_batchMath.width;
+    g_batchMath.spheresInFrustum(&planes[0].x, spheres, inside, 0, wideCount);
+    spheresInFrustumScalar(&planes[0].x, spheres, inside, wideCount, count);
+}
+
+// Same test as intersectRaySphere, direction has to be normalized
+static void
+intersectRaySphereBatch(glm::vec3 origin, glm::vec3 direction, const SphereSoa* spheres, unsigned char* hits, uint count) {
+    uint wideCount = count - count % g_batchMath.width;
+    g_batchMath.intersectRaySphere(&origin.x, &direction.x, spheres, hits, 0, wideCount);
+    intersectRaySphereScalar(&origin.x, &direction.x, spheres, hits, wideCount, count);
+}
+
+// Distance along the ray to where it enters each box, 0 when it starts inside
+// and infinity when it misses
+static void
+intersectRayAABBBatch(glm::vec3 origin, glm::vec3 direction, const AABBSoa* bounds, float* distances, uint count) {
+    glm::vec3 inverseDirection = 1.0f / direction;
+    uint wideCount = count - count % g_batchMath.width;
+    g_batchMath.intersectRayAABB(&origin.x, &inverseDirection.x, bounds, distances, 0, wideCount);
+    intersectRayAABBScalar(&origin.x, &inverseDirection.x, bounds, distances, wideCount, count);
+}
+
+// Same as decomposeTransform for every matrix
+static void
+decomposeMat4Batch(const Mat4Soa* matrices, Vec3Soa* positions, QuatSoa* rotations, Vec3Soa* scales, uint count) {
+    uint wideCount = count - count % g_batchMath.width;
+    g_batchMath.decomposeMat4(matrices, positions, rotations, scales, 0, wideCount);
+    decomposeMat4Scalar(matrices, positions, rotations, scales, wideCount, count);
+}
@@ -0,0 +1,202 @@
+// Batch math kernels, included by batch_math.cpp once per lane type with
+// LANES, LANES_MASK, BATCH_WIDTH and BATCH_SUFFIX defined. Each one handles the
+// elements from first to last, and last - first has to be a multiple of
+// BATCH_WIDTH.
+
+static void
+BATCH_KERNEL(multiplyMat4)(const Mat4Soa* a, const Mat4Soa* b, Mat4Soa* out, uint first, uint last) {
+    for (uint i = first; i < last; i += BATCH_WIDTH) {
+        LANES left[16];
+        for (int j = 0; j < 16; j++) left[j] = LANES::load(a->m[j] + i);
+        for (int column = 0; column < 4; column++) {
+            LANES b0 = LANES::load(b->m[column * 4 + 0] + i);
+            LANES b1 = LANES::load(b->m[column * 4 + 1] + i);
+            LANES b2 = LANES::load(b->m[column * 4 + 2] + i);
+            LANES b3 = LANES::load(b->m[column * 4 + 3] + i);
+            for (int row = 0; row < 4; row++) {
+                LANES value = left[row] * b0 + left[4 + row] * b1 + left[8 + row] * b2 + left[12 + row] * b3;
+                value.store(out->m[column * 4 + row] + i);
+            }
+        }
+    }
+}
+
+static void
+BATCH_KERNEL(premultiplyMat4)(const float* a, const Mat4Soa* b, Mat4Soa* out, uint first, uint last) {
+    LANES left[16];
+    for (int j = 0; j < 16; j++) left[j] = LANES::splat(a[j]);
+    for (uint i = first; i < last; i += BATCH_WIDTH) {
+        for (int column = 0; column < 4; column++) {
+            LANES b0 = LANES::load(b->m[column * 4 + 0] + i);
+            LANES b1 = LANES::load(b->m[column * 4 + 1] + i);
+            LANES b2 = LANES::load(b->m[column * 4 + 2] + i);
+            LANES b3 = LANES::load(b->m[column * 4 + 3] + i);
+            for (int row = 0; row < 4; row++) {
+                LANES value = left[row] * b0 + left[4 + row] * b1 + left[8 + row] * b2 + left[12 + row] * b3;
+                value.store(out->m[column * 4 + row] + i);
+            }
+        }
+    }
+}
+
+// Each axis of the result is the translation plus, for every input axis, the
+// smaller and larger of the box's extremes along it scaled by the matrix
+static void
+BATCH_KERNEL(transformAABB)(const Mat4Soa* matrices, const AABBSoa* bounds, AABBSoa* out, uint first, uint last) {
+    for (uint i = first; i < last; i += BATCH_WIDTH) {
+        LANES mins[3] = { LANES::load(bounds->min.x + i), LANES::load(bounds->min.y + i), LANES::load(bounds->min.z + i) };
+        LANES maxs[3] = { LANES::load(bounds->max.x + i), LANES::load(bounds->max.y + i), LANES::load(bounds->max.z + i) };
+        float* outMins[3] = { out->min.x, out->min.y, out->min.z };
+        float* outMaxs[3] = { out->max.x, out->max.y, out->max.z };
+        LANES resultMin[3];
+        LANES resultMax[3];
+        for (int row = 0; row < 3; row++) {
+            resultMin[row] = LANES::load(matrices->m[12 + row] + i);
+            resultMax[row] = resultMin[row];
+            for (int column = 0; column < 3; column++) {
+                LANES element = LANES::load(matrices->m[column * 4 + row] + i);
+                LANES a = element * mins[column];
+                LANES b = element * maxs[column];
+                resultMin[row] = resultMin[row] + lanesMin(a, b);
+                resultMax[row] = resultMax[row] + lanesMax(a, b);
+            }
+        }
+        // Stored after everything is read, out can be bounds
+        for (int row = 0; row < 3; row++) {
+            resultMin[row].store(outMins[row] + i);
+            resultMax[row].store(outMaxs[row] + i);
+        }
+    }
+}
+
+static void
+BATCH_KERNEL(spheresInFrustum)(const float* planes, const SphereSoa* spheres, unsigned char* inside, uint first, uint last) {
+    LANES normals[BATCH_FRUSTUM_PLANES][3];
+    LANES distances[BATCH_FRUSTUM_PLANES];
+    for (int p = 0; p < BATCH_FRUSTUM_PLANES; p++) {
+        for (int j = 0; j < 3; j++) normals[p][j] = LANES::splat(planes[p * 4 + j]);
+        distances[p] = LANES::splat(planes[p * 4 + 3]);
+    }
+    for (uint i = first; i < last; i += BATCH_WIDTH) {
+        LANES x = LANES::load(spheres->center.x + i);
+        LANES y = LANES::load(spheres->center.y + i);
+        LANES z = LANES::load(spheres->center.z + i);
+        LANES negativeRadius = -LANES::load(spheres->radius + i);
+        LANES distance = normals[0][0] * x + normals[0][1] * y + normals[0][2] * z + distances[0];
+        LANES_MASK outside = distance < negativeRadius;
+        for (int p = 1; p < BATCH_FRUSTUM_PLANES; p++) {
+            distance = normals[p][0] * x + normals[p][1] * y + normals[p][2] * z + distances[p];
+            outside = outside | (distance < negativeRadius);
+        }
+        storeLanesMask(inside + i, !outside);
+    }
+}
+
+static void
+BATCH_KERNEL(intersectRaySphere)(const float* origin, const float* direction, const SphereSoa* spheres, unsigned char* hits, uint first, uint last) {
+    LANES px = LANES::splat(origin[0]), py = LANES::splat(origin[1]), pz = LANES::splat(origin[2]);
+    LANES dx = LANES::splat(direction[0]), dy = LANES::splat(direction[1]), dz = LANES::splat(direction[2]);
+    LANES zero = LANES::splat(0.0f);
+    for (uint i = first; i < last; i += BATCH_WIDTH) {
+        LANES mx = px - LANES::load(spheres->center.x + i);
+        LANES my = py - LANES::load(spheres->center.y + i);
+        LANES mz = pz - LANES::load(spheres->center.z + i);
+        LANES r = LANES::load(spheres->radius + i);
+        LANES b = mx * dx + my * dy + mz * dz;
+        LANES c = mx * mx + my * my + mz * mz - r * r;
+        LANES_MASK miss = ((c > zero) & (b > zero)) | (b * b - c < zero);
+        storeLanesMask(hits + i, !miss);
+    }
+}
+
+static void
+BATCH_KERNEL(intersectRayAABB)(const float* origin, const float* inverseDirection, const AABBSoa* bounds, float* distances, uint first, uint last) {
+    LANES o[3] = { LANES::splat(origin[0]), LANES::splat(origin[1]), LANES::splat(origin[2]) };
+    LANES inv[3] = { LANES::splat(inverseDirection[0]), LANES::splat(inverseDirection[1]), LANES::splat(inverseDirection[2]) };
+    LANES zero = LANES::splat(0.0f);
+    LANES infinity = LANES::splat(INFINITY);
+    for (uint i = first; i < last; i += BATCH_WIDTH) {
+        const float* mins[3] = { bounds->min.x + i, bounds->min.y + i, bounds->min.z + i };
+        const float* maxs[3] = { bounds->max.x + i, bounds->max.y + i, bounds->max.z + i };
+        LANES enter = zero;
+        LANES exit = infinity;
+        for (int axis = 0; axis < 3; axis++) {
+            LANES t0 = (LANES::load(mins[axis]) - o[axis]) * inv[axis];
+            LANES t1 = (LANES::load(maxs[axis]) - o[axis]) * inv[axis];
+            enter = lanesMax(enter, lanesMin(t0, t1));
+            exit = lanesMin(exit, lanesMax(t0, t1));
+        }
+        lanesSelect(enter <= exit, enter, infinity).store(distances + i);
+    }
+}
+
+static void
+BATCH_KERNEL(decomposeMat4)(const Mat4Soa* matrices, Vec3Soa* positions, QuatSoa* rotations, Vec3Soa* scales, uint first, uint last) {
+    LANES zero = LANES::splat(0.0f);
+    LANES one = LANES::splat(1.0f);
+    for (uint i = first; i < last; i += BATCH_WIDTH) {
+        LANES m[12];
+        for (int j = 0; j < 12; j++) m[j] = LANES::load(matrices->m[j] + i);
+        LANES position[3] = { LANES::load(matrices->m[12] + i), LANES::load(matrices->m[13] + i), LANES::load(matrices->m[14] + i) };
+
+        LANES scale[3];
+        for (int axis = 0; axis < 3; axis++) {
+            LANES* a = &m[axis * 4];
+            scale[axis] = lanesSqrt(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+        }
+        LANES cx = m[1] * m[6] - m[5] * m[2];
+        LANES cy = m[2] * m[4] - m[6] * m[0];
+        LANES cz = m[0] * m[5] - m[4] * m[1];
+        LANES determinant = cx * m[8] + cy * m[9] + cz * m[10];
+        scale[0] = lanesSelect(determinant < zero, -scale[0], scale[0]);
+
+        // r[column][row] of the rotation
+        LANES r[3][3];
+        for (int axis = 0; axis < 3; axis++) {
+            LANES_MASK nonZero = scale[axis] != zero;
+            for (int j = 0; j < 3; j++) r[axis][j] = lanesSelect(nonZero, m[axis * 4 + j] / scale[axis], zero);
+        }
+
+        // glm::quat_cast, with the switch done as selects where the last larger value wins
+        LANES fourX = r[0][0] - r[1][1] - r[2][2];
+        LANES fourY = r[1][1] - r[0][0] - r[2][2];
+        LANES fourZ = r[2][2] - r[0][0] - r[1][1];
+        LANES fourW = r[0][0] + r[1][1] + r[2][2];
+        LANES biggest = fourW;
+        LANES_MASK isX = fourX > biggest;
+        biggest = lanesSelect(isX, fourX, biggest);
+        LANES_MASK isY = fourY > biggest;
+        biggest = lanesSelect(isY, fourY, biggest);
+        LANES_MASK isZ = fourZ > biggest;
+        biggest = lanesSelect(isZ, fourZ, biggest);
+
+        LANES biggestValue = lanesSqrt(biggest + one) * LANES::splat(0.5f);
+        LANES mult = LANES::splat(0.25f) / biggestValue;
+        LANES a = (r[1][2] - r[2][1]) * mult;
+        LANES b = (r[2][0] - r[0][2]) * mult;
+        LANES c = (r[0][1] - r[1][0]) * mult;
+        LANES d = (r[0][1] + r[1][0]) * mult;
+        LANES e = (r[2][0] + r[0][2]) * mult;
+        LANES f = (r[1][2] + r[2][1]) * mult;
+        LANES qw = lanesSelect(isZ, c, lanesSelect(isY, b, lanesSelect(isX, a, biggestValue)));
+        LANES qx = lanesSelect(isZ, e, lanesSelect(isY, d, lanesSelect(isX, biggestValue, a)));
+        LANES qy = lanesSelect(isZ, f, lanesSelect(isY, biggestValue, lanesSelect(isX, d, b)));
+        LANES qz = lanesSelect(isZ, biggestValue, lanesSelect(isY, f, lanesSelect(isX, e, c)));
+
+        // glm::normalize, which gives the identity for a zero quaternion
+        LANES length = lanesSqrt((qx * qx + qy * qy) + (qz * qz + qw * qw));
+        LANES_MASK valid = !(length <= zero);
+        LANES inverseLength = one / length;
+        lanesSelect(valid, qx * inverseLength, zero).store(rotations->x + i);
+        lanesSelect(valid, qy * inverseLength, zero).store(rotations->y + i);
+        lanesSelect(valid, qz * inverseLength, zero).store(rotations->z + i);
+        lanesSelect(valid, qw * inverseLength, one).store(rotations->w + i);
+
+        position[0].store(positions->x + i);
+        position[1].store(positions->y + i);
+        position[2].store(positions->z + i);
+        scale[0].store(scales->x + i);
+        scale[1].store(scales->y + i);
+        scale[2].store(scales->z + i);
+    }
+}
@@ -0,0 +1,447 @@
+// Benchmark runner.
+//
+// --bench replaces the interactive session with a fixed list of generated
+// scenes: grids and random scatters of 1 to 100k nanosuits or spheres. Each
+// scene is flown along a scripted camera path that advances per frame rather
+// than per second, so every run renders the same frames however fast the
+// machine is. After BENCH_WARMUP_FRAMES, the CPU and GPU time of every frame is
+// recorded along with draw calls, triangles, allocations and memory, and the
+// results are written as JSON.
+//
+// Given a baseline written by an earlier run, every metric that got worse by
+// more than its threshold is reported and fails the run. Scenes of
+// BENCH_ALLOCATION_CHECK_COUNT entities also fail the run if a measured frame
+// allocates on any thread, the job workers and the streaming worker included.
+// The JSON has one scene per line with flat keys, so the baseline is read back
+// with strstr instead of a JSON parser.
+
+#ifdef _WIN32
+#include <psapi.h>
+#endif
+
+#define BENCH_MAX_SCENES 16
+#define BENCH_WARMUP_FRAMES 60
+#define BENCH_DEFAULT_FRAMES 240 // Measured frames per scene, at most FRAME_HISTORY_SIZE
+#define BENCH_GPU_QUERIES 4
+#define BENCH_DEFAULT_THRESHOLD 10.0f // Percent
+#define BENCH_ALLOCATION_CHECK_COUNT 10000
+#define BENCH_SPACING 3.0f
+
+enum BenchLayout {
+    BENCH_GRID,    // Flown over
+    BENCH_SCATTER, // Orbited
+};
+
+enum BenchMetric {
+    BENCH_CPU_P50,
+    BENCH_CPU_P95,
+    BENCH_CPU_P99,
+    BENCH_GPU_P50,
+    BENCH_GPU_P95,
+    BENCH_GPU_P99,
+    BENCH_DRAW_CALLS,
+    BENCH_TRIANGLES,
+    BENCH_PEAK_RSS,
+    BENCH_METRIC_COUNT,
+};
+
+// Also the JSON keys
+static const char* benchMetricNames[BENCH_METRIC_COUNT] = {
+    "cpu_p50_ms",
+    "cpu_p95_ms",
+    "cpu_p99_ms",
+    "gpu_p50_ms",
+    "gpu_p95_ms",
+    "gpu_p99_ms",
+    "draw_calls",
+    "triangles",
+    "peak_rss_mb",
+};
+
+struct BenchScene {
+    char name[48];
+    BenchLayout layout;
+    uint count;
+    Model* model;
+    float scale;
+    Shader shader;
+};
+
+struct BenchResult {
+    TimingHistory cpuTimes;
+    TimingHistory gpuTimes;
+    uint frames;
+    unsigned long long drawCalls; // Summed over the measured frames
+    unsigned long long triangles;
+    uint maxAllocations; // In a single measured frame
+    size_t peakResidentBytes; // Of the whole process
+    size_t textureBytes;
+    double metrics[BENCH_METRIC_COUNT]; // Filled in when the scene is done
+};
+
+struct BenchRunner {
+    BenchScene scenes[BENCH_MAX_SCENES];
+    BenchResult results[BENCH_MAX_SCENES];
+    uint sceneCount;
+    uint measuredFrames;
+    float thresholds[BENCH_METRIC_COUNT]; // Percent
+
+    uint scene; // Being run
+    uint frame; // Within the scene, warmup included
+    double frameStart;
+    float cpuTime; // Of the current frame, up to the swap
+
+    uint gpuQueries[BENCH_GPU_QUERIES];
+    bool gpuQueryPending[BENCH_GPU_QUERIES];
+    bool gpuQueryMeasured[BENCH_GPU_QUERIES]; // Issued after the warmup
+    uint nextGpuQuery;
+    bool gpuQueryActive;
+};
+
+static BenchRunner g_bench;
+
+// Before the arguments are parsed, doesn't touch GL
+static void
+initBenchRunner(BenchRunner* runner) {
+    runner->measuredFrames = BENCH_DEFAULT_FRAMES;
+    for (int i = 0; i < BENCH_METRIC_COUNT; i++) runner->thresholds[i] = BENCH_DEFAULT_THRESHOLD;
+}
+
+static void
+setBenchFrames(BenchRunner* runner, uint measuredFrames) {
+    runner->measuredFrames = glm::clamp(measuredFrames, 1u, (uint)FRAME_HISTORY_SIZE);
+}
+
+// "metric:percent" sets one metric's threshold, a bare percentage sets all of them
+static bool
+parseBenchThreshold(BenchRunner* runner, const char* arg) {
+    const char* colon = strchr(arg, ':');
+    if (!colon) {
+        float threshold = (float)atof(arg);
+        for (int i = 0; i < BENCH_METRIC_COUNT; i++) runner->thresholds[i] = threshold;
+        return true;
+    }
+    for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+        if (strlen(benchMetricNames[i]) == (size_t)(colon - arg) && strncmp(arg, benchMetricNames[i], colon - arg) == 0) {
+            runner->thresholds[i] = (float)atof(colon + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds every scene whose name contains filter, all of them if it's empty
+static void
+addBenchScenes(BenchRunner* runner, const char* filter, Model* nanosuit, Model* sphere, Shader shader) {
+    const uint counts[] = { 1, 100, 10000, 100000 };
+    const char* countNames[] = { "1", "100", "10k", "100k" };
+    const char* layoutNames[] = { "grid", "scatter" };
+    for (int layout = 0; layout < arrayCount(layoutNames); layout++) {
+        for (int model = 0; model < 2; model++) {
+            for (int i = 0; i < arrayCount(counts); i++) {
+                BenchScene scene = {};
+                snprintf(scene.name, sizeof(scene.name), "%s-%s-%s", layoutNames[layout], countNames[i], model ? "sphere" : "nanosuit");
+                if (filter && filter[0] && !strstr(scene.name, filter)) continue;
+                scene.layout = (BenchLayout)layout;
+                scene.count = counts[i];
+                scene.model = model ? sphere : nanosuit;
+                scene.scale = model ? 0.5f : 0.3f;
+                scene.shader = shader;
+                runner->scenes[runner->sceneCount++] = scene;
+            }
+        }
+    }
+}
+
+// Half the width of the square the scene covers
+static float
+benchSceneExtent(BenchScene* scene) {
+    uint side = (uint)ceilf(sqrtf((float)scene->count));
+    return glm::max(side * BENCH_SPACING * 0.5f, 1.0f);
+}
+
+static void
+generateBenchScene(BenchScene* scene, std::vector<Entity>* entities, TransformHierarchy* transforms) {
+    entities->clear();
+    entities->reserve(scene->count);
+    clearTransforms(transforms);
+
+    uint side = (uint)ceilf(sqrtf((float)scene->count));
+    float extent = benchSceneExtent(scene);
+    uint random = 0x2545f491u ^ scene->count; // Same scatter every run
+    for (uint i = 0; i < scene->count; i++) {
+        glm::vec3 position;
+        float yaw = 0.0f;
+        if (scene->layout == BENCH_GRID) {
+            position = glm::vec3((i % side) * BENCH_SPACING - extent, 0.0f, (i / side) * BENCH_SPACING - extent);
+        } else {
+            float r[3];
+            for (int j = 0; j < 3; j++) {
+                random ^= random << 13;
+                random ^= random >> 17;
+                random ^= random << 5;
+                r[j] = (random & 0xffffff) / (float)0x1000000;
+            }
+            position = glm::vec3((r[0] * 2.0f - 1.0f) * extent, 0.0f, (r[1] * 2.0f - 1.0f) * extent);
+            yaw = r[2] * 2.0f * glm::pi<float>();
+        }
+
+        glm::mat4 matrix = glm::translate(glm::mat4(1.0f), position);
+        matrix = glm::rotate(matrix, yaw, glm::vec3(0.0f, 1.0f, 0.0f));
+        matrix = glm::scale(matrix, glm::vec3(scene->scale));
+        Entity entity = {};
+        entity.transform = createTransform(transforms, NO_TRANSFORM, matrix);
+        entity.model = scene->model;
+        entity.shader = scene->shader;
+        entity.visible = true;
+        entities->push_back(entity);
+    }
+}
+
+// t goes from 0 to 1 over the scene
+static void
+setBenchCamera(BenchScene* scene, float t, Camera* camera) {
+    float extent = benchSceneExtent(scene);
+    glm::vec3 target;
+    if (scene->layout == BENCH_GRID) {
+        // Low and diagonally across, looking ahead
+        float height = 4.0f + extent * 0.1f;
+        glm::vec3 start = glm::vec3(-extent - 5.0f, height, extent + 5.0f);
+        glm::vec3 end = glm::vec3(extent + 5.0f, height, -extent - 5.0f);
+        camera->position = glm::mix(start, end, t);
+        target = camera->position + glm::normalize(end - start) * 10.0f - glm::vec3(0.0f, height * 0.5f, 0.0f);
+    } else {
+        float angle = t * 2.0f * glm::pi<float>();
+        float radius = extent + 10.0f;
+        camera->position = glm::vec3(cosf(angle) * radius, 5.0f + extent * 0.3f, sinf(angle) * radius);
+        target = glm::vec3(0.0f);
+    }
+
+    glm::vec3 front = glm::normalize(target - camera->position);
+    camera->yaw = glm::degrees(atan2f(front.z, front.x));
+    camera->pitch = glm::degrees(asinf(front.y));
+    updateCameraVectors(camera);
+}
+
+static size_t
+processResidentBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.WorkingSetSize;
+#else
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file) return 0;
+    unsigned long pages = 0, residentPages = 0;
+    int read = fscanf(file, "%lu %lu", &pages, &residentPages);
+    fclose(file);
+    return read == 2 ? (size_t)residentPages * sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+static void
+readBenchGpuQueries(BenchRunner* runner, bool wait) {
+    BenchResult* result = &runner->results[runner->scene];
+    for (uint i = 0; i < BENCH_GPU_QUERIES; i++) {
+        if (!runner->gpuQueryPending[i]) continue;
+        GLint available = 0;
+        if (!wait) glGetQueryObjectiv(runner->gpuQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!wait && !available) continue;
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(runner->gpuQueries[i], GL_QUERY_RESULT, &elapsed);
+        if (runner->gpuQueryMeasured[i]) addTimingSample(&result->gpuTimes, (float)(elapsed / 1e9));
+        runner->gpuQueryPending[i] = false;
+    }
+}
+
+// Sets the scene and camera up for this frame, returns false once every scene has run
+static bool
+beginBenchFrame(BenchRunner* runner, std::vector<Entity>* entities, TransformHierarchy* transforms, Camera* camera) {
+    if (runner->scene >= runner->sceneCount) return false;
+    if (!runner->gpuQueries[0]) glGenQueries(BENCH_GPU_QUERIES, runner->gpuQueries);
+    BenchScene* scene = &runner->scenes[runner->scene];
+    if (runner->frame == 0) {
+        printf("Bench: %s\n", scene->name);
+        generateBenchScene(scene, entities, transforms);
+        resetSteadyState(&g_profiler);
+    }
+
+    uint totalFrames = BENCH_WARMUP_FRAMES + runner->measuredFrames;
+    setBenchCamera(scene, (float)runner->frame / (float)(totalFrames - 1), camera);
+    runner->frameStart = glfwGetTime();
+    return true;
+}
+
+// Around the frame's GL work, the GPU timer is skipped when every query is still in flight
+static void
+beginBenchRendering(BenchRunner* runner) {
+    uint query = runner->nextGpuQuery;
+    if (runner->gpuQueryPending[query]) return;
+    glBeginQuery(GL_TIME_ELAPSED, runner->gpuQueries[query]);
+    runner->gpuQueryActive = true;
+}
+
+// Right before the swap, so the CPU time doesn't include waiting for the display
+static void
+endBenchRendering(BenchRunner* runner) {
+    runner->cpuTime = (float)(glfwGetTime() - runner->frameStart);
+    if (!runner->gpuQueryActive) return;
+    glEndQuery(GL_TIME_ELAPSED);
+    uint query = runner->nextGpuQuery;
+    runner->gpuQueryPending[query] = true;
+    runner->gpuQueryMeasured[query] = runner->frame >= BENCH_WARMUP_FRAMES;
+    runner->nextGpuQuery = (query + 1) % BENCH_GPU_QUERIES;
+    runner->gpuQueryActive = false;
+}
+
+static void
+finishBenchScene(BenchRunner* runner) {
+    readBenchGpuQueries(runner, true);
+    BenchResult* result = &runner->results[runner->scene];
+    updateTimingPercentiles(&result->cpuTimes);
+    updateTimingPercentiles(&result->gpuTimes);
+
+    double frames = glm::max(result->frames, 1u);
+    result->metrics[BENCH_CPU_P50] = result->cpuTimes.p50 * 1000.0;
+    result->metrics[BENCH_CPU_P95] = result->cpuTimes.p95 * 1000.0;
+    result->metrics[BENCH_CPU_P99] = result->cpuTimes.p99 * 1000.0;
+    result->metrics[BENCH_GPU_P50] = result->gpuTimes.p50 * 1000.0;
+    result->metrics[BENCH_GPU_P95] = result->gpuTimes.p95 * 1000.0;
+    result->metrics[BENCH_GPU_P99] = result->gpuTimes.p99 * 1000.0;
+    result->metrics[BENCH_DRAW_CALLS] = result->drawCalls / frames;
+    result->metrics[BENCH_TRIANGLES] = result->triangles / frames;
+    result->metrics[BENCH_PEAK_RSS] = result->peakResidentBytes / (1024.0 * 1024.0);
+
+    printf("  cpu p50 %.2f ms, p95 %.2f ms | gpu p50 %.2f ms, p95 %.2f ms | %.0f draws, %.0f triangles\n",
+           result->metrics[BENCH_CPU_P50], result->metrics[BENCH_CPU_P95],
+           result->metrics[BENCH_GPU_P50], result->metrics[BENCH_GPU_P95],
+           result->metrics[BENCH_DRAW_CALLS], result->metrics[BENCH_TRIANGLES]);
+    runner->scene++;
+    runner->frame = 0;
+}
+
+// After the frame has been swapped and its allocations counted
+static void
+endBenchFrame(BenchRunner* runner, uint drawCalls, unsigned long long triangles, uint allocations) {
+    readBenchGpuQueries(runner, false);
+
+    BenchResult* result = &runner->results[runner->scene];
+    if (runner->frame >= BENCH_WARMUP_FRAMES) {
+        addTimingSample(&result->cpuTimes, runner->cpuTime);
+        result->frames++;
+        result->drawCalls += drawCalls;
+        result->triangles += triangles;
+        result->maxAllocations = glm::max(result->maxAllocations, allocations);
+        result->peakResidentBytes = glm::max(result->peakResidentBytes, processResidentBytes());
+        result->textureBytes = glm::max(result->textureBytes, g_textureStreamer.residentBytes);
+    }
+
+    runner->frame++;
+    if (runner->frame == BENCH_WARMUP_FRAMES + runner->measuredFrames) finishBenchScene(runner);
+}
+
+static bool
+writeBenchResults(BenchRunner* runner, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "ERROR::BENCH:: could not open %s\n", path);
+        return false;
+    }
+
+    fprintf(file, "{\n\"renderer\": \"%s\",\n\"job_threads\": %u,\n\"scenes\": [\n", (const char*)glGetString(GL_RENDERER), g_jobs.workerCount);
+    for (uint i = 0; i < runner->sceneCount; i++) {
+        BenchScene* scene = &runner->scenes[i];
+        BenchResult* result = &runner->results[i];
+        fprintf(file, "{\"name\": \"%s\", \"entities\": %u, \"frames\": %u", scene->name, scene->count, result->frames);
+        for (int metric = 0; metric < BENCH_METRIC_COUNT; metric++) {
+            fprintf(file, ", \"%s\": %.3f", benchMetricNames[metric], result->metrics[metric]);
+        }
+        fprintf(file, ", \"max_allocations\": %u, \"texture_mb\": %.1f}%s\n", result->maxAllocations,
+                result->textureBytes / (1024.0 * 1024.0), i + 1 < runner->sceneCount ? "," : "");
+    }
+    fprintf(file, "]\n}\n");
+    fclose(file);
+    printf("Bench results written to %s\n", path);
+    return true;
+}
+
+// Returns the number of metrics that regressed past their threshold
+static uint
+compareBenchBaseline(BenchRunner* runner, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "ERROR::BENCH:: could not open baseline %s\n", path);
+        return 1;
+    }
+
+    uint regressions = 0;
+    char line[2048];
+    while (fgets(line, sizeof(line), file)) {
+        const char* name = strstr(line, "\"name\": \"");
+        if (!name) continue;
+        name += 9;
+        const char* nameEnd = strchr(name, '"');
+        if (!nameEnd) continue;
+
+        BenchScene* scene = NULL;
+        BenchResult* result = NULL;
+        for (uint i = 0; i < runner->sceneCount; i++) {
+            if (strlen(runner->scenes[i].name) == (size_t)(nameEnd - name) && strncmp(runner->scenes[i].name, name, nameEnd - name) == 0) {
+                scene = &runner->scenes[i];
+                result = &runner->results[i];
+            }
+        }
+        if (!scene) continue;
+
+        for (int metric = 0; metric < BENCH_METRIC_COUNT; metric++) {
+            char key[64];
+            snprintf(key, sizeof(key), "\"%s\": ", benchMetricNames[metric]);
+            const char* value = strstr(line, key);
+            if (!value) continue;
+            double baseline = strtod(value + strlen(key), NULL);
+            double current = result->metrics[metric];
+            if (baseline <= 0.0) continue;
+            double change = (current - baseline) / baseline * 100.0;
+            if (change > runner->thresholds[metric]) {
+                printf("REGRESSION %s %s: %.3f -> %.3f (+%.1f%%, threshold %.1f%%)\n", scene->name, benchMetricNames[metric],
+                       baseline, current, change, runner->thresholds[metric]);
+                regressions++;
+            }
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+// Writes the results and checks them, returns the process exit code
+static int
+finishBench(BenchRunner* runner, const char* outPath, const char* baselinePath) {
+    int exitCode = 0;
+    if (runner->sceneCount == 0) {
+        fprintf(stderr, "ERROR::BENCH:: no scenes to run\n");
+        exitCode = 1;
+    } else if (runner->scene < runner->sceneCount) {
+        fprintf(stderr, "ERROR::BENCH:: stopped after %u of %u scenes\n", runner->scene, runner->sceneCount);
+        exitCode = 1;
+    }
+    if (!writeBenchResults(runner, outPath)) exitCode = 1;
+
+    for (uint i = 0; i < runner->scene; i++) {
+        if (runner->scenes[i].count == BENCH_ALLOCATION_CHECK_COUNT && runner->results[i].maxAllocations > 0) {
+            fprintf(stderr, "ERROR::BENCH:: %s allocated %u times in a frame, it has to run without allocating\n",
+                    runner->scenes[i].name, runner->results[i].maxAllocations);
+            exitCode = 1;
+        }
+    }
+
+    if (baselinePath) {
+        uint regressions = compareBenchBaseline(runner, baselinePath);
+        if (regressions) {
+            fprintf(stderr, "ERROR::BENCH:: %u metrics regressed against %s\n", regressions, baselinePath);
+            exitCode = 1;
+        } else {
+            printf("No regressions against %s\n", baselinePath);
+        }
+    }
+    return exitCode;
+}
@@ -20,7 +20,7 @@ struct Camera {
 };
 
 const float Camera::NearPlane = 0.1f;
-const float Camera::FarPlane  = 100.0f;
+const float Camera::FarPlane  = 1000.0f;
 
 static void updateCameraVectors(Camera* camera);
 
@@ -67,6 +67,25 @@ calculateViewMatrix(Camera* camera) {
     return viewMatrix;
 }
 
+// Same layout as CameraBlock in the shaders (std140)
+struct CameraUniforms {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec4 position;
+};
+
+// Writes the camera into the ring and binds it for every shader with a CameraBlock
+static void
+bindCameraUniforms(Camera* camera, GpuRing* ring) {
+    GpuRingAllocation allocation = allocGpuRing(ring, sizeof(CameraUniforms));
+    if (!allocation.data) return;
+    CameraUniforms* uniforms = (CameraUniforms*)allocation.data;
+    uniforms->projection = calculateProjectionMatrix(camera);
+    uniforms->view = calculateViewMatrix(camera);
+    uniforms->position = glm::vec4(camera->position, 1.0f);
+    glBindBufferRange(GL_UNIFORM_BUFFER, CAMERA_UNIFORM_BINDING, ring->buffer, allocation.offset, sizeof(CameraUniforms));
+}
+
 static void
 processKeyboard(Camera* camera, CameraMovement direction, float deltaTime) {
     float velocity = camera->movementSpeed * deltaTime;
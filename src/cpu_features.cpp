@@ -0,0 +1,161 @@
+// CPU feature detection.
+//
+// The build targets the baseline of the architecture, SSE2 on x86-64, so one
+// binary runs everywhere. The kernels that have versions for newer instruction
+// sets pick one at startup through function pointers, from the instruction set
+// found here: CPUID says what the CPU supports, and for AVX and AVX-512 XGETBV
+// also has to say the OS saves the wider registers.
+//
+// --isa=<name> caps the instruction set below what the CPU has, so every
+// version of a kernel can be run and compared on one machine. It's applied
+// before anything is loaded, the kernels are only picked once.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+enum CpuIsa {
+    CPU_ISA_SCALAR,
+    CPU_ISA_SSE2,
+    CPU_ISA_SSE41,
+    CPU_ISA_AVX,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512,
+    CPU_ISA_COUNT,
+};
+
+static const char* cpuIsaNames[CPU_ISA_COUNT] = {
+    "scalar",
+    "sse2",
+    "sse4.1",
+    "avx",
+    "avx2",
+    "avx512",
+};
+
+struct CpuFeatures {
+    CpuIsa detected;
+    CpuIsa active; // What the kernels are picked for, at most detected
+    bool fma;
+    char brand[49];
+};
+
+static CpuFeatures g_cpu;
+
+#if CPU_X86
+static void
+cpuid(uint leaf, uint subleaf, uint* registers) {
+#if defined(_MSC_VER)
+    __cpuidex((int*)registers, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Register state the OS saves on context switches
+static unsigned long long
+readXcr0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint low, high;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return ((unsigned long long)high << 32) | low;
+#endif
+}
+#endif
+
+static void
+detectCpuFeatures(CpuFeatures* cpu) {
+    *cpu = {};
+    cpu->detected = CPU_ISA_SCALAR;
+    strcpy(cpu->brand, "unknown");
+#if CPU_X86
+    uint registers[4];
+    cpuid(0, 0, registers);
+    uint maxLeaf = registers[0];
+    if (maxLeaf < 1) return;
+
+    cpuid(1, 0, registers);
+    uint ecx1 = registers[2];
+    uint edx1 = registers[3];
+    uint ebx7 = 0;
+    if (maxLeaf >= 7) {
+        cpuid(7, 0, registers);
+        ebx7 = registers[1];
+    }
+    bool osxsave = (ecx1 >> 27) & 1;
+    unsigned long long xcr0 = osxsave ? readXcr0() : 0;
+    bool avxState = (xcr0 & 0x6) == 0x6;         // SSE and AVX registers
+    bool avx512State = (xcr0 & 0xe6) == 0xe6;    // Also the opmask and upper ZMM registers
+
+    if ((edx1 >> 26) & 1) cpu->detected = CPU_ISA_SSE2;
+    if (cpu->detected == CPU_ISA_SSE2 && ((ecx1 >> 19) & 1)) cpu->detected = CPU_ISA_SSE41;
+    if (cpu->detected == CPU_ISA_SSE41 && ((ecx1 >> 28) & 1) && avxState) cpu->detected = CPU_ISA_AVX;
+    if (cpu->detected == CPU_ISA_AVX && ((ebx7 >> 5) & 1)) cpu->detected = CPU_ISA_AVX2;
+    if (cpu->detected == CPU_ISA_AVX2 && ((ebx7 >> 16) & 1) && avx512State) cpu->detected = CPU_ISA_AVX512;
+    cpu->fma = ((ecx1 >> 12) & 1) && avxState;
+
+    cpuid(0x80000000, 0, registers);
+    if (registers[0] >= 0x80000004) {
+        for (uint i = 0; i < 3; i++) {
+            cpuid(0x80000002 + i, 0, (uint*)(cpu->brand + i * 16));
+        }
+        cpu->brand[48] = 0;
+    }
+#endif
+    cpu->active = cpu->detected;
+}
+
+static bool
+parseCpuIsa(const char* name, CpuIsa* isa) {
+    for (int i = 0; i < CPU_ISA_COUNT; i++) {
+        if (strcmp(name, cpuIsaNames[i]) == 0) {
+            *isa = (CpuIsa)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+limitCpuIsa(CpuFeatures* cpu, CpuIsa isa) {
+    if (isa > cpu->detected) {
+        fprintf(stderr, "This CPU only supports up to %s, not %s\n", cpuIsaNames[cpu->detected], cpuIsaNames[isa]);
+        isa = cpu->detected;
+    }
+    cpu->active = isa;
+}
+
+// Leading spaces are common in brand strings
+static const char*
+cpuBrand(const CpuFeatures* cpu) {
+    const char* brand = cpu->brand;
+    while (*brand == ' ') brand++;
+    return brand;
+}
+
+// Compiles the functions between CPU_TARGET_BEGIN("avx") and CPU_TARGET_END
+// for that instruction set, whatever the build targets, so they can use its
+// intrinsics. They may only be called when g_cpu says so. GCC would otherwise
+// fuse multiplies and adds where the instruction set has FMA, as AVX-512 does,
+// and those round differently from the other versions.
+#define CPU_PRAGMA(x) _Pragma(#x)
+#if defined(__clang__)
+#define CPU_TARGET_BEGIN(isa) CPU_PRAGMA(clang attribute push (__attribute__((target(isa))), apply_to = function))
+#define CPU_TARGET_END CPU_PRAGMA(clang attribute pop)
+#elif defined(__GNUC__)
+#define CPU_TARGET_BEGIN(isa) CPU_PRAGMA(GCC push_options) CPU_PRAGMA(GCC target(isa)) CPU_PRAGMA(GCC optimize("fp-contract=off"))
+#define CPU_TARGET_END CPU_PRAGMA(GCC pop_options)
+#else
+// MSVC lets any function use any intrinsic
+#define CPU_TARGET_BEGIN(isa)
+#define CPU_TARGET_END
+#endif
+
@@ -0,0 +1,100 @@
+// Entity indicators.
+//
+// While the entity editor is open every entity gets a marker, drawn on top of
+// everything. The markers are a single instanced draw of a model's mesh: the
+// entity positions are gathered into the instance ring in parallel, and the
+// vertex shader scales each instance by its distance so it covers the same
+// number of pixels however far away the entity is. Picking tests against the
+// same size through entityIndicatorRadius.
+
+#define ENTITY_INDICATOR_PIXEL_RADIUS 8.0f
+#define INDICATOR_CHUNK_SIZE 4096
+
+struct EntityIndicators {
+    uint VAO;
+    Mesh* mesh;       // Only the first mesh of the model is drawn
+    glm::vec3 center; // Of the mesh, in node space
+    float radius;
+    float pixelRadius;
+
+    // Positions gathered for the current frame, written straight into a ring buffer
+    glm::vec3* positions;
+    size_t positionOffset; // In the ring's GL buffer
+    uint count;
+    uint dropped; // Didn't fit in the ring, since the last gather
+};
+
+static EntityIndicators g_entityIndicators;
+
+static void
+initEntityIndicators(EntityIndicators* indicators, Model* model, float pixelRadius) {
+    Mesh* mesh = &model->meshes[0];
+    glm::vec3 extent = (mesh->bounds.max - mesh->bounds.min) * 0.5f;
+    indicators->mesh = mesh;
+    indicators->center = mesh->bounds.min + extent;
+    indicators->radius = glm::max(glm::max(extent.x, extent.y), glm::max(extent.z, 1e-6f));
+    indicators->pixelRadius = pixelRadius;
+
+    // Shares the mesh's buffers, only the positions are used
+    glGenVertexArrays(1, &indicators->VAO);
+    glBindVertexArray(indicators->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->VBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->EBO);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+
+    // The instance positions point into the ring, they are set when drawing
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(1, 1);
+    glBindVertexArray(0);
+}
+
+// World space radius of an indicator at this distance along the view direction,
+// must match indicator.vs
+static float
+entityIndicatorRadius(EntityIndicators* indicators, Camera* camera, float depth) {
+    float worldPerPixel = 2.0f * glm::max(depth, 0.0f) * tanf(glm::radians(camera->fov) * 0.5f) / g_renderContext.height;
+    return indicators->pixelRadius * worldPerPixel;
+}
+
+// Indicators that don't fit in the ring this frame are dropped, and counted in
+// dropped and the ring's overflow. Has to be called before the ring is flushed.
+static void
+gatherEntityIndicators(EntityIndicators* indicators, GpuRing* ring, const Entity* entities, uint entityCount, TransformHierarchy* transforms) {
+    GpuRingAllocation allocation;
+    indicators->count = allocGpuRingElements(ring, entityCount, sizeof(glm::vec3), &allocation);
+    indicators->positions = (glm::vec3*)allocation.data;
+    indicators->positionOffset = allocation.offset;
+    indicators->dropped = entityCount - indicators->count;
+
+    glm::vec3* positions = indicators->positions;
+    parallelFor(indicators->count, INDICATOR_CHUNK_SIZE, [positions, entities, transforms](uint first, uint last) {
+        for (uint i = first; i < last; i++) {
+            positions[i] = glm::vec3(worldMatrix(transforms, entities[i].transform)[3]);
+        }
+    });
+}
+
+// Draws and clears the indicators gathered for this frame, the ring has to be
+// flushed already. The camera comes from the camera uniform block.
+static void
+drawEntityIndicators(EntityIndicators* indicators, Shader shader, GpuRing* ring) {
+    if (indicators->count == 0) return;
+
+    use(shader);
+    setVec3(shader, SID("meshCenter"), indicators->center);
+    setFloat(shader, SID("meshRadius"), indicators->radius);
+    setFloat(shader, SID("pixelRadius"), indicators->pixelRadius);
+    setFloat(shader, SID("viewportHeight"), (float)g_renderContext.height);
+
+    setGlCapability(&g_glState, GL_CAPABILITY_DEPTH_TEST, false);
+    glBindVertexArray(indicators->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, ring->buffer);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)indicators->positionOffset);
+    MeshLod* lod = &indicators->mesh->lods[0];
+    glDrawElementsInstanced(GL_TRIANGLES, lod->indexCount, GL_UNSIGNED_INT, (void*)(lod->indexOffset * sizeof(uint)), indicators->count);
+    glBindVertexArray(0);
+    setGlCapability(&g_glState, GL_CAPABILITY_DEPTH_TEST, true);
+
+    indicators->count = 0;
+}
@@ -0,0 +1,228 @@
+// ImGui font atlas cache.
+//
+// Building the atlas rasterizes every glyph of every range with stb_truetype
+// and packs them with stb_rect_pack, which takes hundreds of milliseconds for
+// large fonts or CJK ranges. The finished atlas only depends on its inputs, so
+// it's written to a file after the first build and loaded from there on later
+// runs: the alpha pixels, each font's metrics and glyph table, and where the
+// custom rects were packed.
+//
+// The file is keyed by a hash of the inputs: the font data itself, not its
+// path, and every config field and atlas setting the build reads, plus the
+// sizes and ids of the custom rects. A file with a different key, ImGui
+// version or glyph layout is ignored and rebuilt over. Fonts still have to be
+// added as usual before loading, the cache only replaces Build().
+
+#define FONT_CACHE_MAGIC   0x43544e46 // "FNTC"
+#define FONT_CACHE_VERSION 1
+
+struct FontCacheHeader {
+    uint magic;
+    uint version;
+    uint imguiVersion;
+    uint glyphSize;
+    unsigned long long key;
+    int texWidth;
+    int texHeight;
+    float whitePixelUv[2];
+    uint fontCount;       // FontCacheFont[fontCount] follows the header
+    uint customRectCount; // Then unsigned short[2][customRectCount], x and y
+    // Then each font's glyphs, then the pixels
+};
+
+struct FontCacheFont {
+    float ascent;
+    float descent;
+    int metricsTotalSurface;
+    int configDataCount; // Sources that added glyphs, not every config merged into the font
+    uint glyphCount;
+};
+
+struct FontCacheStats {
+    bool loaded;   // False if the atlas was built
+    float seconds; // To load or build
+};
+
+static FontCacheStats g_fontCache;
+
+static inline unsigned long long
+hashFontCacheBytes(unsigned long long hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+static int
+fontAtlasIndex(const ImFontAtlas* atlas, const ImFont* font) {
+    for (int i = 0; i < atlas->Fonts.Size; i++) {
+        if (atlas->Fonts[i] == font) return i;
+    }
+    return -1;
+}
+
+#define HASH_FONT_CACHE_FIELD(hash, field) hashFontCacheBytes(hash, &(field), sizeof(field))
+
+static unsigned long long
+fontAtlasCacheKey(ImFontAtlas* atlas) {
+    unsigned long long hash = 14695981039346656037ull;
+    hash = HASH_FONT_CACHE_FIELD(hash, atlas->Flags);
+    hash = HASH_FONT_CACHE_FIELD(hash, atlas->TexDesiredWidth);
+    hash = HASH_FONT_CACHE_FIELD(hash, atlas->TexGlyphPadding);
+    for (int i = 0; i < atlas->ConfigData.Size; i++) {
+        const ImFontConfig* config = &atlas->ConfigData[i];
+        hash = hashFontCacheBytes(hash, config->FontData, (size_t)config->FontDataSize);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->FontNo);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->SizePixels);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->OversampleH);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->OversampleV);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->PixelSnapH);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->GlyphExtraSpacing);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->GlyphOffset);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->GlyphMinAdvanceX);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->GlyphMaxAdvanceX);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->MergeMode);
+        hash = HASH_FONT_CACHE_FIELD(hash, config->RasterizerMultiply);
+        const ImWchar* ranges = config->GlyphRanges ? config->GlyphRanges : atlas->GetGlyphRangesDefault();
+        for (; ranges[0] && ranges[1]; ranges += 2) hash = hashFontCacheBytes(hash, ranges, 2 * sizeof(ImWchar));
+        int font = fontAtlasIndex(atlas, config->DstFont);
+        hash = HASH_FONT_CACHE_FIELD(hash, font);
+    }
+    for (int i = 0; i < atlas->CustomRects.Size; i++) {
+        const ImFontAtlas::CustomRect* rect = &atlas->CustomRects[i];
+        hash = HASH_FONT_CACHE_FIELD(hash, rect->ID);
+        hash = HASH_FONT_CACHE_FIELD(hash, rect->Width);
+        hash = HASH_FONT_CACHE_FIELD(hash, rect->Height);
+        hash = HASH_FONT_CACHE_FIELD(hash, rect->GlyphAdvanceX);
+        hash = HASH_FONT_CACHE_FIELD(hash, rect->GlyphOffset);
+        int font = fontAtlasIndex(atlas, rect->Font);
+        hash = HASH_FONT_CACHE_FIELD(hash, font);
+    }
+    return hash;
+}
+
+// Everything is read before the atlas is touched, so a bad file leaves it as it was
+static bool
+loadFontAtlasCache(ImFontAtlas* atlas, const char* path, unsigned long long key) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    FontCacheHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != FONT_CACHE_MAGIC || header.version != FONT_CACHE_VERSION
+        || header.imguiVersion != IMGUI_VERSION_NUM || header.glyphSize != sizeof(ImFontGlyph) || header.key != key
+        || header.fontCount != (uint)atlas->Fonts.Size || header.customRectCount != (uint)atlas->CustomRects.Size
+        || header.texWidth <= 0 || header.texHeight <= 0) {
+        fclose(file);
+        return false;
+    }
+
+    ImVector<FontCacheFont> fonts;
+    ImVector<unsigned short> rectPositions;
+    ImVector<ImFontGlyph> glyphs;
+    fonts.resize(header.fontCount);
+    rectPositions.resize(header.customRectCount * 2);
+    bool read = fread(fonts.Data, sizeof(FontCacheFont), fonts.Size, file) == (size_t)fonts.Size
+             && fread(rectPositions.Data, sizeof(unsigned short), rectPositions.Size, file) == (size_t)rectPositions.Size;
+    uint glyphCount = 0;
+    for (int i = 0; read && i < fonts.Size; i++) glyphCount += fonts[i].glyphCount;
+    size_t pixelCount = (size_t)header.texWidth * header.texHeight;
+    unsigned char* pixels = NULL;
+    if (read) {
+        glyphs.resize(glyphCount);
+        pixels = (unsigned char*)ImGui::MemAlloc(pixelCount);
+        read = fread(glyphs.Data, sizeof(ImFontGlyph), glyphCount, file) == glyphCount
+            && fread(pixels, 1, pixelCount, file) == pixelCount;
+    }
+    fclose(file);
+    if (!read) {
+        if (pixels) ImGui::MemFree(pixels);
+        fprintf(stderr, "ERROR::FONT_CACHE:: %s is truncated\n", path);
+        return false;
+    }
+
+    // What ImFontAtlasBuildWithStbTruetype and ImFontAtlasBuildFinish leave behind
+    atlas->ClearTexData();
+    atlas->TexID = (ImTextureID)NULL;
+    atlas->TexPixelsAlpha8 = pixels;
+    atlas->TexWidth = header.texWidth;
+    atlas->TexHeight = header.texHeight;
+    atlas->TexUvScale = ImVec2(1.0f / atlas->TexWidth, 1.0f / atlas->TexHeight);
+    atlas->TexUvWhitePixel = ImVec2(header.whitePixelUv[0], header.whitePixelUv[1]);
+    for (int i = 0; i < atlas->CustomRects.Size; i++) {
+        atlas->CustomRects[i].X = rectPositions[i * 2];
+        atlas->CustomRects[i].Y = rectPositions[i * 2 + 1];
+    }
+    for (int i = 0; i < atlas->ConfigData.Size; i++) {
+        ImFontConfig* config = &atlas->ConfigData[i];
+        const FontCacheFont* font = &fonts[fontAtlasIndex(atlas, config->DstFont)];
+        ImFontAtlasBuildSetupFont(atlas, config->DstFont, config, font->ascent, font->descent);
+    }
+    // The glyphs already have spacing and snapping baked in, so they're copied rather than added
+    const ImFontGlyph* glyph = glyphs.Data;
+    for (int i = 0; i < atlas->Fonts.Size; i++) {
+        ImFont* font = atlas->Fonts[i];
+        font->Glyphs.resize(fonts[i].glyphCount);
+        if (fonts[i].glyphCount) memcpy(font->Glyphs.Data, glyph, fonts[i].glyphCount * sizeof(ImFontGlyph));
+        glyph += fonts[i].glyphCount;
+        font->MetricsTotalSurface = fonts[i].metricsTotalSurface;
+        font->ConfigDataCount = fonts[i].configDataCount;
+        font->BuildLookupTable();
+    }
+    return true;
+}
+
+static bool
+saveFontAtlasCache(const ImFontAtlas* atlas, const char* path, unsigned long long key) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "ERROR::FONT_CACHE:: could not open %s for writing\n", path);
+        return false;
+    }
+    FontCacheHeader header = {};
+    header.magic = FONT_CACHE_MAGIC;
+    header.version = FONT_CACHE_VERSION;
+    header.imguiVersion = IMGUI_VERSION_NUM;
+    header.glyphSize = sizeof(ImFontGlyph);
+    header.key = key;
+    header.texWidth = atlas->TexWidth;
+    header.texHeight = atlas->TexHeight;
+    header.whitePixelUv[0] = atlas->TexUvWhitePixel.x;
+    header.whitePixelUv[1] = atlas->TexUvWhitePixel.y;
+    header.fontCount = atlas->Fonts.Size;
+    header.customRectCount = atlas->CustomRects.Size;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; i < atlas->Fonts.Size; i++) {
+        const ImFont* font = atlas->Fonts[i];
+        FontCacheFont cached = {font->Ascent, font->Descent, font->MetricsTotalSurface, font->ConfigDataCount, (uint)font->Glyphs.Size};
+        written = written && fwrite(&cached, sizeof(cached), 1, file) == 1;
+    }
+    for (int i = 0; i < atlas->CustomRects.Size; i++) {
+        unsigned short position[2] = {atlas->CustomRects[i].X, atlas->CustomRects[i].Y};
+        written = written && fwrite(position, sizeof(position), 1, file) == 1;
+    }
+    for (int i = 0; i < atlas->Fonts.Size; i++) {
+        const ImVector<ImFontGlyph>& glyphs = atlas->Fonts[i]->Glyphs;
+        written = written && fwrite(glyphs.Data, sizeof(ImFontGlyph), glyphs.Size, file) == (size_t)glyphs.Size;
+    }
+    size_t pixelCount = (size_t)atlas->TexWidth * atlas->TexHeight;
+    written = written && fwrite(atlas->TexPixelsAlpha8, 1, pixelCount, file) == pixelCount;
+    fclose(file);
+    if (!written) fprintf(stderr, "ERROR::FONT_CACHE:: could not write %s\n", path);
+    return written;
+}
+
+// Call after the fonts are added and before the first frame, in place of the
+// build ImGui would otherwise do when the backend first asks for the texture
+static void
+buildFontAtlasCached(ImFontAtlas* atlas, const char* path) {
+    double start = glfwGetTime();
+    if (atlas->ConfigData.empty()) atlas->AddFontDefault();
+    ImFontAtlasBuildRegisterDefaultCustomRects(atlas);
+    unsigned long long key = fontAtlasCacheKey(atlas);
+    g_fontCache.loaded = loadFontAtlasCache(atlas, path, key);
+    if (!g_fontCache.loaded) {
+        atlas->Build();
+        saveFontAtlasCache(atlas, path, key);
+    }
+    g_fontCache.seconds = (float)(glfwGetTime() - start);
+    printf("Font atlas: %dx%d, %s in %.2f ms\n", atlas->TexWidth, atlas->TexHeight,
+           g_fontCache.loaded ? "loaded from cache" : "built", g_fontCache.seconds * 1000.f);
+}
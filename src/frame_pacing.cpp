@@ -0,0 +1,264 @@
+// Frame pacing and latency measurement.
+//
+// The pacing mode decides what paces the main loop: the display (vsync, or
+// adaptive vsync that tears instead of waiting when a frame is late), a frame
+// cap, or nothing at all for benchmarks. The cap sleeps until shortly before
+// the next frame is due and spins the rest of the way, since sleeps are only
+// accurate to a millisecond or so.
+//
+// Latency is measured from when input was sampled to when the GPU got past the
+// frame's swap, both on the GPU clock: the GPU time is read when the input is
+// sampled and a timestamp query is issued after the swap. The queries are read
+// back a few frames later without waiting on them. It doesn't include the time
+// the display takes to scan out, so it's a lower bound on input to photon.
+//
+// On demand, the loop only draws when something asks for a frame, and otherwise
+// sleeps in glfwWaitEventsTimeout. Input asks for REDRAW_TRAILING_FRAMES, so
+// ImGui can settle hover states and finish what the input started. Held keys,
+// picks in flight and texture uploads ask for one frame at a time, the text
+// cursor asks for one at a set time, and async work finishing on another thread
+// posts an empty event to wake the loop up. Benchmarks and replays draw
+// continuously.
+
+#include <thread>
+#include <chrono>
+
+enum FramePacingMode {
+    FRAME_PACING_VSYNC,
+    FRAME_PACING_ADAPTIVE,
+    FRAME_PACING_CAPPED,
+    FRAME_PACING_UNCAPPED,
+    FRAME_PACING_MODE_COUNT,
+};
+
+static const char* framePacingModeNames[FRAME_PACING_MODE_COUNT] = {
+    "vsync",
+    "adaptive",
+    "capped",
+    "uncapped",
+};
+
+#define FRAME_HISTORY_SIZE 512
+#define LATENCY_QUERY_COUNT 8
+#define FRAME_LIMITER_SPIN_TIME 0.002 // Seconds before the deadline to stop sleeping
+#define REDRAW_TRAILING_FRAMES 3
+#define REDRAW_TEXT_CURSOR_INTERVAL 0.2 // Seconds, often enough for ImGui's cursor blink
+
+struct TimingHistory {
+    float samples[FRAME_HISTORY_SIZE]; // Seconds
+    uint count;
+    uint next;
+
+    // Of the samples in the history
+    float p50;
+    float p95;
+    float p99;
+    float max;
+};
+
+struct FramePacer {
+    FramePacingMode mode;
+    FramePacingMode appliedMode; // Swap interval currently set
+    bool applied;
+    float capFps;
+    bool lateInput; // Sample camera input right before rendering instead of at the start of the frame
+
+    double lastFrameStart;
+    long long inputGpuTime; // GPU timestamp of this frame's input, nanoseconds
+
+    uint queries[LATENCY_QUERY_COUNT];
+    long long queryInputTimes[LATENCY_QUERY_COUNT];
+    bool queryPending[LATENCY_QUERY_COUNT];
+    uint nextQuery;
+
+    TimingHistory frameTimes;
+    TimingHistory latencies;
+};
+
+static FramePacer g_framePacer;
+
+struct RedrawState {
+    bool onDemand;
+    uint pendingFrames;
+    double wakeTime; // When a frame is due regardless, 0 for never
+    std::atomic<bool> asyncRequested;
+
+    // Stats
+    float lastWaitTime; // Seconds slept before the current frame
+    uint drawnFrames;   // Since init
+    uint idleWakeUps;   // Woken without anything to draw, since init
+};
+
+static RedrawState g_redraw;
+
+static bool
+parseFramePacingMode(const char* name, FramePacingMode* mode) {
+    for (int i = 0; i < FRAME_PACING_MODE_COUNT; i++) {
+        if (strcmp(name, framePacingModeNames[i]) == 0) {
+            *mode = (FramePacingMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+initFramePacer(FramePacer* pacer, FramePacingMode mode, float capFps) {
+    pacer->mode = mode;
+    pacer->capFps = capFps;
+    pacer->applied = false;
+    pacer->lastFrameStart = glfwGetTime();
+    glGenQueries(LATENCY_QUERY_COUNT, pacer->queries);
+}
+
+static void
+addTimingSample(TimingHistory* history, float sample) {
+    history->samples[history->next] = sample;
+    history->next = (history->next + 1) % FRAME_HISTORY_SIZE;
+    if (history->count < FRAME_HISTORY_SIZE) history->count++;
+}
+
+static void
+updateTimingPercentiles(TimingHistory* history) {
+    if (history->count == 0) return;
+    ScratchScope scratch;
+    float* sorted = pushArray(scratch.arena(), float, history->count);
+    memcpy(sorted, history->samples, history->count * sizeof(float));
+    std::sort(sorted, sorted + history->count);
+    history->p50 = sorted[(history->count - 1) * 50 / 100];
+    history->p95 = sorted[(history->count - 1) * 95 / 100];
+    history->p99 = sorted[(history->count - 1) * 99 / 100];
+    history->max = sorted[history->count - 1];
+}
+
+static void
+applySwapInterval(FramePacer* pacer) {
+    int interval = 0;
+    if (pacer->mode == FRAME_PACING_VSYNC) {
+        interval = 1;
+    } else if (pacer->mode == FRAME_PACING_ADAPTIVE) {
+        // Negative intervals tear late frames instead of waiting a whole refresh for them
+        bool tearSupported = glfwExtensionSupported("WGL_EXT_swap_control_tear") || glfwExtensionSupported("GLX_EXT_swap_control_tear");
+        interval = tearSupported ? -1 : 1;
+    }
+    glfwSwapInterval(interval);
+    pacer->appliedMode = pacer->mode;
+    pacer->applied = true;
+}
+
+// Waits until the frame is due, when capped, and records how long the last frame took
+static void
+beginPacedFrame(FramePacer* pacer) {
+    if (!pacer->applied || pacer->appliedMode != pacer->mode) applySwapInterval(pacer);
+
+    if (pacer->mode == FRAME_PACING_CAPPED && pacer->capFps > 0.0f) {
+        double deadline = pacer->lastFrameStart + 1.0 / pacer->capFps;
+        double now = glfwGetTime();
+        if (deadline - now > FRAME_LIMITER_SPIN_TIME) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(deadline - now - FRAME_LIMITER_SPIN_TIME));
+        }
+        while (glfwGetTime() < deadline) {}
+    }
+
+    double now = glfwGetTime();
+    addTimingSample(&pacer->frameTimes, (float)(now - pacer->lastFrameStart));
+    updateTimingPercentiles(&pacer->frameTimes);
+    pacer->lastFrameStart = now;
+}
+
+// Called right after polling the input the frame will render with
+static void
+markInputSampled(FramePacer* pacer) {
+    GLint64 gpuTime = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+    pacer->inputGpuTime = gpuTime;
+}
+
+// Called right after swapping buffers
+static void
+endPacedFrame(FramePacer* pacer) {
+    bool added = false;
+    for (uint i = 0; i < LATENCY_QUERY_COUNT; i++) {
+        if (!pacer->queryPending[i]) continue;
+        GLint available = 0;
+        glGetQueryObjectiv(pacer->queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+        GLint64 presentTime = 0;
+        glGetQueryObjecti64v(pacer->queries[i], GL_QUERY_RESULT, &presentTime);
+        addTimingSample(&pacer->latencies, (float)((presentTime - pacer->queryInputTimes[i]) / 1e9));
+        pacer->queryPending[i] = false;
+        added = true;
+    }
+    if (added) updateTimingPercentiles(&pacer->latencies);
+
+    // If the GPU is so far behind that every query is in flight this frame isn't measured
+    uint query = pacer->nextQuery;
+    if (pacer->queryPending[query]) return;
+    glQueryCounter(pacer->queries[query], GL_TIMESTAMP);
+    pacer->queryInputTimes[query] = pacer->inputGpuTime;
+    pacer->queryPending[query] = true;
+    pacer->nextQuery = (query + 1) % LATENCY_QUERY_COUNT;
+}
+
+static void
+initRedraw(RedrawState* redraw, bool onDemand) {
+    redraw->onDemand = onDemand;
+    redraw->pendingFrames = REDRAW_TRAILING_FRAMES;
+    redraw->wakeTime = 0.0;
+    redraw->asyncRequested = false;
+}
+
+// Main thread only
+static void
+requestRedraw(RedrawState* redraw, uint frames) {
+    redraw->pendingFrames = glm::max(redraw->pendingFrames, frames);
+}
+
+static void
+requestRedrawAt(RedrawState* redraw, double time) {
+    if (redraw->wakeTime == 0.0 || time < redraw->wakeTime) redraw->wakeTime = time;
+}
+
+// From any thread, for work that finishes in the background
+static void
+requestRedrawAsync(RedrawState* redraw) {
+    redraw->asyncRequested = true;
+    glfwPostEmptyEvent();
+}
+
+// Blocks until a frame is wanted or the window is closing. The GLFW callbacks
+// run while it waits. Returns true if it slept, the sleep doesn't count as a
+// frame time, so the caller should restart anything that times frames.
+static bool
+waitForRedraw(RedrawState* redraw, FramePacer* pacer, GLFWwindow* window) {
+    redraw->lastWaitTime = 0.f;
+    if (!redraw->onDemand) {
+        redraw->drawnFrames++;
+        return false;
+    }
+
+    double start = glfwGetTime();
+    bool waited = false;
+    for (;;) {
+        if (redraw->asyncRequested.exchange(false)) requestRedraw(redraw, 1);
+        double now = glfwGetTime();
+        if (redraw->wakeTime != 0.0 && now >= redraw->wakeTime) {
+            redraw->wakeTime = 0.0;
+            requestRedraw(redraw, 1);
+        }
+        if (redraw->pendingFrames > 0 || glfwWindowShouldClose(window)) break;
+
+        if (waited) redraw->idleWakeUps++;
+        if (redraw->wakeTime != 0.0) glfwWaitEventsTimeout(redraw->wakeTime - now);
+        else glfwWaitEvents();
+        waited = true;
+    }
+    if (redraw->pendingFrames > 0) redraw->pendingFrames--;
+    redraw->drawnFrames++;
+    if (waited) {
+        double now = glfwGetTime();
+        redraw->lastWaitTime = (float)(now - start);
+        pacer->lastFrameStart = now;
+    }
+    return waited;
+}
@@ -0,0 +1,108 @@
+// Shadow copy of the GL state that passes switch on and off.
+//
+// Fixed function state that one pass changes and the next one depends on goes
+// through the functions here instead of straight to GL. They skip calls that
+// wouldn't change anything, and since the cache always knows what is set,
+// nothing has to be read back with glGet or glIsEnabled, which can make the
+// driver synchronize. The UI pass relies on this to draw without backing up
+// and restoring state around itself.
+//
+// Programs, VAOs, buffers and textures aren't cached: every pass binds its own
+// right before drawing and doesn't expect anything to be left bound.
+
+enum GlCapability {
+    GL_CAPABILITY_BLEND,
+    GL_CAPABILITY_CULL_FACE,
+    GL_CAPABILITY_DEPTH_TEST,
+    GL_CAPABILITY_SCISSOR_TEST,
+    GL_CAPABILITY_COUNT,
+};
+
+static const GLenum glCapabilityEnums[GL_CAPABILITY_COUNT] = {
+    GL_BLEND,
+    GL_CULL_FACE,
+    GL_DEPTH_TEST,
+    GL_SCISSOR_TEST,
+};
+
+struct GlStateCache {
+    bool enabled[GL_CAPABILITY_COUNT];
+    GLenum blendEquation;
+    GLenum blendSource;
+    GLenum blendDestination;
+    GLenum polygonMode;
+    int viewport[4];
+    int scissor[4];
+
+    uint changes; // Calls that reached GL, since init
+};
+
+static GlStateCache g_glState;
+
+// Sets every cached piece of state, so the cache matches GL whatever was set before
+static void
+initGlStateCache(GlStateCache* state, int width, int height) {
+    *state = {};
+    for (int i = 0; i < GL_CAPABILITY_COUNT; i++) glDisable(glCapabilityEnums[i]);
+    state->blendEquation = GL_FUNC_ADD;
+    state->blendSource = GL_ONE;
+    state->blendDestination = GL_ZERO;
+    glBlendEquation(state->blendEquation);
+    glBlendFunc(state->blendSource, state->blendDestination);
+    state->polygonMode = GL_FILL;
+    glPolygonMode(GL_FRONT_AND_BACK, state->polygonMode);
+    state->viewport[2] = state->scissor[2] = width;
+    state->viewport[3] = state->scissor[3] = height;
+    glViewport(0, 0, width, height);
+    glScissor(0, 0, width, height);
+}
+
+static inline void
+setGlCapability(GlStateCache* state, GlCapability capability, bool enabled) {
+    if (state->enabled[capability] == enabled) return;
+    state->enabled[capability] = enabled;
+    if (enabled) glEnable(glCapabilityEnums[capability]);
+    else glDisable(glCapabilityEnums[capability]);
+    state->changes++;
+}
+
+static inline void
+setGlBlendFunc(GlStateCache* state, GLenum equation, GLenum source, GLenum destination) {
+    if (state->blendEquation != equation) {
+        state->blendEquation = equation;
+        glBlendEquation(equation);
+        state->changes++;
+    }
+    if (state->blendSource != source || state->blendDestination != destination) {
+        state->blendSource = source;
+        state->blendDestination = destination;
+        glBlendFunc(source, destination);
+        state->changes++;
+    }
+}
+
+static inline void
+setGlPolygonMode(GlStateCache* state, GLenum mode) {
+    if (state->polygonMode == mode) return;
+    state->polygonMode = mode;
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+    state->changes++;
+}
+
+static inline void
+setGlViewport(GlStateCache* state, int x, int y, int width, int height) {
+    int* v = state->viewport;
+    if (v[0] == x && v[1] == y && v[2] == width && v[3] == height) return;
+    v[0] = x; v[1] = y; v[2] = width; v[3] = height;
+    glViewport(x, y, width, height);
+    state->changes++;
+}
+
+static inline void
+setGlScissor(GlStateCache* state, int x, int y, int width, int height) {
+    int* s = state->scissor;
+    if (s[0] == x && s[1] == y && s[2] == width && s[3] == height) return;
+    s[0] = x; s[1] = y; s[2] = width; s[3] = height;
+    glScissor(x, y, width, height);
+    state->changes++;
+}
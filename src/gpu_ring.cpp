@@ -0,0 +1,158 @@
+// Ring buffers for data that changes every frame.
+//
+// A ring is one GL buffer split into GPU_RING_FRAMES regions, one per frame in
+// flight. Each frame allocates linearly from its region and ends with a fence,
+// and before a region is written again its fence is waited on, so the CPU never
+// overwrites data the GPU is still reading and the driver never has to copy or
+// synchronize behind our back.
+//
+// With GL 4.4 (or ARB_buffer_storage) the buffer is mapped once, persistent and
+// coherent, and allocations can be written from any thread. Otherwise the
+// frame's region is mapped unsynchronized at the start of the frame and has to
+// be unmapped with flushGpuRing before anything draws from it.
+//
+// Waiting on a fence means the GPU is a full GPU_RING_FRAMES frames behind,
+// those waits are counted as stalls.
+
+#define GPU_RING_FRAMES 3
+
+struct GpuRing {
+    uint buffer;
+    GLenum target;
+    bool persistent;
+    unsigned char* mapped; // Whole buffer when persistent, the current region otherwise
+    size_t frameSize;
+    size_t alignment;
+    uint frame; // Region being written
+    std::atomic<size_t> frameUsed;
+    GLsync fences[GPU_RING_FRAMES];
+    const char* name;
+
+    // Stats
+    uint stallCount;     // Since init
+    float lastStallTime; // Seconds waited at the start of the current frame
+    size_t peakUsed;
+    size_t overflowBytes; // Asked for this frame and not given
+};
+
+struct GpuRingAllocation {
+    void* data;    // NULL if the region is full
+    size_t offset; // In the GL buffer
+};
+
+static void
+initGpuRing(GpuRing* ring, GLenum target, size_t frameSize, size_t alignment, const char* name) {
+    ring->target = target;
+    ring->frameSize = (frameSize + alignment - 1) & ~(alignment - 1);
+    ring->alignment = alignment;
+    ring->frame = 0;
+    ring->frameUsed = 0;
+    ring->name = name;
+    for (int i = 0; i < GPU_RING_FRAMES; i++) ring->fences[i] = 0;
+
+    size_t size = ring->frameSize * GPU_RING_FRAMES;
+    glGenBuffers(1, &ring->buffer);
+    glBindBuffer(target, ring->buffer);
+    ring->persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+    if (ring->persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(target, size, NULL, flags);
+        ring->mapped = (unsigned char*)glMapBufferRange(target, 0, size, flags);
+        if (!ring->mapped) {
+            std::cout << "ERROR::GPU_RING:: could not map " << name << " persistently, using unsynchronized maps" << std::endl;
+            glDeleteBuffers(1, &ring->buffer);
+            glGenBuffers(1, &ring->buffer);
+            glBindBuffer(target, ring->buffer);
+            ring->persistent = false;
+        }
+    }
+    if (!ring->persistent) {
+        glBufferData(target, size, NULL, GL_STREAM_DRAW);
+        ring->mapped = NULL;
+    }
+    glBindBuffer(target, 0);
+}
+
+// Moves on to the next region, waiting for the GPU to finish with it first
+static void
+beginGpuRingFrame(GpuRing* ring) {
+    ring->frame = (ring->frame + 1) % GPU_RING_FRAMES;
+    ring->frameUsed = 0;
+    ring->overflowBytes = 0;
+    ring->lastStallTime = 0.f;
+
+    GLsync fence = ring->fences[ring->frame];
+    if (fence) {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            double startTime = glfwGetTime();
+            GLenum result;
+            do {
+                result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1ms
+            } while (result == GL_TIMEOUT_EXPIRED);
+            ring->lastStallTime = (float)(glfwGetTime() - startTime);
+            ring->stallCount++;
+        }
+        glDeleteSync(fence);
+        ring->fences[ring->frame] = 0;
+    }
+
+    if (!ring->persistent) {
+        glBindBuffer(ring->target, ring->buffer);
+        ring->mapped = (unsigned char*)glMapBufferRange(ring->target, ring->frame * ring->frameSize, ring->frameSize,
+                                                        GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        glBindBuffer(ring->target, 0);
+    }
+}
+
+// Bytes that can still be allocated this frame
+static size_t
+gpuRingSpace(GpuRing* ring) {
+    size_t used = ring->frameUsed.load(std::memory_order_relaxed);
+    return used < ring->frameSize ? ring->frameSize - used : 0;
+}
+
+// Safe to call from any thread between beginGpuRingFrame and flushGpuRing
+static GpuRingAllocation
+allocGpuRing(GpuRing* ring, size_t size) {
+    GpuRingAllocation result = {};
+    size_t alignedSize = (size + ring->alignment - 1) & ~(ring->alignment - 1);
+    size_t offset = ring->frameUsed.fetch_add(alignedSize, std::memory_order_relaxed);
+    if (offset + size > ring->frameSize || !ring->mapped) {
+        ring->overflowBytes += size; // Only a stat, a lost update doesn't matter
+        return result;
+    }
+
+    result.offset = ring->frame * ring->frameSize + offset;
+    result.data = ring->mapped + (ring->persistent ? result.offset : offset);
+    return result;
+}
+
+// Allocates as many of count elements as fit in what is left of the frame,
+// the ones that don't are counted as overflow. Returns how many fit.
+static uint
+allocGpuRingElements(GpuRing* ring, uint count, size_t elementSize, GpuRingAllocation* allocation) {
+    uint fits = (uint)glm::min((size_t)count, gpuRingSpace(ring) / elementSize);
+    ring->overflowBytes += (count - fits) * elementSize;
+    *allocation = allocGpuRing(ring, fits * elementSize);
+    return allocation->data ? fits : 0;
+}
+
+// Everything written this frame becomes visible to the GPU. Must be called
+// before drawing from the ring, nothing can be allocated after it this frame.
+static void
+flushGpuRing(GpuRing* ring) {
+    size_t used = glm::min(ring->frameUsed.load(std::memory_order_relaxed), ring->frameSize);
+    ring->peakUsed = glm::max(ring->peakUsed, used);
+    if (ring->persistent || !ring->mapped) return;
+
+    glBindBuffer(ring->target, ring->buffer);
+    glUnmapBuffer(ring->target);
+    glBindBuffer(ring->target, 0);
+    ring->mapped = NULL;
+}
+
+// After the last draw that reads this frame's region
+static void
+endGpuRingFrame(GpuRing* ring) {
+    ring->fences[ring->frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
@@ -0,0 +1,325 @@
+// GPU picking through an ID buffer.
+//
+// The recorded render commands that can cover the pixel under the cursor are
+// drawn a second time into an RG32UI target holding the entity index + 1 in R
+// and the mesh and triangle in G, with its own depth attachment. Which ones can
+// is decided on the CPU, by testing the ray through the pixel against each
+// mesh's world space bounds, so only the few meshes under the cursor are drawn.
+// The pass is scissored to that pixel, and the pixel is copied into a pixel
+// pack buffer with a fence behind it. The copy is read once its fence has
+// passed, a frame or two later, so picking never waits on the GPU.
+//
+// The pass only runs when the answer can have changed: the cursor moved, the
+// view changed, the number of commands changed or a click is waiting. While the
+// UI has the mouse nothing is picked at all, see dropIdPicks.
+//
+// The newest readback that finished is the hover. A click marks the readback
+// issued in the frame after it, and is reported when that one finishes.
+
+#define ID_PICK_READBACKS 3 // Frames a readback can be in flight before the pass is skipped
+#define ID_PICK_MESH_SHIFT 24
+#define ID_PICK_TRIANGLE_MASK 0xffffffu
+#define ID_PICK_READBACK_SIZE (2 * sizeof(uint) + sizeof(float))
+
+struct IdPickResult {
+    bool hit;
+    uint entity;
+    uint mesh;
+    uint triangle;      // Within the LOD the entity was drawn with
+    float depth;        // Window space, 0 to 1
+    glm::vec3 position; // World space
+};
+
+struct IdPickReadback {
+    uint pbo;
+    GLsync fence; // 0 when the slot is free
+    bool click;
+    bool dropped; // Read back and thrown away, see dropIdPicks
+    glm::mat4 inverseViewProjection; // Of the frame that was picked
+    glm::vec2 ndc;                   // Of the pixel's center
+};
+
+struct IdPicker {
+    bool enabled;
+
+    uint framebuffer;
+    uint idTexture;
+    uint depthTexture;
+    uint width;
+    uint height;
+
+    Shader shader;
+    int modelLocation;
+    int entityLocation;
+    int meshLocation;
+
+    IdPickReadback readbacks[ID_PICK_READBACKS];
+    uint nextReadback; // Also the oldest one, if it's still in flight
+    bool clickRequested;
+
+    // What the last pass was drawn for, it's skipped while they stay the same
+    bool picked;
+    int lastX;
+    int lastY;
+    glm::mat4 lastViewProjection;
+    uint lastCommandCount;
+
+    IdPickResult hover;
+    IdPickResult click;
+    bool clickReady;   // Cleared by whoever handles the click
+    bool hoverChanged; // Hovered entity or mesh, in the last resolveIdPicks
+
+    uint skippedFrames; // Every readback was still in flight, since init
+    uint drawnCommands; // In the last pass, out of lastCommandCount
+};
+
+static IdPicker g_idPicker;
+
+static void
+initIdPicker(IdPicker* picker, Shader shader) {
+    picker->enabled = true;
+    picker->shader = shader;
+    picker->modelLocation = uniformLocation(shader, SID("model"));
+    picker->entityLocation = uniformLocation(shader, SID("entityId"));
+    picker->meshLocation = uniformLocation(shader, SID("meshId"));
+
+    for (int i = 0; i < ID_PICK_READBACKS; i++) {
+        IdPickReadback* readback = &picker->readbacks[i];
+        glGenBuffers(1, &readback->pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, ID_PICK_READBACK_SIZE, NULL, GL_STREAM_READ);
+        readback->fence = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+static void
+resizeIdPicker(IdPicker* picker, uint width, uint height) {
+    if (picker->framebuffer) {
+        glDeleteFramebuffers(1, &picker->framebuffer);
+        glDeleteTextures(1, &picker->idTexture);
+        glDeleteTextures(1, &picker->depthTexture);
+    }
+    picker->width = width;
+    picker->height = height;
+
+    glGenTextures(1, &picker->idTexture);
+    glBindTexture(GL_TEXTURE_2D, picker->idTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, width, height, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &picker->depthTexture);
+    glBindTexture(GL_TEXTURE_2D, picker->depthTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &picker->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, picker->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, picker->idTexture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, picker->depthTexture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "ERROR::ID_PICKING:: ID framebuffer is not complete, GPU picking is disabled" << std::endl;
+        picker->enabled = false;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+static inline void
+drawIdMesh(IdPicker* picker, Mesh* mesh, uint lod, const glm::mat4& world) {
+    glm::mat4 model = world * mesh->transform;
+    glUniformMatrix4fv(picker->modelLocation, 1, GL_FALSE, &model[0][0]);
+    glBindVertexArray(mesh->VAO);
+    MeshLod* meshLod = &mesh->lods[glm::min(lod, mesh->lodCount - 1)];
+    glDrawElements(GL_TRIANGLES, meshLod->indexCount, GL_UNSIGNED_INT, (void*)(meshLod->indexOffset * sizeof(uint)));
+}
+
+// Whether the segment from origin to origin + direction passes through the box
+static inline bool
+idPickSegmentHits(glm::vec3 origin, glm::vec3 inverseDirection, AABB bounds) {
+    glm::vec3 t0 = (bounds.min - origin) * inverseDirection;
+    glm::vec3 t1 = (bounds.max - origin) * inverseDirection;
+    glm::vec3 nearT = glm::min(t0, t1);
+    glm::vec3 farT = glm::max(t0, t1);
+    float enter = glm::max(glm::max(nearT.x, nearT.y), glm::max(nearT.z, 0.0f));
+    float exit = glm::min(glm::min(farT.x, farT.y), glm::min(farT.z, 1.0f));
+    return enter <= exit;
+}
+
+// Draws the pixel under the cursor into the ID buffer and starts reading it
+// back. The camera uniforms have to be bound already. Skipped when nothing it
+// depends on changed, or when every readback is still in flight rather than
+// waiting for one.
+static void
+drawIdBuffer(IdPicker* picker, RenderCommandBuffer* buffer, Entity* entities, TransformHierarchy* transforms, Camera* camera, float mouseX, float mouseY) {
+    if (!picker->enabled) return;
+    if (picker->width != g_renderContext.width || picker->height != g_renderContext.height) {
+        resizeIdPicker(picker, g_renderContext.width, g_renderContext.height);
+        if (!picker->enabled) return;
+    }
+
+    int x = (int)mouseX;
+    int y = (int)picker->height - 1 - (int)mouseY;
+    if (x < 0 || y < 0 || x >= (int)picker->width || y >= (int)picker->height) return;
+
+    glm::mat4 viewProjection = calculateProjectionMatrix(camera) * calculateViewMatrix(camera);
+    if (picker->picked && !picker->clickRequested && x == picker->lastX && y == picker->lastY
+        && viewProjection == picker->lastViewProjection && buffer->count == picker->lastCommandCount) {
+        return;
+    }
+
+    IdPickReadback* readback = &picker->readbacks[picker->nextReadback];
+    if (readback->fence) {
+        picker->skippedFrames++;
+        return;
+    }
+
+    // The part of the ray through the pixel's center between the near and far planes
+    glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+    glm::vec2 ndc = glm::vec2((x + 0.5f) / picker->width, (y + 0.5f) / picker->height) * 2.0f - 1.0f;
+    glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndc, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndc, 1.0f, 1.0f);
+    glm::vec3 rayOrigin = glm::vec3(nearPoint) / nearPoint.w;
+    glm::vec3 inverseRayDirection = 1.0f / (glm::vec3(farPoint) / farPoint.w - rayOrigin);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, picker->framebuffer);
+    setGlCapability(&g_glState, GL_CAPABILITY_SCISSOR_TEST, true);
+    setGlScissor(&g_glState, x, y, 1, 1);
+    const uint clearId[] = { 0, 0, 0, 0 };
+    const float clearDepth = 1.f;
+    glClearBufferuiv(GL_COLOR, 0, clearId);
+    glClearBufferfv(GL_DEPTH, 0, &clearDepth);
+
+    use(picker->shader);
+    picker->drawnCommands = 0;
+    for (uint i = 0; i < buffer->count; i++) {
+        RenderCommand* command = &buffer->commands[i];
+        Entity* entity = &entities[command->entity];
+        Model* model = entity->model;
+        const glm::mat4& world = worldMatrix(transforms, entity->transform);
+
+        if (command->mesh == RENDER_IMPOSTOR_MESH) {
+            // The impostor's silhouette comes from the model, the coarsest LOD is close enough
+            if (!idPickSegmentHits(rayOrigin, inverseRayDirection, transformAABB(model->bounds, world))) continue;
+            glUniform1ui(picker->entityLocation, command->entity + 1);
+            for (uint j = 0; j < model->meshes.size(); j++) {
+                Mesh* mesh = &model->meshes[j];
+                if (!idPickSegmentHits(rayOrigin, inverseRayDirection, transformAABB(mesh->bounds, world * mesh->transform))) continue;
+                glUniform1ui(picker->meshLocation, j);
+                drawIdMesh(picker, mesh, MAX_LODS - 1, world);
+            }
+            picker->drawnCommands++;
+            continue;
+        }
+        Mesh* mesh = &model->meshes[command->mesh];
+        if (!idPickSegmentHits(rayOrigin, inverseRayDirection, transformAABB(mesh->bounds, world * mesh->transform))) continue;
+        glUniform1ui(picker->entityLocation, command->entity + 1);
+        glUniform1ui(picker->meshLocation, command->mesh);
+        drawIdMesh(picker, mesh, command->lod, world);
+        picker->drawnCommands++;
+    }
+    glBindVertexArray(0);
+    setGlCapability(&g_glState, GL_CAPABILITY_SCISSOR_TEST, false);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(x, y, 1, 1, GL_RG_INTEGER, GL_UNSIGNED_INT, (void*)0);
+    glReadPixels(x, y, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, (void*)(2 * sizeof(uint)));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback->click = picker->clickRequested;
+    readback->dropped = false;
+    readback->inverseViewProjection = inverseViewProjection;
+    readback->ndc = ndc;
+    picker->clickRequested = false;
+    picker->picked = true;
+    picker->lastX = x;
+    picker->lastY = y;
+    picker->lastViewProjection = viewProjection;
+    picker->lastCommandCount = buffer->count;
+    picker->nextReadback = (picker->nextReadback + 1) % ID_PICK_READBACKS;
+}
+
+// Reads every readback whose fence has passed, oldest first, without waiting on the rest
+static void
+resolveIdPicks(IdPicker* picker) {
+    picker->hoverChanged = false;
+    for (uint i = 0; i < ID_PICK_READBACKS; i++) {
+        IdPickReadback* readback = &picker->readbacks[(picker->nextReadback + i) % ID_PICK_READBACKS];
+        if (!readback->fence) continue;
+        if (glClientWaitSync(readback->fence, 0, 0) == GL_TIMEOUT_EXPIRED) break;
+        glDeleteSync(readback->fence);
+        readback->fence = 0;
+        if (readback->dropped) continue;
+
+        unsigned char data[ID_PICK_READBACK_SIZE];
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+        glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, ID_PICK_READBACK_SIZE, data);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        uint ids[2];
+        memcpy(ids, data, sizeof(ids));
+
+        IdPickResult result = {};
+        result.hit = ids[0] != 0;
+        if (result.hit) {
+            result.entity = ids[0] - 1;
+            result.mesh = ids[1] >> ID_PICK_MESH_SHIFT;
+            result.triangle = ids[1] & ID_PICK_TRIANGLE_MASK;
+            memcpy(&result.depth, data + sizeof(ids), sizeof(float));
+            glm::vec4 position = readback->inverseViewProjection * glm::vec4(readback->ndc, result.depth * 2.0f - 1.0f, 1.0f);
+            result.position = glm::vec3(position) / position.w;
+        }
+
+        if (result.hit != picker->hover.hit || result.entity != picker->hover.entity || result.mesh != picker->hover.mesh) {
+            picker->hoverChanged = true;
+        }
+        picker->hover = result;
+        if (readback->click) {
+            picker->click = result;
+            picker->clickReady = true;
+        }
+    }
+}
+
+// A click that hasn't been drawn or read back yet
+static bool
+idPickClickPending(IdPicker* picker) {
+    if (picker->clickRequested) return true;
+    for (uint i = 0; i < ID_PICK_READBACKS; i++) {
+        if (picker->readbacks[i].fence && picker->readbacks[i].click) return true;
+    }
+    return false;
+}
+
+// For frames where the UI has the mouse: nothing is hovered or clicked, and the
+// picks still in flight are thrown away when they arrive
+static void
+dropIdPicks(IdPicker* picker) {
+    for (uint i = 0; i < ID_PICK_READBACKS; i++) {
+        IdPickReadback* readback = &picker->readbacks[i];
+        if (!readback->fence) continue;
+        readback->dropped = true;
+        readback->click = false;
+    }
+    if (picker->hover.hit) picker->hoverChanged = true;
+    picker->hover = {};
+    picker->clickRequested = false;
+    picker->picked = false; // Picks again when the mouse comes back, even if it didn't move
+}
+
+// Outlines the hovered entity, on top of the scene
+static void
+drawHoverHighlight(IdPicker* picker, Entity* entities, uint entityCount, TransformHierarchy* transforms, Shader shader) {
+    if (!picker->enabled || !picker->hover.hit || picker->hover.entity >= entityCount) return;
+
+    Entity* entity = &entities[picker->hover.entity];
+    setGlPolygonMode(&g_glState, GL_LINE);
+    glDepthFunc(GL_LEQUAL);
+    drawModel(entity->model, shader, entity->lod, worldMatrix(transforms, entity->transform));
+    glDepthFunc(GL_LESS);
+    setGlPolygonMode(&g_glState, GL_FILL);
+}
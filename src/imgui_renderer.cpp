@@ -0,0 +1,194 @@
+// ImGui rendering without per frame GL object churn.
+//
+// imgui_impl_opengl3 is written to drop into any engine: every frame it reads
+// back around twenty pieces of GL state, creates and deletes a VAO, uploads
+// each draw list with glBufferData and restores everything it touched. Here the
+// VAO is made once, the vertices and indices of the whole frame are written
+// into one GpuRing and drawn with base vertex offsets, and state goes through
+// g_glState, so nothing is read back. The backend's shader, font texture and
+// attribute locations are reused as they are.
+//
+// The stock path is kept for frames that don't fit in the ring, and for
+// comparison: --ui-stress opens a dense editor layout and --ui-stock switches
+// back to the stock path, so the two can be compared with the imgui profile
+// scope or, with --bench, in the frame times.
+
+#define IMGUI_RING_FRAME_SIZE (4 * 1024 * 1024)
+
+struct ImGuiRenderer {
+    bool cached; // Off uses ImGui_ImplOpenGL3_RenderDrawData
+    uint vao;    // Made on the first cached frame, when the backend's shader exists
+    GpuRing ring;
+
+    // Stats for the last frame
+    uint vertexCount;
+    uint indexCount;
+    uint drawCalls;
+    uint stateChanges;
+    uint fallbackFrames; // Since init, drawn by the stock path because the ring was full
+};
+
+static ImGuiRenderer g_imguiRenderer;
+
+static void
+initImGuiRenderer(ImGuiRenderer* renderer) {
+    renderer->cached = true;
+    renderer->vao = 0;
+    // Indices are 2 or 4 bytes, vertices are placed on a multiple of their size by hand
+    initGpuRing(&renderer->ring, GL_ARRAY_BUFFER, IMGUI_RING_FRAME_SIZE, 4, "imgui ring");
+}
+
+// The vertex layout reads from offset 0 of the ring, draws pick their vertices with a base vertex
+static void
+createImGuiVertexArray(ImGuiRenderer* renderer) {
+    glGenVertexArrays(1, &renderer->vao);
+    glBindVertexArray(renderer->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->ring.buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, renderer->ring.buffer);
+    glEnableVertexAttribArray(g_AttribLocationPosition);
+    glEnableVertexAttribArray(g_AttribLocationUV);
+    glEnableVertexAttribArray(g_AttribLocationColor);
+    glVertexAttribPointer(g_AttribLocationPosition, 2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert), (void*)IM_OFFSETOF(ImDrawVert, pos));
+    glVertexAttribPointer(g_AttribLocationUV, 2, GL_FLOAT, GL_FALSE, sizeof(ImDrawVert), (void*)IM_OFFSETOF(ImDrawVert, uv));
+    glVertexAttribPointer(g_AttribLocationColor, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ImDrawVert), (void*)IM_OFFSETOF(ImDrawVert, col));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void
+renderImGui(ImGuiRenderer* renderer, ImDrawData* drawData) {
+    renderer->vertexCount = drawData->TotalVtxCount;
+    renderer->indexCount = drawData->TotalIdxCount;
+    renderer->drawCalls = 0;
+    renderer->stateChanges = 0;
+    if (!renderer->cached) {
+        ImGui_ImplOpenGL3_RenderDrawData(drawData);
+        return;
+    }
+
+    ImGuiIO& io = ImGui::GetIO();
+    int width = (int)(drawData->DisplaySize.x * io.DisplayFramebufferScale.x);
+    int height = (int)(drawData->DisplaySize.y * io.DisplayFramebufferScale.y);
+    if (width <= 0 || height <= 0) return;
+    if (!renderer->vao) createImGuiVertexArray(renderer);
+
+    // One extra vertex of room to move the start onto a whole vertex
+    GpuRing* ring = &renderer->ring;
+    beginGpuRingFrame(ring);
+    GpuRingAllocation vertices = allocGpuRing(ring, (drawData->TotalVtxCount + 1) * sizeof(ImDrawVert));
+    GpuRingAllocation indices = allocGpuRing(ring, drawData->TotalIdxCount * sizeof(ImDrawIdx));
+    if (!vertices.data || !indices.data) {
+        flushGpuRing(ring);
+        endGpuRingFrame(ring);
+        renderer->fallbackFrames++;
+        ImGui_ImplOpenGL3_RenderDrawData(drawData);
+        return;
+    }
+    size_t skip = (sizeof(ImDrawVert) - vertices.offset % sizeof(ImDrawVert)) % sizeof(ImDrawVert);
+    ImDrawVert* vertexData = (ImDrawVert*)((unsigned char*)vertices.data + skip);
+    ImDrawIdx* indexData = (ImDrawIdx*)indices.data;
+    for (int i = 0; i < drawData->CmdListsCount; i++) {
+        const ImDrawList* list = drawData->CmdLists[i];
+        memcpy(vertexData, list->VtxBuffer.Data, list->VtxBuffer.Size * sizeof(ImDrawVert));
+        memcpy(indexData, list->IdxBuffer.Data, list->IdxBuffer.Size * sizeof(ImDrawIdx));
+        vertexData += list->VtxBuffer.Size;
+        indexData += list->IdxBuffer.Size;
+    }
+    flushGpuRing(ring);
+
+    uint changesBefore = g_glState.changes;
+    setGlCapability(&g_glState, GL_CAPABILITY_BLEND, true);
+    setGlBlendFunc(&g_glState, GL_FUNC_ADD, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    setGlCapability(&g_glState, GL_CAPABILITY_CULL_FACE, false);
+    setGlCapability(&g_glState, GL_CAPABILITY_DEPTH_TEST, false);
+    setGlCapability(&g_glState, GL_CAPABILITY_SCISSOR_TEST, true);
+    setGlPolygonMode(&g_glState, GL_FILL);
+    setGlViewport(&g_glState, 0, 0, width, height);
+
+    float l = drawData->DisplayPos.x;
+    float r = drawData->DisplayPos.x + drawData->DisplaySize.x;
+    float t = drawData->DisplayPos.y;
+    float b = drawData->DisplayPos.y + drawData->DisplaySize.y;
+    glm::mat4 projection = glm::ortho(l, r, b, t);
+    glUseProgram(g_ShaderHandle);
+    glUniform1i(g_AttribLocationTex, 0);
+    glUniformMatrix4fv(g_AttribLocationProjMtx, 1, GL_FALSE, &projection[0][0]);
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(renderer->vao);
+
+    ImVec2 origin = drawData->DisplayPos;
+    ImVec2 scale = io.DisplayFramebufferScale;
+    GLenum indexType = sizeof(ImDrawIdx) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    GLint baseVertex = (GLint)((vertices.offset + skip) / sizeof(ImDrawVert));
+    size_t indexOffset = indices.offset;
+    GLuint boundTexture = (GLuint)-1;
+    for (int i = 0; i < drawData->CmdListsCount; i++) {
+        const ImDrawList* list = drawData->CmdLists[i];
+        for (int j = 0; j < list->CmdBuffer.Size; j++) {
+            const ImDrawCmd* command = &list->CmdBuffer[j];
+            if (command->UserCallback) {
+                command->UserCallback(list, command);
+            } else {
+                float x0 = (command->ClipRect.x - origin.x) * scale.x;
+                float y0 = (command->ClipRect.y - origin.y) * scale.y;
+                float x1 = (command->ClipRect.z - origin.x) * scale.x;
+                float y1 = (command->ClipRect.w - origin.y) * scale.y;
+                if (x0 < width && y0 < height && x1 >= 0.0f && y1 >= 0.0f) {
+                    setGlScissor(&g_glState, (int)x0, (int)(height - y1), (int)(x1 - x0), (int)(y1 - y0));
+                    GLuint texture = (GLuint)(intptr_t)command->TextureId;
+                    if (texture != boundTexture) {
+                        glBindTexture(GL_TEXTURE_2D, texture);
+                        boundTexture = texture;
+                    }
+                    glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)command->ElemCount, indexType, (void*)indexOffset, baseVertex);
+                    renderer->drawCalls++;
+                }
+            }
+            indexOffset += command->ElemCount * sizeof(ImDrawIdx);
+        }
+        baseVertex += list->VtxBuffer.Size;
+    }
+    glBindVertexArray(0);
+    endGpuRingFrame(ring);
+
+    // What the scene passes expect at the start of the next frame
+    setGlCapability(&g_glState, GL_CAPABILITY_BLEND, false);
+    setGlCapability(&g_glState, GL_CAPABILITY_SCISSOR_TEST, false);
+    setGlCapability(&g_glState, GL_CAPABILITY_DEPTH_TEST, true);
+    renderer->stateChanges = g_glState.changes - changesBefore;
+}
+
+// Roughly what a busy editor shows at once, an outliner with several widgets
+// per row, laid out without a list clipper so every row is submitted
+static void
+drawUiStressWindow(bool* open) {
+    static float values[256][3];
+    static bool flags[256];
+    static float colors[256][3];
+    ImGui::SetNextWindowSize(ImVec2(900, 700), ImGuiCond_FirstUseEver);
+    if (!ImGui::Begin("UI stress", open)) {
+        ImGui::End();
+        return;
+    }
+    ImGui::Columns(3, "stress columns");
+    for (int i = 0; i < 256; i++) {
+        ImGui::PushID(i);
+        ImGui::Selectable("##row", false, ImGuiSelectableFlags_SpanAllColumns);
+        ImGui::SameLine();
+        ImGui::Text("Entity %03d", i);
+        ImGui::NextColumn();
+        ImGui::PushItemWidth(-1);
+        ImGui::DragFloat3("##position", values[i], 0.1f);
+        ImGui::PopItemWidth();
+        ImGui::NextColumn();
+        ImGui::Checkbox("##visible", &flags[i]);
+        ImGui::SameLine();
+        ImGui::ColorEdit3("##color", colors[i], ImGuiColorEditFlags_NoInputs);
+        ImGui::SameLine();
+        ImGui::ProgressBar((i % 17) / 16.0f, ImVec2(-1, 0));
+        ImGui::NextColumn();
+        ImGui::PopID();
+    }
+    ImGui::Columns(1);
+    ImGui::End();
+}
@@ -0,0 +1,190 @@
+// Octahedral impostors.
+//
+// A model is rendered from IMPOSTOR_FRAMES x IMPOSTOR_FRAMES directions spread
+// over the sphere with an octahedral mapping, into one atlas for the color and
+// one for the model space normal and depth. Far away entities then draw as a
+// single instanced quad each, which picks the baked view closest to the camera
+// direction and reconstructs depth from the atlas.
+
+#define IMPOSTOR_FRAMES     8   // Views per side of the octahedral grid
+#define IMPOSTOR_FRAME_SIZE 128 // Pixels per view
+
+struct Impostor {
+    uint colorTexture;       // RGB albedo, alpha is coverage
+    uint normalDepthTexture; // Model space normal in RGB, depth inside the bounding sphere in A
+    glm::vec3 center;        // Model space center of the bounds
+    float radius;
+
+    uint quadVAO;
+    // Model matrices gathered for the current frame, written straight into a ring buffer
+    glm::mat4* instances;
+    size_t instanceOffset; // In the ring's GL buffer
+    uint instanceCount;
+    uint maxInstances;
+    uint droppedInstances; // Didn't fit in the ring, since the last beginImpostorInstances
+};
+
+static inline float
+signNotZero(float v) {
+    return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+// Must match octDecode in impostor.vs
+static glm::vec3
+octDecode(glm::vec2 uv) {
+    glm::vec2 p = uv * 2.0f - 1.0f;
+    glm::vec3 n = glm::vec3(p.x, 1.0f - fabsf(p.x) - fabsf(p.y), p.y);
+    if (n.y < 0.0f) {
+        float x = n.x;
+        n.x = (1.0f - fabsf(n.z)) * signNotZero(x);
+        n.z = (1.0f - fabsf(x)) * signNotZero(n.z);
+    }
+    return glm::normalize(n);
+}
+
+static Impostor
+bakeImpostor(Model* model, Shader bakeShader) {
+    Impostor impostor = {};
+    impostor.center = (model->bounds.min + model->bounds.max) * 0.5f;
+    impostor.radius = glm::length(model->bounds.max - model->bounds.min) * 0.5f;
+
+    const int atlasSize = IMPOSTOR_FRAMES * IMPOSTOR_FRAME_SIZE;
+
+    glGenTextures(1, &impostor.colorTexture);
+    glBindTexture(GL_TEXTURE_2D, impostor.colorTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, atlasSize, atlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glGenTextures(1, &impostor.normalDepthTexture);
+    glBindTexture(GL_TEXTURE_2D, impostor.normalDepthTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, atlasSize, atlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    uint depthRenderbuffer;
+    glGenRenderbuffers(1, &depthRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, atlasSize, atlasSize);
+
+    uint framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostor.colorTexture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, impostor.normalDepthTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderbuffer);
+    GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(arrayCount(drawBuffers), drawBuffers);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "ERROR::IMPOSTOR:: Bake framebuffer is not complete" << std::endl;
+    } else {
+        const float clearColor[] = { 0.f, 0.f, 0.f, 0.f };
+        const float clearNormalDepth[] = { 0.5f, 0.5f, 0.5f, 1.f };
+        const float clearDepth = 1.f;
+        glClearBufferfv(GL_COLOR, 0, clearColor);
+        glClearBufferfv(GL_COLOR, 1, clearNormalDepth);
+        glClearBufferfv(GL_DEPTH, 0, &clearDepth);
+
+        float r = impostor.radius;
+        glm::mat4 projection = glm::ortho(-r, r, -r, r, r, 3.f * r);
+        use(bakeShader);
+        setMat4(bakeShader, SID("projection"), projection);
+
+        for (int y = 0; y < IMPOSTOR_FRAMES; y++) {
+            for (int x = 0; x < IMPOSTOR_FRAMES; x++) {
+                glm::vec3 dir = octDecode(glm::vec2(x + 0.5f, y + 0.5f) / (float)IMPOSTOR_FRAMES);
+                glm::vec3 up = fabsf(dir.y) > 0.999f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+                glm::mat4 view = glm::lookAt(impostor.center + dir * 2.f * r, impostor.center, up);
+
+                setGlViewport(&g_glState, x * IMPOSTOR_FRAME_SIZE, y * IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE);
+                setMat4(bakeShader, SID("view"), view);
+                drawModel(model, bakeShader, 0, glm::mat4(1.0f));
+            }
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    setGlViewport(&g_glState, 0, 0, g_renderContext.width, g_renderContext.height);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &depthRenderbuffer);
+
+    uint textures[] = { impostor.colorTexture, impostor.normalDepthTexture };
+    for (int i = 0; i < arrayCount(textures); i++) {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Unit quad as a triangle strip, plus a per instance model matrix
+    float corners[] = { -1.f, -1.f, 1.f, -1.f, -1.f, 1.f, 1.f, 1.f };
+    uint quadVBO;
+    glGenVertexArrays(1, &impostor.quadVAO);
+    glGenBuffers(1, &quadVBO);
+
+    glBindVertexArray(impostor.quadVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+
+    // The instance attributes point into the ring, they are set when drawing
+    for (int i = 0; i < 4; i++) {
+        glEnableVertexAttribArray(1 + i);
+        glVertexAttribDivisor(1 + i, 1);
+    }
+    glBindVertexArray(0);
+
+    return impostor;
+}
+
+// Instances that don't fit in the ring this frame are dropped, and counted in
+// droppedInstances and the ring's overflow
+static void
+beginImpostorInstances(Impostor* impostor, GpuRing* ring, uint maxInstances) {
+    GpuRingAllocation allocation;
+    impostor->maxInstances = allocGpuRingElements(ring, maxInstances, sizeof(glm::mat4), &allocation);
+    impostor->instances = (glm::mat4*)allocation.data;
+    impostor->instanceOffset = allocation.offset;
+    impostor->instanceCount = 0;
+    impostor->droppedInstances = maxInstances - impostor->maxInstances;
+}
+
+static void
+pushImpostorInstance(Impostor* impostor, const glm::mat4& modelMatrix) {
+    if (impostor->instanceCount < impostor->maxInstances) {
+        impostor->instances[impostor->instanceCount++] = modelMatrix;
+    } else {
+        impostor->droppedInstances++;
+    }
+}
+
+// Draws and clears all the instances gathered for this frame, the ring has to
+// be flushed already. The camera comes from the camera uniform block.
+static void
+drawImpostorInstances(Impostor* impostor, Shader shader, GpuRing* ring) {
+    if (impostor->instanceCount == 0) return;
+
+    use(shader);
+    setVec3(shader, SID("impostorCenter"), impostor->center);
+    setFloat(shader, SID("impostorRadius"), impostor->radius);
+    setFloat(shader, SID("framesPerSide"), (float)IMPOSTOR_FRAMES);
+    setInt(shader, SID("impostorColor"), 0);
+    setInt(shader, SID("impostorNormalDepth"), 1);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, impostor->colorTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, impostor->normalDepthTexture);
+
+    glBindVertexArray(impostor->quadVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, ring->buffer);
+    for (int i = 0; i < 4; i++) {
+        glVertexAttribPointer(1 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(impostor->instanceOffset + i * sizeof(glm::vec4)));
+    }
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, impostor->instanceCount);
+    glBindVertexArray(0);
+
+    glActiveTexture(GL_TEXTURE0);
+    impostor->instanceCount = 0;
+}
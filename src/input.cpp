@@ -0,0 +1,337 @@
+// Input recording and replay.
+//
+// Everything the app reads from the mouse and keyboard goes through
+// InputState. The GLFW callbacks turn what happened into InputEvents, and the
+// main loop applies them. While recording, every event is also appended to an
+// arena with the time it arrived. Each time a frame samples input, an
+// INPUT_FRAME event is appended holding the time since the previous sample.
+//
+// On replay the live callbacks are ignored. Each frame applies the recorded
+// events up to the next INPUT_FRAME and steps with that frame's recorded delta
+// time. Camera movement, picking clicks and the debug UI then play out the
+// same however long the replayed frames take. The debug UI gets its mouse and
+// keys from InputState while replaying. The replay doesn't load a scene: pass
+// the same --scene as the recording.
+//
+// The file is an InputRecordingHeader with the starting camera and window
+// size, followed by the events as they were recorded, 16 bytes each.
+
+#define INPUT_RECORDING_MAGIC 0x52504e49 // "INPR"
+#define INPUT_RECORDING_VERSION 1
+#define INPUT_RECORDING_ARENA_SIZE (64 * 1024 * 1024)
+#define INPUT_MOUSE_BUTTONS 8
+#define INPUT_MAX_CHARS 32 // Characters typed in one frame
+
+enum InputEventType {
+    INPUT_CURSOR, // x, y: position
+    INPUT_BUTTON, // code: mouse button
+    INPUT_SCROLL, // x, y: offsets
+    INPUT_KEY,    // code: GLFW key
+    INPUT_CHAR,   // code: character
+    INPUT_FRAME,  // x: seconds since the previous frame sampled input
+};
+
+enum InputMode {
+    INPUT_LIVE,
+    INPUT_RECORDING,
+    INPUT_REPLAYING,
+};
+
+struct InputEvent {
+    unsigned char type;
+    unsigned char action; // GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT
+    unsigned short code;
+    float time; // Seconds since the recording started
+    float x;
+    float y;
+};
+
+struct InputRecordingHeader {
+    uint magic;
+    uint version;
+    uint eventCount;
+    uint frameCount;
+    uint width;
+    uint height;
+    uint entityCount; // Only to warn when the replay starts from a different scene
+    float cameraPosition[3];
+    float cameraYaw;
+    float cameraPitch;
+    float cameraFov;
+};
+
+struct InputState {
+    float cursorX;
+    float cursorY;
+    bool buttons[INPUT_MOUSE_BUTTONS];
+    bool buttonsPressed[INPUT_MOUSE_BUTTONS]; // Since the UI last saw them, so clicks shorter than a frame still count
+    bool keys[GLFW_KEY_LAST + 1];
+    float scrollX; // Since the UI last saw them
+    float scrollY;
+    unsigned short chars[INPUT_MAX_CHARS];
+    uint charCount;
+    float frameDeltaTime; // Of the last input sample
+
+    InputMode mode;
+    const char* path;
+    MemoryArena arena;
+    InputEvent* events;
+    uint eventCount;
+    uint frameCount;
+    double startTime;
+    double lastSampleTime;
+    bool overflowed;
+
+    // Replay
+    InputRecordingHeader header;
+    uint nextEvent;
+    uint replayedFrames;
+    float* replayFrameTimes; // Wall time each replayed frame took
+    double lastReplayTime;
+};
+
+static InputState g_input;
+
+static inline bool
+inputKeyDown(InputState* input, int key) {
+    return key >= 0 && key <= GLFW_KEY_LAST && input->keys[key];
+}
+
+// Anything held down keeps moving the camera or dragging a widget
+static bool
+inputHeld(InputState* input) {
+    for (int i = 0; i < INPUT_MOUSE_BUTTONS; i++) {
+        if (input->buttons[i]) return true;
+    }
+    for (int i = 0; i <= GLFW_KEY_LAST; i++) {
+        if (input->keys[i]) return true;
+    }
+    return false;
+}
+
+static void
+applyInputEvent(InputState* input, const InputEvent* event) {
+    switch (event->type) {
+    case INPUT_CURSOR:
+        input->cursorX = event->x;
+        input->cursorY = event->y;
+        break;
+    case INPUT_BUTTON:
+        if (event->code < INPUT_MOUSE_BUTTONS) {
+            input->buttons[event->code] = event->action != GLFW_RELEASE;
+            if (event->action == GLFW_PRESS) input->buttonsPressed[event->code] = true;
+        }
+        break;
+    case INPUT_SCROLL:
+        input->scrollX += event->x;
+        input->scrollY += event->y;
+        break;
+    case INPUT_KEY:
+        if (event->code <= GLFW_KEY_LAST) input->keys[event->code] = event->action != GLFW_RELEASE;
+        break;
+    case INPUT_CHAR:
+        if (input->charCount < INPUT_MAX_CHARS) input->chars[input->charCount++] = event->code;
+        break;
+    }
+}
+
+static void
+appendInputEvent(InputState* input, const InputEvent* event) {
+    if (input->overflowed) return;
+    if (input->arena.used + sizeof(InputEvent) > input->arena.size) {
+        fprintf(stderr, "ERROR::INPUT:: recording is full, stopped after %u events\n", input->eventCount);
+        input->overflowed = true;
+        return;
+    }
+    *pushStruct(&input->arena, InputEvent) = *event;
+    input->eventCount++;
+}
+
+// For the live callbacks, stamped with the current time and recorded if recording
+static InputEvent
+makeInputEvent(InputState* input, InputEventType type, int code, int action, double x, double y) {
+    InputEvent event = {};
+    event.type = (unsigned char)type;
+    event.action = (unsigned char)action;
+    event.code = (unsigned short)code;
+    event.time = (float)(glfwGetTime() - input->startTime);
+    event.x = (float)x;
+    event.y = (float)y;
+    if (input->mode == INPUT_RECORDING) appendInputEvent(input, &event);
+    return event;
+}
+
+static void
+startInputRecording(InputState* input, const char* path, Camera* camera, uint entityCount) {
+    input->mode = INPUT_RECORDING;
+    input->path = path;
+    initArena(&input->arena, INPUT_RECORDING_ARENA_SIZE, "input recording arena");
+    input->events = (InputEvent*)input->arena.base;
+
+    InputRecordingHeader* header = &input->header;
+    header->magic = INPUT_RECORDING_MAGIC;
+    header->version = INPUT_RECORDING_VERSION;
+    header->width = g_renderContext.width;
+    header->height = g_renderContext.height;
+    header->entityCount = entityCount;
+    for (int i = 0; i < 3; i++) header->cameraPosition[i] = camera->position[i];
+    header->cameraYaw = camera->yaw;
+    header->cameraPitch = camera->pitch;
+    header->cameraFov = camera->fov;
+}
+
+static bool
+finishInputRecording(InputState* input) {
+    FILE* file = fopen(input->path, "wb");
+    if (!file) {
+        fprintf(stderr, "ERROR::INPUT:: could not open %s\n", input->path);
+        return false;
+    }
+    input->header.eventCount = input->eventCount;
+    input->header.frameCount = input->frameCount;
+    bool written = fwrite(&input->header, sizeof(input->header), 1, file) == 1
+                && fwrite(input->events, sizeof(InputEvent), input->eventCount, file) == input->eventCount;
+    fclose(file);
+    if (!written) {
+        fprintf(stderr, "ERROR::INPUT:: could not write %s\n", input->path);
+        return false;
+    }
+    printf("Recorded %u frames (%u events) to %s\n", input->frameCount, input->eventCount, input->path);
+    return true;
+}
+
+// Puts the camera where the recording started, the window size is left to the caller in header
+static bool
+startInputReplay(InputState* input, const char* path, Camera* camera, uint entityCount) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "ERROR::INPUT:: could not open %s\n", path);
+        return false;
+    }
+    InputRecordingHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != INPUT_RECORDING_MAGIC || header.version != INPUT_RECORDING_VERSION) {
+        fprintf(stderr, "ERROR::INPUT:: %s is not an input recording\n", path);
+        fclose(file);
+        return false;
+    }
+
+    initArena(&input->arena, header.eventCount * sizeof(InputEvent) + header.frameCount * sizeof(float) + 64, "input replay arena");
+    input->events = pushArray(&input->arena, InputEvent, header.eventCount);
+    input->replayFrameTimes = pushArray(&input->arena, float, header.frameCount);
+    bool read = fread(input->events, sizeof(InputEvent), header.eventCount, file) == header.eventCount;
+    fclose(file);
+    if (!read) {
+        fprintf(stderr, "ERROR::INPUT:: %s is truncated\n", path);
+        freeArena(&input->arena);
+        return false;
+    }
+
+    if (header.entityCount != entityCount) {
+        fprintf(stderr, "ERROR::INPUT:: %s was recorded with %u entities, replaying with %u\n", path, header.entityCount, entityCount);
+    }
+    input->mode = INPUT_REPLAYING;
+    input->path = path;
+    input->header = header;
+    input->eventCount = header.eventCount;
+    input->nextEvent = 0;
+    input->replayedFrames = 0;
+
+    camera->position = glm::vec3(header.cameraPosition[0], header.cameraPosition[1], header.cameraPosition[2]);
+    camera->yaw = header.cameraYaw;
+    camera->pitch = header.cameraPitch;
+    camera->fov = header.cameraFov;
+    updateCameraVectors(camera);
+    return true;
+}
+
+// Right before the first frame, in every mode, so the first sample doesn't include startup
+static void
+startInputClock(InputState* input) {
+    input->startTime = glfwGetTime();
+    input->lastSampleTime = input->startTime;
+    input->lastReplayTime = input->startTime;
+}
+
+// Records a frame's input sample, returns the time since the previous one
+static float
+recordInputFrame(InputState* input) {
+    double now = glfwGetTime();
+    float deltaTime = (float)(now - input->lastSampleTime);
+    input->lastSampleTime = now;
+    input->frameDeltaTime = deltaTime;
+    if (input->mode == INPUT_RECORDING) {
+        makeInputEvent(input, INPUT_FRAME, 0, 0, deltaTime, 0.0);
+        input->frameCount++;
+    }
+    return deltaTime;
+}
+
+// The recorded events of the next frame, to be applied in order, without its
+// INPUT_FRAME. Returns false once the recording has run out.
+static bool
+nextReplayFrame(InputState* input, const InputEvent** events, uint* count) {
+    if (input->nextEvent >= input->eventCount) return false;
+
+    uint first = input->nextEvent;
+    uint frame = first;
+    while (frame < input->eventCount && input->events[frame].type != INPUT_FRAME) frame++;
+    if (frame == input->eventCount) {
+        // Events after the last frame sample never affected anything
+        input->nextEvent = input->eventCount;
+        return false;
+    }
+
+    *events = input->events + first;
+    *count = frame - first;
+    input->frameDeltaTime = input->events[frame].x;
+    input->nextEvent = frame + 1;
+
+    double now = glfwGetTime();
+    if (input->replayedFrames < input->header.frameCount) {
+        input->replayFrameTimes[input->replayedFrames++] = (float)(now - input->lastReplayTime);
+    }
+    input->lastReplayTime = now;
+    return true;
+}
+
+static void
+printReplaySummary(InputState* input) {
+    uint count = input->replayedFrames;
+    if (count == 0) return;
+    float* times = input->replayFrameTimes;
+    std::sort(times, times + count);
+    printf("Replayed %u frames of %s in %.2f s\n", count, input->path, glfwGetTime() - input->startTime);
+    printf("Frame time p50/p95/p99/max: %.2f / %.2f / %.2f / %.2f ms\n", times[(count - 1) * 50 / 100] * 1000.f,
+           times[(count - 1) * 95 / 100] * 1000.f, times[(count - 1) * 99 / 100] * 1000.f, times[count - 1] * 1000.f);
+}
+
+// Gives the UI this frame's mouse and keys from the replay instead of GLFW.
+// Call between ImGui_ImplGlfw_NewFrame and ImGui::NewFrame, every frame, since
+// it also clears what only lasts a frame.
+static void
+updateImGuiInput(InputState* input) {
+    if (input->mode == INPUT_REPLAYING) {
+        ImGuiIO& io = ImGui::GetIO();
+        io.DeltaTime = glm::max(input->frameDeltaTime, 1e-4f);
+        io.MousePos = ImVec2(input->cursorX, input->cursorY);
+        for (int i = 0; i < IM_ARRAYSIZE(io.MouseDown) && i < INPUT_MOUSE_BUTTONS; i++) {
+            io.MouseDown[i] = input->buttons[i] || input->buttonsPressed[i];
+        }
+        io.MouseWheel = input->scrollY;
+        io.MouseWheelH = input->scrollX;
+        for (int i = 0; i < IM_ARRAYSIZE(io.KeysDown); i++) {
+            io.KeysDown[i] = i <= GLFW_KEY_LAST && input->keys[i];
+        }
+        io.KeyCtrl = input->keys[GLFW_KEY_LEFT_CONTROL] || input->keys[GLFW_KEY_RIGHT_CONTROL];
+        io.KeyShift = input->keys[GLFW_KEY_LEFT_SHIFT] || input->keys[GLFW_KEY_RIGHT_SHIFT];
+        io.KeyAlt = input->keys[GLFW_KEY_LEFT_ALT] || input->keys[GLFW_KEY_RIGHT_ALT];
+        io.KeySuper = input->keys[GLFW_KEY_LEFT_SUPER] || input->keys[GLFW_KEY_RIGHT_SUPER];
+        io.ClearInputCharacters();
+        for (uint i = 0; i < input->charCount; i++) io.AddInputCharacter(input->chars[i]);
+    }
+
+    for (int i = 0; i < INPUT_MOUSE_BUTTONS; i++) input->buttonsPressed[i] = false;
+    input->scrollX = 0.f;
+    input->scrollY = 0.f;
+    input->charCount = 0;
+}
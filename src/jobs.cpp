@@ -0,0 +1,286 @@
+// Work-stealing job system.
+//
+// The main thread and workerCount - 1 worker threads each own a job queue. A
+// thread pushes and pops jobs at the bottom of its own queue, and when it runs
+// out it steals from the top of someone else's (Chase-Lev deques, lock free).
+// Workers that find nothing to do for a while sleep until new jobs are pushed.
+//
+// Every job can count down a JobCounter when it finishes. waitForCounter runs
+// other jobs until the counter reaches zero, so the main thread helps instead of
+// blocking, and a job that depends on other jobs can wait for them the same way.
+// Pushing jobs doesn't allocate: a job is a function pointer, a data pointer and
+// an index range, copied into the queue.
+//
+// Threads that aren't part of the system (the texture streaming worker) run the
+// jobs they push right away.
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define MAX_JOB_WORKERS 64
+#define JOB_QUEUE_SIZE 1024 // Power of two
+#define JOB_CHUNKS_PER_WORKER 4 // parallelFor splits into this many chunks per worker, for balancing
+#define JOB_SPIN_COUNT 64 // Failed attempts to find a job before a worker goes to sleep
+#define NO_JOB_WORKER (~0u)
+
+typedef void JobFunction(void* data, uint first, uint last);
+
+struct JobCounter {
+    std::atomic<uint> pending;
+
+    JobCounter() : pending(0) {}
+};
+
+struct Job {
+    JobFunction* function;
+    void* data;
+    uint first;
+    uint last;
+    JobCounter* counter; // Can be NULL
+};
+
+struct JobQueue {
+    std::atomic<long long> top; // Thieves take from here
+    char padding[64]; // Keeps top and bottom on separate cache lines
+    std::atomic<long long> bottom; // The owner pushes and pops here
+    Job jobs[JOB_QUEUE_SIZE];
+};
+
+struct JobWorker {
+    JobQueue queue;
+    std::thread thread; // Not used for the main thread
+    uint random;        // For picking who to steal from
+};
+
+struct JobSystem {
+    JobWorker* workers; // The main thread is worker 0
+    uint workerCount;
+
+    std::atomic<uint> queuedJobs; // Pushed and not yet taken by anyone
+    std::atomic<uint> sleepingWorkers;
+    std::atomic<bool> quit;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+};
+
+static JobSystem g_jobs;
+static thread_local uint t_jobWorker = NO_JOB_WORKER;
+
+// Only called by the owner
+static bool
+pushJobQueue(JobQueue* queue, const Job& job) {
+    long long bottom = queue->bottom.load(std::memory_order_relaxed);
+    long long top = queue->top.load(std::memory_order_acquire);
+    if (bottom - top >= JOB_QUEUE_SIZE) return false;
+    queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)] = job;
+    queue->bottom.store(bottom + 1, std::memory_order_release);
+    return true;
+}
+
+// Only called by the owner, takes the newest job
+static bool
+popJobQueue(JobQueue* queue, Job* job) {
+    long long bottom = queue->bottom.load(std::memory_order_relaxed) - 1;
+    queue->bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long long top = queue->top.load(std::memory_order_relaxed);
+    if (top > bottom) {
+        queue->bottom.store(bottom + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    *job = queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)];
+    if (top < bottom) return true;
+
+    // Last job, race the thieves for it
+    bool won = queue->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    queue->bottom.store(bottom + 1, std::memory_order_relaxed);
+    return won;
+}
+
+// Called by anyone, takes the oldest job. The slot can't be reused by the owner
+// while top still points at it, so copying before the exchange is fine.
+static bool
+stealJobQueue(JobQueue* queue, Job* job) {
+    long long top = queue->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long long bottom = queue->bottom.load(std::memory_order_acquire);
+    if (top >= bottom) return false;
+
+    *job = queue->jobs[top & (JOB_QUEUE_SIZE - 1)];
+    return queue->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+static bool
+getJob(JobSystem* jobs, Job* job) {
+    uint self = t_jobWorker;
+    bool found = false;
+    if (self != NO_JOB_WORKER) found = popJobQueue(&jobs->workers[self].queue, job);
+
+    if (!found && jobs->workerCount > 1) {
+        // Start from a random victim so the thieves spread out
+        uint random = 0;
+        if (self != NO_JOB_WORKER) {
+            random = jobs->workers[self].random;
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            jobs->workers[self].random = random;
+        }
+        for (uint i = 0; i < jobs->workerCount && !found; i++) {
+            uint victim = (random + i) % jobs->workerCount;
+            if (victim == self) continue;
+            found = stealJobQueue(&jobs->workers[victim].queue, job);
+        }
+    }
+
+    if (found) jobs->queuedJobs.fetch_sub(1, std::memory_order_relaxed);
+    return found;
+}
+
+static inline void
+executeJob(Job* job) {
+    job->function(job->data, job->first, job->last);
+    if (job->counter) job->counter->pending.fetch_sub(1, std::memory_order_release);
+}
+
+static void
+runJob(JobFunction* function, void* data, uint first, uint last, JobCounter* counter) {
+    Job job = { function, data, first, last, counter };
+    if (counter) counter->pending.fetch_add(1, std::memory_order_relaxed);
+
+    uint self = t_jobWorker;
+    if (self == NO_JOB_WORKER || g_jobs.workerCount <= 1) {
+        executeJob(&job);
+        return;
+    }
+
+    // Counted before it can be stolen, so the count never goes below zero
+    g_jobs.queuedJobs.fetch_add(1, std::memory_order_seq_cst);
+    if (!pushJobQueue(&g_jobs.workers[self].queue, job)) {
+        g_jobs.queuedJobs.fetch_sub(1, std::memory_order_relaxed);
+        executeJob(&job);
+        return;
+    }
+    // Taking the lock makes sure a worker that is about to sleep either sees the job or gets woken up
+    if (g_jobs.sleepingWorkers.load(std::memory_order_seq_cst) > 0) {
+        std::lock_guard<std::mutex> lock(g_jobs.sleepMutex);
+        g_jobs.wake.notify_one();
+    }
+}
+
+// Runs queued jobs on the calling thread until the counter reaches zero
+static void
+waitForCounter(JobCounter* counter) {
+    while (counter->pending.load(std::memory_order_acquire) != 0) {
+        Job job;
+        if (getJob(&g_jobs, &job)) {
+            executeJob(&job);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void
+jobWorkerThread(JobSystem* jobs, uint index) {
+    t_jobWorker = index;
+    uint spins = 0;
+    while (!jobs->quit.load(std::memory_order_relaxed)) {
+        Job job;
+        if (getJob(jobs, &job)) {
+            executeJob(&job);
+            spins = 0;
+            continue;
+        }
+        if (++spins < JOB_SPIN_COUNT) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(jobs->sleepMutex);
+        jobs->sleepingWorkers.fetch_add(1, std::memory_order_seq_cst);
+        jobs->wake.wait(lock, [jobs]() {
+            return jobs->queuedJobs.load(std::memory_order_seq_cst) > 0 || jobs->quit.load(std::memory_order_relaxed);
+        });
+        jobs->sleepingWorkers.fetch_sub(1, std::memory_order_relaxed);
+        spins = 0;
+    }
+}
+
+// threadCount includes the calling thread, which becomes worker 0. Zero uses every core.
+static void
+initJobSystem(JobSystem* jobs, uint threadCount) {
+    if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+    threadCount = glm::clamp(threadCount, 1u, (uint)MAX_JOB_WORKERS);
+
+    jobs->workers = new JobWorker[threadCount];
+    jobs->workerCount = threadCount;
+    jobs->queuedJobs = 0;
+    jobs->sleepingWorkers = 0;
+    jobs->quit = false;
+    for (uint i = 0; i < threadCount; i++) {
+        jobs->workers[i].queue.top = 0;
+        jobs->workers[i].queue.bottom = 0;
+        jobs->workers[i].random = 0x9e3779b9u * (i + 1);
+    }
+
+    t_jobWorker = 0;
+    for (uint i = 1; i < threadCount; i++) {
+        jobs->workers[i].thread = std::thread(jobWorkerThread, jobs, i);
+    }
+}
+
+static void
+shutdownJobSystem(JobSystem* jobs) {
+    {
+        std::lock_guard<std::mutex> lock(jobs->sleepMutex);
+        jobs->quit = true;
+        jobs->wake.notify_all();
+    }
+    for (uint i = 1; i < jobs->workerCount; i++) {
+        jobs->workers[i].thread.join();
+    }
+    delete[] jobs->workers;
+    jobs->workers = NULL;
+    jobs->workerCount = 0;
+    t_jobWorker = NO_JOB_WORKER;
+}
+
+template<typename F>
+static void
+parallelForJob(void* data, uint first, uint last) {
+    (*(F*)data)(first, last);
+}
+
+// Splits count items into chunks of at least minChunkSize and runs func(first, last)
+// on each as a job without waiting for them. func has to stay alive until counter
+// reaches zero.
+template<typename F>
+static void
+runParallelFor(uint count, uint minChunkSize, F* func, JobCounter* counter) {
+    if (count == 0) return;
+    uint maxChunks = glm::max(g_jobs.workerCount, 1u) * JOB_CHUNKS_PER_WORKER;
+    uint chunkCount = glm::clamp(count / glm::max(minChunkSize, 1u), 1u, maxChunks);
+    uint chunkSize = (count + chunkCount - 1) / chunkCount;
+    // Pushed from the back, so the owner pops the front chunks first
+    for (uint first = (chunkCount - 1) * chunkSize; ; first -= chunkSize) {
+        if (first < count) runJob(parallelForJob<F>, func, first, glm::min(first + chunkSize, count), counter);
+        if (first == 0) break;
+    }
+}
+
+// Runs func(first, last) over count items in parallel and returns once all of them are done
+template<typename F>
+static void
+parallelFor(uint count, uint minChunkSize, F func) {
+    if (g_jobs.workerCount <= 1 || count <= minChunkSize) {
+        if (count) func(0u, count);
+        return;
+    }
+    JobCounter counter;
+    runParallelFor(count, minChunkSize, &func, &counter);
+    waitForCounter(&counter);
+}
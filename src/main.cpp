@@ -2,9 +2,6 @@
 #include <GLFW/glfw3.h>
 #include <stdio.h>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -18,7 +15,6 @@
 #include "ImGuizmo/ImGuizmo.cpp"
 
 //TODO: Maybe don't use stl as much. Just faster to setup for now.
-//TODO: Should make a temp stack allocator for all the temp allocs at least, like strings
 //TODO: Get rid of std::string entirely and have custom one
 #include <string>
 #include <fstream>
@@ -31,8 +27,38 @@
 
 typedef unsigned int uint;
 
+#include "cpu_features.cpp"
+
+// Lets --isa turn off the SSE2 JPEG decoding
+#define STBI_SSE2_AVAILABLE (g_cpu.active >= CPU_ISA_SSE2)
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "memory.cpp"
+#include "profiler.cpp"
+#include "jobs.cpp"
+#include "batch_math.cpp"
+#include "string_id.cpp"
+#include "material.cpp"
 #include "shader.cpp"
+#include "gl_state.cpp"
+#include "gpu_ring.cpp"
+#include "frame_pacing.cpp"
+#include "texture_streaming.cpp"
+
+static TextureStreamer g_textureStreamer;
+static GpuRing g_cameraRing;
+static GpuRing g_instanceRing;
+
+#include "imgui_renderer.cpp"
+#include "font_cache.cpp"
+
+#include "mesh_simplify.cpp"
 #include "model_loading.cpp"
+#include "occlusion.cpp"
+#include "transform.cpp"
+
+static TransformHierarchy g_transforms;
 
 struct RenderContext {
     GLFWwindow* window;
@@ -52,11 +78,17 @@ enum Direction {
 };
 
 #include "camera.cpp"
+#include "input.cpp"
+#include "impostor.cpp"
 
 struct Entity {
-    glm::mat4 modelMatrix;
+    uint transform; // Handle in g_transforms
     Model* model;
     Shader shader;
+    bool visible; // Result of culling for the current frame
+    uint lod;
+    bool impostor; // Drawn as an impostor instead of the model this frame
+    float screenSize; // Projected diameter in pixels
 };
 
 struct Sphere {
@@ -67,6 +99,12 @@ struct Sphere {
 static int selectedEntity = 0;
 static std::vector<Entity> entities;
 
+#include "scene.cpp"
+#include "render_commands.cpp"
+#include "entity_indicators.cpp"
+#include "id_picking.cpp"
+#include "bench.cpp"
+
 static bool
 intersectRaySphere(glm::vec3 p, glm::vec3 d, Sphere sphere) {
     glm::vec3 m = p - sphere.c;
@@ -87,12 +125,20 @@ static inline void
 resizeView(RenderContext* renderContext, uint width, uint height) {
     renderContext->width = width;
     renderContext->height = height;
-    glViewport(0, 0, width, height);
+    setGlViewport(&g_glState, 0, 0, width, height);
 }
 
 static void
 windowSizeCallback(GLFWwindow* window, int width, int height) {
     resizeView(&g_renderContext, (uint)width, (uint)height);
+    resetSteadyState(&g_profiler);
+    requestRedraw(&g_redraw, REDRAW_TRAILING_FRAMES);
+}
+
+// Uncovered or damaged while the loop was idle
+static void
+windowRefreshCallback(GLFWwindow* window) {
+    requestRedraw(&g_redraw, 1);
 }
 
 static float lastMouseX;
@@ -103,7 +149,7 @@ static Camera g_camera;
 static bool cameraMousePressed = false;
 
 static void
-mouseCallback(GLFWwindow* window, double xpos, double ypos) {
+mouseMoved(float xpos, float ypos) {
     static bool firstMouse = true;
 
     if (firstMouse) {
@@ -122,8 +168,6 @@ mouseCallback(GLFWwindow* window, double xpos, double ypos) {
     processMouseMovement(&g_camera, xoffset, yoffset);
 }
 
-static float entityPickerSize = 0.1f;
-
 static glm::vec3 testIndicatorPos;
 
 static void
@@ -134,7 +178,7 @@ setPos(glm::mat4* matrix, glm::vec3 pos) {
 }
 
 static glm::vec3
-getPos(glm::mat4& matrix) {
+getPos(const glm::mat4& matrix) {
     glm::vec3 pos = glm::vec3(matrix[3]);
     return pos;
 }
@@ -149,6 +193,8 @@ getScale(glm::mat4 matrix) {
     return scale;
 }
 
+#define PICK_CHUNK_SIZE 4096
+
 static int
 findEntityUnderScreenPos(float mouseX, float mouseY) {
     // Raycast from screenpos and see if we hit an entity, return its index, if so
@@ -173,34 +219,202 @@ findEntityUnderScreenPos(float mouseX, float mouseY) {
     glm::vec3 rayDir = glm::normalize(glm::vec3(pos.x, pos.y, pos.z) - g_camera.position);
     glm::vec3 rayPos = g_camera.position;
 
-    int entityIndex = -1;
-    float smallestDistance = INFINITY;
+    // Distance in the high bits and the index in the low ones, so the closest hit is the smallest
+    // value. Positive floats compare the same as their bits.
+    std::atomic<unsigned long long> closest(~0ull);
+    parallelFor(entities.size(), PICK_CHUNK_SIZE, [rayPos, rayDir, &closest](uint first, uint last) {
+        unsigned long long chunkClosest = ~0ull;
+        for(uint i = first; i < last; i++) {
+            auto* entity = &entities[i];
+            glm::vec3 entityPos = getPos(worldMatrix(&g_transforms, entity->transform));
+            float radius = entityIndicatorRadius(&g_entityIndicators, &g_camera, glm::dot(entityPos - rayPos, g_camera.front));
+            Sphere sphere;
+            sphere.c = entityPos;
+            sphere.r = radius + radius*0.1f;
+            if(!intersectRaySphere(rayPos, rayDir, sphere)) continue;
+
+            float distance = glm::distance(rayPos, entityPos);
+            uint distanceBits;
+            memcpy(&distanceBits, &distance, sizeof(distanceBits));
+            chunkClosest = glm::min(chunkClosest, ((unsigned long long)distanceBits << 32) | i);
+        }
+        unsigned long long current = closest.load();
+        while(chunkClosest < current && !closest.compare_exchange_weak(current, chunkClosest)) {}
+    });
+
+    if(closest == ~0ull) return -1;
+    return (int)(closest & 0xffffffffu);
+}
+
+#define MAX_OCCLUDERS 8
+#define MAX_OCCLUDER_TRIANGLES 65536
+#define CULL_CHUNK_SIZE 1024
+
+static OcclusionBuffer g_occlusionBuffer;
+static bool occlusionCullingEnabled = true;
+static float occlusionCullingTime;
+
+static void
+cullEntities(OcclusionBuffer* buffer, Camera* camera) {
+    if(!occlusionCullingEnabled) {
+        clearOcclusionBuffer(buffer);
+        for(int i = 0; i < entities.size(); i++) {
+            entities[i].visible = true;
+        }
+        return;
+    }
+
+    float startTime = glfwGetTime();
+
+    glm::mat4 viewProjection = calculateProjectionMatrix(camera) * calculateViewMatrix(camera);
+
+    clearOcclusionBuffer(buffer);
+
+    // Use the entities that cover the most of the screen as occluders
+    int occluders[MAX_OCCLUDERS];
+    float occluderScores[MAX_OCCLUDERS];
+    int occluderCount = 0;
     for(int i = 0; i < entities.size(); i++) {
         auto* entity = &entities[i];
-        glm::vec3 entityPos = getPos(entity->modelMatrix);
-        Sphere sphere;
-        sphere.c = entityPos;
-        sphere.r = entityPickerSize + entityPickerSize*0.1f;
-        bool result = intersectRaySphere(rayPos, rayDir, sphere);
-        if(result) {
-            float distance = glm::distance(g_camera.position, entityPos);
-            if(distance < smallestDistance) {
-                entityIndex = i;
-            }
+        Model* model = entity->model;
+        if(model->occluderIndices.empty()) continue;
+
+        const glm::mat4& modelMatrix = worldMatrix(&g_transforms, entity->transform);
+        glm::vec3 center = glm::vec3(modelMatrix * glm::vec4((model->bounds.min + model->bounds.max) * 0.5f, 1.0f));
+        glm::vec3 scale = getScale(modelMatrix);
+        float radius = glm::length(model->bounds.max - model->bounds.min) * 0.5f * glm::max(scale.x, glm::max(scale.y, scale.z));
+        float distance = glm::dot(center - camera->position, camera->front);
+        if(distance + radius < Camera::NearPlane) continue;
+
+        float score = radius / glm::max(distance, Camera::NearPlane);
+        int slot = occluderCount;
+        if(occluderCount == MAX_OCCLUDERS) {
+            if(score <= occluderScores[MAX_OCCLUDERS - 1]) continue;
+            slot--;
+        } else {
+            occluderCount++;
         }
+        while(slot > 0 && occluderScores[slot - 1] < score) {
+            occluders[slot] = occluders[slot - 1];
+            occluderScores[slot] = occluderScores[slot - 1];
+            slot--;
+        }
+        occluders[slot] = i;
+        occluderScores[slot] = score;
+    }
+
+    uint triangleBudget = MAX_OCCLUDER_TRIANGLES;
+    for(int i = 0; i < occluderCount; i++) {
+        auto* entity = &entities[occluders[i]];
+        Model* model = entity->model;
+        uint triangleCount = model->occluderIndices.size() / 3;
+        if(triangleCount > triangleBudget) continue;
+        triangleBudget -= triangleCount;
+
+        rasterizeOccluder(buffer, viewProjection * worldMatrix(&g_transforms, entity->transform),
+                          &model->occluderVertices[0], model->occluderVertices.size(),
+                          &model->occluderIndices[0], model->occluderIndices.size());
     }
+    updateOcclusionTiles(buffer);
+
+    std::atomic<uint> culledCount(0);
+    parallelFor(entities.size(), CULL_CHUNK_SIZE, [buffer, &viewProjection, &culledCount](uint first, uint last) {
+        uint culled = 0;
+        for(uint i = first; i < last; i++) {
+            auto* entity = &entities[i];
+            entity->visible = testOccludee(buffer, viewProjection * worldMatrix(&g_transforms, entity->transform), entity->model->bounds);
+            culled += !entity->visible;
+        }
+        culledCount += culled;
+    });
+    buffer->testedCount = entities.size();
+    buffer->culledCount = culledCount;
 
-    return entityIndex;
+    occlusionCullingTime = glfwGetTime() - startTime;
 }
 
+static bool lodEnabled = true;
+static float lodPixelThreshold = 1.0f;
+// A coarser LOD has to be this much under the threshold before switching to it, so entities
+// sitting right at the threshold don't pop back and forth
+static float lodHysteresis = 0.75f;
+
+static bool impostorsEnabled = true;
+static float impostorDistance = 60.0f;
+
+#define LOD_CHUNK_SIZE 1024
+
 static void
-mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
+selectEntityLodRange(Camera* camera, float pixelsPerUnit, uint first, uint last) {
+    for(uint i = first; i < last; i++) {
+        auto* entity = &entities[i];
+        Model* model = entity->model;
+
+        const glm::mat4& modelMatrix = worldMatrix(&g_transforms, entity->transform);
+        glm::vec3 center = glm::vec3(modelMatrix * glm::vec4((model->bounds.min + model->bounds.max) * 0.5f, 1.0f));
+        glm::vec3 scale = getScale(modelMatrix);
+        float maxScale = glm::max(scale.x, glm::max(scale.y, scale.z));
+        float radius = glm::length(model->bounds.max - model->bounds.min) * 0.5f * maxScale;
+        float distance = glm::max(glm::distance(center, camera->position) - radius, Camera::NearPlane);
+
+        entity->impostor = impostorsEnabled && model->impostor && distance > impostorDistance;
+        entity->screenSize = 2.0f * radius * pixelsPerUnit / distance;
+
+        if(!lodEnabled || model->lodCount <= 1) {
+            entity->lod = 0;
+            continue;
+        }
+
+        float errorScale = maxScale * pixelsPerUnit / distance;
+        uint lod = 0;
+        for(uint j = 1; j < model->lodCount; j++) {
+            float limit = j > entity->lod ? lodPixelThreshold * lodHysteresis : lodPixelThreshold;
+            if(model->lodErrors[j] * errorScale > limit) break;
+            lod = j;
+        }
+        entity->lod = lod;
+    }
+}
+
+static void
+selectEntityLods(Camera* camera) {
+    // Pixels per world unit at distance 1
+    float pixelsPerUnit = (float)g_renderContext.height / (2.0f * tanf(glm::radians(camera->fov) * 0.5f));
+
+    parallelFor(entities.size(), LOD_CHUNK_SIZE, [camera, pixelsPerUnit](uint first, uint last) {
+        selectEntityLodRange(camera, pixelsPerUnit, first, last);
+    });
+}
+
+static void
+processCameraInput(InputState* input, float deltaTime) {
+    if (inputKeyDown(input, GLFW_KEY_W))
+        processKeyboard(&g_camera, FORWARD, deltaTime);
+    if (inputKeyDown(input, GLFW_KEY_S))
+        processKeyboard(&g_camera, BACKWARD, deltaTime);
+    if (inputKeyDown(input, GLFW_KEY_A))
+        processKeyboard(&g_camera, LEFT, deltaTime);
+    if (inputKeyDown(input, GLFW_KEY_D))
+        processKeyboard(&g_camera, RIGHT, deltaTime);
+    if (inputKeyDown(input, GLFW_KEY_Q))
+        processKeyboard(&g_camera, UP, deltaTime);
+    if (inputKeyDown(input, GLFW_KEY_E))
+        processKeyboard(&g_camera, DOWN, deltaTime);
+}
+
+static void
+mouseButtonChanged(int button, int action) {
     if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS)
         cameraMousePressed = true;
     if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_RELEASE)
         cameraMousePressed = false;
 
     if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE) {
+        // Resolved a frame or two later, see resolveIdPicks
+        if(g_idPicker.enabled) {
+            g_idPicker.clickRequested = true;
+            return;
+        }
         int entityIndex = findEntityUnderScreenPos(lastMouseX, lastMouseY);
         if(entityIndex >= 0) {
             selectedEntity = entityIndex;
@@ -208,27 +422,79 @@ mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
     }
 }
 
+// Live and replayed events both end up here
+static void
+handleInputEvent(const InputEvent* event) {
+    applyInputEvent(&g_input, event);
+    if(event->type == INPUT_CURSOR) {
+        mouseMoved(event->x, event->y);
+    } else if(event->type == INPUT_BUTTON) {
+        mouseButtonChanged(event->code, event->action);
+    } else if(event->type == INPUT_SCROLL) {
+        processMouseScroll(&g_camera, event->y);
+    }
+}
+
+static void
+receiveInputEvent(InputEventType type, int code, int action, double x, double y) {
+    if(g_input.mode == INPUT_REPLAYING) return;
+    InputEvent event = makeInputEvent(&g_input, type, code, action, x, y);
+    handleInputEvent(&event);
+    requestRedraw(&g_redraw, REDRAW_TRAILING_FRAMES);
+}
+
+static void
+cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
+    receiveInputEvent(INPUT_CURSOR, 0, 0, xpos, ypos);
+}
+
+static void
+mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
+    receiveInputEvent(INPUT_BUTTON, button, action, 0.0, 0.0);
+}
+
 static void
 scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
-    processMouseScroll(&g_camera, yoffset);
+    receiveInputEvent(INPUT_SCROLL, 0, 0, xoffset, yoffset);
 }
 
 static void
-drawEntity(Entity* entity) {
-    use(entity->shader);
-    setMat4(entity->shader, "projection", calculateProjectionMatrix(&g_camera));
-    setMat4(entity->shader, "view", calculateViewMatrix(&g_camera));
+keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if(key < 0) return; // GLFW_KEY_UNKNOWN
+    receiveInputEvent(INPUT_KEY, key, action, 0.0, 0.0);
+}
 
-    // glm::mat4 modelMat = glm::mat4(1.0f);
-    // modelMat = glm::translate(modelMat, entity->position);
-    // modelMat = glm::scale(modelMat, glm::vec3(entity->scale.x, entity->scale.y, entity->scale.z));
-    // modelMat = glm::rotate(modelMat, glm::radians(entity->rotation.x), glm::vec3(1.f, 0.f, 0.f));
-    // modelMat = glm::rotate(modelMat, glm::radians(entity->rotation.y), glm::vec3(0.f, 1.f, 0.f));
-    // modelMat = glm::rotate(modelMat, glm::radians(entity->rotation.z), glm::vec3(0.f, 0.f, 1.f));
+static void
+charCallback(GLFWwindow* window, unsigned int c) {
+    receiveInputEvent(INPUT_CHAR, c, 0, 0.0, 0.0);
+}
 
-    setMat4(entity->shader, "model", entity->modelMatrix);
+// Called once a frame, right before the camera moves, returns how far to move it in time.
+// When replaying this is where the frame's recorded events are applied.
+static float
+sampleInput(GLFWwindow* window) {
+    if(g_input.mode != INPUT_REPLAYING) return recordInputFrame(&g_input);
+
+    const InputEvent* events;
+    uint count;
+    if(!nextReplayFrame(&g_input, &events, &count)) {
+        glfwSetWindowShouldClose(window, true);
+        return 0.f;
+    }
+    for(uint i = 0; i < count; i++) {
+        handleInputEvent(&events[i]);
+    }
+    return g_input.frameDeltaTime;
+}
 
-    drawModel(entity->model, entity->shader);
+// ImGuizmo round trips the matrix through euler angles every frame, so tiny differences don't count as edits
+static bool
+matricesDiffer(const glm::mat4& a, const glm::mat4& b) {
+    for(int i = 0; i < 4; i++) {
+        glm::vec4 d = glm::abs(a[i] - b[i]);
+        if(glm::max(glm::max(d.x, d.y), glm::max(d.z, d.w)) > 1e-5f) return true;
+    }
+    return false;
 }
 
 static void
@@ -236,11 +502,11 @@ editTransform(GLFWwindow* window, Camera* camera, glm::mat4& matrix) {
     static ImGuizmo::OPERATION mCurrentGizmoOperation(ImGuizmo::TRANSLATE);
     static ImGuizmo::MODE mCurrentGizmoMode(ImGuizmo::WORLD);
 
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
+    if (inputKeyDown(&g_input, GLFW_KEY_1))
         mCurrentGizmoOperation = ImGuizmo::TRANSLATE;
-    if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
+    if (inputKeyDown(&g_input, GLFW_KEY_2))
         mCurrentGizmoOperation = ImGuizmo::ROTATE;
-    if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS)
+    if (inputKeyDown(&g_input, GLFW_KEY_3))
         mCurrentGizmoOperation = ImGuizmo::SCALE;
 
     if (ImGui::RadioButton("Translate", mCurrentGizmoOperation == ImGuizmo::TRANSLATE))
@@ -272,7 +538,85 @@ editTransform(GLFWwindow* window, Camera* camera, glm::mat4& matrix) {
     ImGuizmo::Manipulate((float*)glm::value_ptr(calculateViewMatrix(camera)), (float*)glm::value_ptr(calculateProjectionMatrix(camera)), mCurrentGizmoOperation, mCurrentGizmoMode, (float*)glm::value_ptr(matrix));
 }
 
-int main() {
+// microbench.cpp includes everything above and has its own main
+#ifndef MICROBENCH
+int main(int argc, char** argv) {
+    const char* scenePath = NULL;
+    uint threadCount = 0;
+    FramePacingMode pacingMode = FRAME_PACING_VSYNC;
+    float fpsCap = 144.0f;
+    bool headless = false;
+    bool benchMode = false;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    const char* benchFilter = NULL;
+    const char* benchOutPath = "bench_results.json";
+    const char* benchBaselinePath = NULL;
+    bool uiStressOpen = false;
+    bool stockImGuiRenderer = false;
+    bool continuous = false;
+    initBenchRunner(&g_bench);
+    detectCpuFeatures(&g_cpu);
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--strict-allocations") == 0) {
+            g_profiler.strictAllocations = true;
+        } else if(strncmp(argv[i], "--scene=", 8) == 0) {
+            scenePath = argv[i] + 8;
+        } else if(strncmp(argv[i], "--threads=", 10) == 0) {
+            threadCount = (uint)atoi(argv[i] + 10);
+        } else if(strncmp(argv[i], "--pacing=", 9) == 0) {
+            if(!parseFramePacingMode(argv[i] + 9, &pacingMode)) {
+                fprintf(stderr, "Unknown pacing mode: %s (vsync, adaptive, capped or uncapped)\n", argv[i] + 9);
+            }
+        } else if(strncmp(argv[i], "--fps-cap=", 10) == 0) {
+            fpsCap = (float)atof(argv[i] + 10);
+            pacingMode = FRAME_PACING_CAPPED;
+        } else if(strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if(strncmp(argv[i], "--record=", 9) == 0) {
+            recordPath = argv[i] + 9;
+        } else if(strncmp(argv[i], "--replay=", 9) == 0) {
+            replayPath = argv[i] + 9;
+        } else if(strcmp(argv[i], "--bench") == 0) {
+            benchMode = true;
+            headless = true;
+        } else if(strncmp(argv[i], "--bench=", 8) == 0) {
+            benchMode = true;
+            headless = true;
+            benchFilter = argv[i] + 8;
+        } else if(strncmp(argv[i], "--bench-frames=", 15) == 0) {
+            setBenchFrames(&g_bench, (uint)atoi(argv[i] + 15));
+        } else if(strncmp(argv[i], "--bench-out=", 12) == 0) {
+            benchOutPath = argv[i] + 12;
+        } else if(strncmp(argv[i], "--bench-baseline=", 17) == 0) {
+            benchBaselinePath = argv[i] + 17;
+        } else if(strncmp(argv[i], "--bench-threshold=", 18) == 0) {
+            if(!parseBenchThreshold(&g_bench, argv[i] + 18)) {
+                fprintf(stderr, "Unknown bench threshold: %s\n", argv[i] + 18);
+            }
+        } else if(strcmp(argv[i], "--ui-stress") == 0) {
+            uiStressOpen = true;
+        } else if(strcmp(argv[i], "--ui-stock") == 0) {
+            stockImGuiRenderer = true;
+        } else if(strcmp(argv[i], "--continuous") == 0) {
+            continuous = true;
+        } else if(strncmp(argv[i], "--isa=", 6) == 0) {
+            CpuIsa isa;
+            if(parseCpuIsa(argv[i] + 6, &isa)) {
+                limitCpuIsa(&g_cpu, isa);
+            } else {
+                fprintf(stderr, "Unknown instruction set: %s (scalar, sse2, sse4.1, avx, avx2 or avx512)\n", argv[i] + 6);
+            }
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+        }
+    }
+
+    selectBatchMathKernels(g_cpu.active);
+    selectOcclusionKernels(g_cpu.active);
+    selectVertexConversion(g_cpu.active);
+    printf("CPU: %s, %s (using %s)\n", cpuBrand(&g_cpu), cpuIsaNames[g_cpu.detected], cpuIsaNames[g_cpu.active]);
+
     if (!glfwInit()) {
         fprintf(stderr, "ERROR: could not start GLFW3\n");
         return 1;
@@ -284,6 +628,11 @@ int main() {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    // Nothing to show and nothing to wait for, the frames are only timed
+    if(headless) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        pacingMode = FRAME_PACING_UNCAPPED;
+    }
 
     g_renderContext.width = 1280;
     g_renderContext.height = 720;
@@ -299,10 +648,13 @@ int main() {
     g_renderContext.window = window;
 
     glfwSetWindowSizeCallback(window, windowSizeCallback);
+    glfwSetWindowRefreshCallback(window, windowRefreshCallback);
 
-    glfwSetCursorPosCallback(window, mouseCallback);
+    glfwSetCursorPosCallback(window, cursorPosCallback);
     glfwSetMouseButtonCallback(window, mouseButtonCallback);
     glfwSetScrollCallback(window, scrollCallback);
+    glfwSetKeyCallback(window, keyCallback);
+    glfwSetCharCallback(window, charCallback);
 
     glewExperimental = GL_TRUE;
     glewInit();
@@ -312,10 +664,12 @@ int main() {
     printf("Renderer: %s\n", renderer);
     printf("OpenGL version supported %s\n", version);
 
-    glEnable(GL_DEPTH_TEST);
+    initGlStateCache(&g_glState, g_renderContext.width, g_renderContext.height);
+    setGlCapability(&g_glState, GL_CAPABILITY_DEPTH_TEST, true);
     glDepthFunc(GL_LESS);
 
     IMGUI_CHECKVERSION();
+    ImGui::SetAllocatorFunctions(imguiAlloc, imguiFree);
     ImGui::CreateContext();
     ImGuiIO& io = ImGui::GetIO(); (void)io;
     //io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;
@@ -326,59 +680,132 @@ int main() {
 
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init("#version 330 core");
+    buildFontAtlasCached(io.Fonts, "imgui_font_atlas.cache");
+
+    initFrameMemory();
+    initJobSystem(&g_jobs, threadCount);
+    initTextureStreaming(&g_textureStreamer, 256 * 1024 * 1024);
+
+    GLint uniformBufferAlignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformBufferAlignment);
+    initGpuRing(&g_cameraRing, GL_UNIFORM_BUFFER, 64 * 1024, uniformBufferAlignment, "camera ring");
+    initGpuRing(&g_instanceRing, GL_ARRAY_BUFFER, 16 * 1024 * 1024, sizeof(glm::mat4), "instance ring");
+    initImGuiRenderer(&g_imguiRenderer);
+    g_imguiRenderer.cached = !stockImGuiRenderer;
 
     Shader basicShader = compileShader("basic.vs", "basic.fs");
-    Shader greenShader = compileShader("basic.vs", "green.fs");
     Shader redShader   = compileShader("basic.vs", "red.fs");
+    Shader impostorBakeShader = compileShader("impostor_bake.vs", "impostor_bake.fs");
+    Shader impostorShader     = compileShader("impostor.vs", "impostor.fs");
+    Shader indicatorShader    = compileShader("indicator.vs", "green.fs");
+    Shader idShader           = compileShader("basic.vs", "id.fs");
+
+    const char* modelPaths[] = { "data/nanosuit/nanosuit.obj", "data/sphere/sphere.obj" };
+    Model models[arrayCount(modelPaths)];
+    loadModels(models, modelPaths, arrayCount(modelPaths));
+    Model& nanosuitModel = models[0];
+    Model& sphereModel = models[1];
+
+    registerSceneModel(&g_sceneAssets, "data/nanosuit/nanosuit.obj", &nanosuitModel);
+    registerSceneModel(&g_sceneAssets, "data/sphere/sphere.obj", &sphereModel);
+    registerSceneShader(&g_sceneAssets, "basic", basicShader);
+    registerSceneShader(&g_sceneAssets, "red", redShader);
+
+    // Pack the textures of everything loaded into arrays
+    createTextureArrays(&g_textureStreamer);
+
+    // The bake needs the full resolution textures, they get evicted later if they aren't used
+    for(int i = 0; i < nanosuitModel.textures_loaded.size(); i++) {
+        makeTextureResident(&g_textureStreamer, nanosuitModel.textures_loaded[i].streamed, 0);
+    }
+    Impostor nanosuitImpostor = bakeImpostor(&nanosuitModel, impostorBakeShader);
+    nanosuitModel.impostor = &nanosuitImpostor;
 
-    Model nanosuitModel = loadModel("data/nanosuit/nanosuit.obj");
-    Model sphereModel = loadModel("data/sphere/sphere.obj");
+    if(scenePath) {
+        loadScene(scenePath, &entities, &g_transforms, &g_sceneAssets);
+    }
 
-    Entity greenIndicator;
-    greenIndicator.modelMatrix = glm::scale(glm::mat4(1.0f), glm::vec3(entityPickerSize));
-    greenIndicator.model = &sphereModel;
-    greenIndicator.shader = greenShader;
+    initEntityIndicators(&g_entityIndicators, &sphereModel, ENTITY_INDICATOR_PIXEL_RADIUS);
+    initIdPicker(&g_idPicker, idShader);
+    if(benchMode) {
+        addBenchScenes(&g_bench, benchFilter, &nanosuitModel, &sphereModel, basicShader);
+        g_idPicker.enabled = false;
+    }
 
     glm::vec3 clearColor = glm::vec3(0.2f, 0.3f, 0.3f);
 
+    initFramePacer(&g_framePacer, pacingMode, fpsCap);
+
+    int exitCode = 0;
+    if(recordPath) {
+        startInputRecording(&g_input, recordPath, &g_camera, entities.size());
+    } else if(replayPath) {
+        if(startInputReplay(&g_input, replayPath, &g_camera, entities.size())) {
+            glfwSetWindowSize(window, g_input.header.width, g_input.header.height);
+            resizeView(&g_renderContext, g_input.header.width, g_input.header.height);
+        } else {
+            glfwSetWindowShouldClose(window, true);
+            exitCode = 1;
+        }
+    }
+
+    // Benchmarks and replays time every frame, so they never wait for a reason to draw
+    initRedraw(&g_redraw, !continuous && !benchMode && !headless && !replayPath);
+
     float deltaTime = 0.f;
     float lastFrame = glfwGetTime();
+    startInputClock(&g_input);
 
+    bool dumpRenderCommandsRequested = false; // Written after this frame's commands are recorded
     bool hideAllDebugMenusPressed = false;
-    bool hideAllDebugMenus = false;
+    bool hideAllDebugMenus = benchMode;
     bool running = true;
     while (!glfwWindowShouldClose(window)) {
+        if(waitForRedraw(&g_redraw, &g_framePacer, window)) {
+            // Nothing moved while idle, the first frame back only steps over its own time
+            lastFrame = glfwGetTime();
+            g_input.lastSampleTime = lastFrame;
+            if(glfwWindowShouldClose(window)) break;
+        }
+        beginPacedFrame(&g_framePacer);
+        beginProfileFrame(&g_profiler);
+
         float currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
 
-        if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
+        glfwPollEvents();
+        if (inputKeyDown(&g_input, GLFW_KEY_ESCAPE)) {
             glfwSetWindowShouldClose(window, true);
         }
 
-        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-            processKeyboard(&g_camera, FORWARD, deltaTime);
-        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-            processKeyboard(&g_camera, BACKWARD, deltaTime);
-        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-            processKeyboard(&g_camera, LEFT, deltaTime);
-        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-            processKeyboard(&g_camera, RIGHT, deltaTime);
-        if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-            processKeyboard(&g_camera, UP, deltaTime);
-        if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-            processKeyboard(&g_camera, DOWN, deltaTime);
-
-        if (glfwGetKey(window, GLFW_KEY_F1) == GLFW_PRESS && !hideAllDebugMenusPressed) {
+        resolveIdPicks(&g_idPicker);
+        if(g_idPicker.clickReady) {
+            if(g_idPicker.click.hit && g_idPicker.click.entity < entities.size()) {
+                selectedEntity = g_idPicker.click.entity;
+            }
+            g_idPicker.clickReady = false;
+        }
+
+        bool lateInput = g_framePacer.lateInput;
+        if (!lateInput) {
+            processCameraInput(&g_input, sampleInput(window));
+            markInputSampled(&g_framePacer);
+        }
+        // Overrides the camera and replaces the scene when the next one starts
+        if(benchMode && !beginBenchFrame(&g_bench, &entities, &g_transforms, &g_camera)) break;
+
+        if (inputKeyDown(&g_input, GLFW_KEY_F1) && !hideAllDebugMenusPressed) {
             hideAllDebugMenus = !hideAllDebugMenus;
             hideAllDebugMenusPressed = true;
         }
-        if (glfwGetKey(window, GLFW_KEY_F1) == GLFW_RELEASE)
+        if (!inputKeyDown(&g_input, GLFW_KEY_F1))
             hideAllDebugMenusPressed = false;
 
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
+        updateImGuiInput(&g_input);
         ImGui::NewFrame();
         ImGuizmo::BeginFrame();
 
@@ -386,6 +813,9 @@ int main() {
         if(!hideAllDebugMenus)
         {
             entityEditorOpen = ImGui::Begin("Entity editor");
+            if(entityEditorOpen && g_entityIndicators.dropped) {
+                ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "Indicators dropped, out of instance ring space: %u", g_entityIndicators.dropped);
+            }
             if(entityEditorOpen && entities.size() > 0)
             {
                 if(selectedEntity < 0) selectedEntity = 0;
@@ -393,7 +823,27 @@ int main() {
 
                 auto* entity = &entities[selectedEntity];
                 ImGui::Text("Selected entity: %i", selectedEntity);
-                editTransform(window, &g_camera, entity->modelMatrix);
+
+                // Only used for showing the parent, fine to search
+                int parentEntity = -1;
+                uint parent = parentTransform(&g_transforms, entity->transform);
+                for(int i = 0; parent != NO_TRANSFORM && i < entities.size(); i++) {
+                    if(entities[i].transform == parent) parentEntity = i;
+                }
+                if(ImGui::InputInt("Parent entity", &parentEntity)) {
+                    if(parentEntity < 0) {
+                        setParentTransform(&g_transforms, entity->transform, NO_TRANSFORM);
+                    } else if(parentEntity < entities.size() && parentEntity != selectedEntity) {
+                        setParentTransform(&g_transforms, entity->transform, entities[parentEntity].transform);
+                    }
+                }
+
+                glm::mat4 matrix = worldMatrix(&g_transforms, entity->transform);
+                glm::mat4 edited = matrix;
+                editTransform(window, &g_camera, edited);
+                if(matricesDiffer(matrix, edited)) {
+                    setWorldMatrix(&g_transforms, entity->transform, edited);
+                }
             }
             ImGui::End();
 
@@ -402,42 +852,274 @@ int main() {
                 Entity entity = {};
                 glm::mat4 mat = glm::scale(glm::mat4(1.0f), glm::vec3(0.3f));;
                 setPos(&mat, g_camera.front * 10.f + g_camera.position);
-                entity.modelMatrix = mat;
+                entity.transform = createTransform(&g_transforms, NO_TRANSFORM, mat);
                 entity.model = &nanosuitModel;
                 entity.shader = basicShader;
                 entities.push_back(entity);
+                resetSteadyState(&g_profiler);
+            }
+            static int gridSize = 100;
+            ImGui::InputInt("Grid size", &gridSize);
+            if(ImGui::Button("Add nanosuit grid in front of camera")) {
+                const float spacing = 3.0f;
+                glm::vec3 origin = g_camera.front * 10.f + g_camera.position;
+                for(int z = 0; z < gridSize; z++) {
+                    for(int x = 0; x < gridSize; x++) {
+                        Entity entity = {};
+                        glm::mat4 mat = glm::scale(glm::mat4(1.0f), glm::vec3(0.3f));
+                        setPos(&mat, origin + glm::vec3((x - gridSize / 2) * spacing, 0.f, -z * spacing));
+                        entity.transform = createTransform(&g_transforms, NO_TRANSFORM, mat);
+                        entity.model = &nanosuitModel;
+                        entity.shader = basicShader;
+                        entities.push_back(entity);
+                    }
+                }
+                resetSteadyState(&g_profiler);
+            }
+
+            ImGui::Separator();
+            static char scenePathBuffer[256] = "scene.bin";
+            ImGui::InputText("Scene file", scenePathBuffer, sizeof(scenePathBuffer));
+            if(ImGui::Button("Save scene")) {
+                saveScene(scenePathBuffer, entities, &g_transforms, &g_sceneAssets);
+            }
+            ImGui::SameLine();
+            if(ImGui::Button("Load scene")) {
+                loadScene(scenePathBuffer, &entities, &g_transforms, &g_sceneAssets);
+                resetSteadyState(&g_profiler);
+            }
+            ImGui::SameLine();
+            if(ImGui::Button("Clear")) {
+                entities.clear();
+                clearTransforms(&g_transforms);
+                resetSteadyState(&g_profiler);
+            }
+            ImGui::TextDisabled("Files ending in .txt are saved and loaded as text");
+            ImGui::End();
+
+            ImGui::Begin("Stats");
+            ImGui::Text("Frame time: %.2f ms", deltaTime * 1000.f);
+            int selectedPacingMode = g_framePacer.mode;
+            if(ImGui::Combo("Pacing", &selectedPacingMode, framePacingModeNames, FRAME_PACING_MODE_COUNT)) {
+                g_framePacer.mode = (FramePacingMode)selectedPacingMode;
+            }
+            if(g_framePacer.mode == FRAME_PACING_CAPPED) {
+                ImGui::SliderFloat("FPS cap", &g_framePacer.capFps, 10.0f, 500.0f);
+            }
+            ImGui::Checkbox("Late input sampling", &g_framePacer.lateInput);
+            ImGui::Checkbox("Redraw on demand", &g_redraw.onDemand);
+            ImGui::Text("Frames drawn: %u, idle wake ups: %u, slept %.1f ms before this one", g_redraw.drawnFrames, g_redraw.idleWakeUps, g_redraw.lastWaitTime * 1000.f);
+            TimingHistory* frameTimes = &g_framePacer.frameTimes;
+            ImGui::Text("Frame time p50/p95/p99/max: %.2f / %.2f / %.2f / %.2f ms", frameTimes->p50 * 1000.f, frameTimes->p95 * 1000.f, frameTimes->p99 * 1000.f, frameTimes->max * 1000.f);
+            TimingHistory* latencies = &g_framePacer.latencies;
+            ImGui::Text("Input latency p50/p95/p99/max: %.2f / %.2f / %.2f / %.2f ms", latencies->p50 * 1000.f, latencies->p95 * 1000.f, latencies->p99 * 1000.f, latencies->max * 1000.f);
+            ImGui::Text("Entities: %i", (int)entities.size());
+            ImGui::Text("Job threads: %u", g_jobs.workerCount);
+            ImGui::Text("Instruction set: %s of %s", cpuIsaNames[g_cpu.active], cpuIsaNames[g_cpu.detected]);
+            ImGui::Text("Transforms updated: %u", g_transforms.updatedCount);
+            ImGui::Checkbox("GPU picking", &g_idPicker.enabled);
+            if(g_idPicker.enabled) {
+                IdPickResult* hover = &g_idPicker.hover;
+                if(hover->hit) {
+                    ImGui::Text("Hover: entity %u, mesh %u, triangle %u", hover->entity, hover->mesh, hover->triangle);
+                    ImGui::Text("  at (%.2f, %.2f, %.2f), depth %.5f", hover->position.x, hover->position.y, hover->position.z, hover->depth);
+                } else {
+                    ImGui::Text("Hover: nothing");
+                }
+                ImGui::Text("Picking frames skipped: %u", g_idPicker.skippedFrames);
+                ImGui::Text("Pick pass: %u / %u commands drawn", g_idPicker.drawnCommands, g_idPicker.lastCommandCount);
+            }
+            ImGui::Checkbox("Occlusion culling", &occlusionCullingEnabled);
+            if(occlusionCullingEnabled) {
+                ImGui::Text("Occluders: %u (%u triangles)", g_occlusionBuffer.occluderCount, g_occlusionBuffer.occluderTriangles);
+                ImGui::Text("Culled: %u / %u", g_occlusionBuffer.culledCount, g_occlusionBuffer.testedCount);
+                ImGui::Text("Culling time: %.3f ms", occlusionCullingTime * 1000.f);
+            }
+
+            ImGui::Separator();
+            ImGui::Checkbox("LOD", &lodEnabled);
+            ImGui::SliderFloat("LOD pixel error", &lodPixelThreshold, 0.1f, 10.0f);
+            uint lodEntityCounts[MAX_LODS] = {};
+            uint drawnTriangles = 0;
+            uint impostorCount = 0;
+            for(int i = 0; i < entities.size(); i++) {
+                auto* entity = &entities[i];
+                if(!entity->visible) continue;
+                if(entity->impostor) {
+                    impostorCount++;
+                    drawnTriangles += 2;
+                    continue;
+                }
+                if(entity->model == &nanosuitModel) lodEntityCounts[entity->lod]++;
+                drawnTriangles += entity->model->lodTriangleCounts[entity->lod];
+            }
+            ImGui::Text("Drawn triangles: %u", drawnTriangles);
+            ImGui::Text("nanosuit.obj LODs:");
+            for(uint i = 0; i < nanosuitModel.lodCount; i++) {
+                ImGui::Text("  LOD %u: %u triangles, error %.4f, %u entities", i, nanosuitModel.lodTriangleCounts[i], nanosuitModel.lodErrors[i], lodEntityCounts[i]);
+            }
+
+            ImGui::Separator();
+            ImGui::Checkbox("Impostors", &impostorsEnabled);
+            ImGui::SliderFloat("Impostor distance", &impostorDistance, 5.0f, 500.0f);
+            ImGui::Text("Impostors drawn: %u", impostorCount);
+            if(nanosuitImpostor.droppedInstances) {
+                ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "  Dropped, out of instance ring space: %u", nanosuitImpostor.droppedInstances);
+            }
+
+            ImGui::Separator();
+            ImGui::Text("Render commands: %u", g_renderCommands.count);
+            ImGui::Text("Program changes: %u, mesh changes: %u", g_renderCommands.programChanges, g_renderCommands.meshChanges);
+            if(ImGui::Button("Dump render commands")) {
+                dumpRenderCommandsRequested = true;
+            }
+
+            ImGui::Separator();
+            ImGui::Checkbox("Cached UI renderer", &g_imguiRenderer.cached);
+            ImGui::SameLine();
+            ImGui::Checkbox("UI stress", &uiStressOpen);
+            ImGui::Text("UI: %u vertices, %u indices, %u draws, %u state changes", g_imguiRenderer.vertexCount,
+                        g_imguiRenderer.indexCount, g_imguiRenderer.drawCalls, g_imguiRenderer.stateChanges);
+            if(g_imguiRenderer.fallbackFrames) ImGui::Text("  Frames too big for the ring: %u", g_imguiRenderer.fallbackFrames);
+            ImGui::Text("Font atlas %s in %.2f ms", g_fontCache.loaded ? "loaded from cache" : "built", g_fontCache.seconds * 1000.f);
+            GpuRing* rings[] = { &g_cameraRing, &g_instanceRing, &g_imguiRenderer.ring };
+            for(int i = 0; i < arrayCount(rings); i++) {
+                GpuRing* ring = rings[i];
+                ImGui::Text("%s (%s): peak %.1f / %.0f KB", ring->name, ring->persistent ? "persistent" : "unsynchronized",
+                            ring->peakUsed / 1024.f, ring->frameSize / 1024.f);
+                ImGui::Text("  Fence stalls: %u, last frame %.3f ms", ring->stallCount, ring->lastStallTime * 1000.f);
+                if(ring->overflowBytes) ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "  Overflowed by %.1f KB", ring->overflowBytes / 1024.f);
+            }
+
+            ImGui::Separator();
+            static int textureBudgetMB = (int)(g_textureStreamer.budgetBytes / (1024 * 1024));
+            if(ImGui::SliderInt("Texture budget (MB)", &textureBudgetMB, 16, 2048)) {
+                g_textureStreamer.budgetBytes = (size_t)textureBudgetMB * 1024 * 1024;
+            }
+            ImGui::Text("Textures resident: %.1f MB (%i textures)", g_textureStreamer.residentBytes / (1024.f * 1024.f), (int)g_textureStreamer.textures.size());
+            ImGui::Text("Mip levels uploaded: %u, evicted: %u", g_textureStreamer.uploadedLevels, g_textureStreamer.evictedLevels);
+
+            ImGui::Separator();
+            ImGui::Text("Frame arena peak: %.1f KB / %.0f MB", g_framePeakBytes / 1024.f, g_frameArena.size / (1024.f * 1024.f));
+            ImGui::Text("Scratch arena peak: %.1f KB / %.0f MB", g_scratchPeakBytes / 1024.f, t_scratchArena.size / (1024.f * 1024.f));
+            ImGui::Text("Allocations last frame, all threads: %u (%.1f KB)", g_profiler.frameAllocationCount, g_profiler.frameAllocationBytes / 1024.f);
+            for(uint i = 0; i < g_profiler.scopeCount; i++) {
+                ProfileScopeStats* scope = &g_profiler.scopes[i];
+                ImGui::Text("  %-10s %6.3f ms, %u allocations", scope->name, scope->time * 1000.f, scope->allocationCount);
             }
             ImGui::End();
         }
+        // Also with the debug menus hidden, so --bench --ui-stress includes it
+        if(uiStressOpen) drawUiStressWindow(&uiStressOpen);
 
         glClearColor(clearColor.r, clearColor.g, clearColor.b, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        if(benchMode) beginBenchRendering(&g_bench);
 
-        glm::mat4 projection = calculateProjectionMatrix(&g_camera);
-        glm::mat4 view = calculateViewMatrix(&g_camera);
+        // Everything that depends on the camera happens after this, the UI above only sees the new input next frame
+        if (lateInput) {
+            glfwPollEvents();
+            processCameraInput(&g_input, sampleInput(window));
+            markInputSampled(&g_framePacer);
+        }
 
-        for(int i = 0; i < entities.size(); i++) {
-            auto* entity = &entities[i];
-            drawEntity(entity);
+        {
+            PROFILE_SCOPE("transforms");
+            updateTransforms(&g_transforms);
+        }
+        {
+            PROFILE_SCOPE("cull");
+            cullEntities(&g_occlusionBuffer, &g_camera);
+        }
+        {
+            PROFILE_SCOPE("lod");
+            selectEntityLods(&g_camera);
         }
 
-        if(!hideAllDebugMenus && entityEditorOpen) {
-            for(int i = 0; i < entities.size(); i++) {
-                auto* entity = &entities[i];
-                 glDisable(GL_DEPTH_TEST);
-                setPos(&greenIndicator.modelMatrix, getPos(entity->modelMatrix));
-                drawEntity(&greenIndicator);
-                glEnable(GL_DEPTH_TEST);
+        {
+            PROFILE_SCOPE("record");
+            recordRenderCommands(&g_renderCommands, entities.data(), entities.size(), &g_transforms, &g_camera);
+        }
+        {
+            PROFILE_SCOPE("draw");
+            beginGpuRingFrame(&g_cameraRing);
+            beginGpuRingFrame(&g_instanceRing);
+            bindCameraUniforms(&g_camera, &g_cameraRing);
+            flushGpuRing(&g_cameraRing);
+
+            beginImpostorInstances(&nanosuitImpostor, &g_instanceRing, g_renderCommands.impostorCount);
+            replayRenderCommands(&g_renderCommands, entities.data(), &g_transforms);
+            if(!hideAllDebugMenus && entityEditorOpen) {
+                gatherEntityIndicators(&g_entityIndicators, &g_instanceRing, entities.data(), entities.size(), &g_transforms);
             }
+            flushGpuRing(&g_instanceRing);
+            drawImpostorInstances(&nanosuitImpostor, impostorShader, &g_instanceRing);
+            if(!hideAllDebugMenus && !ImGui::GetIO().WantCaptureMouse) {
+                drawHoverHighlight(&g_idPicker, entities.data(), entities.size(), &g_transforms, redShader);
+            }
+            drawEntityIndicators(&g_entityIndicators, indicatorShader, &g_instanceRing);
+        }
+        {
+            PROFILE_SCOPE("pick");
+            if(ImGui::GetIO().WantCaptureMouse) {
+                dropIdPicks(&g_idPicker);
+            } else {
+                drawIdBuffer(&g_idPicker, &g_renderCommands, entities.data(), &g_transforms, &g_camera, lastMouseX, lastMouseY);
+            }
+        }
+        if(dumpRenderCommandsRequested) {
+            dumpRenderCommands(&g_renderCommands, "render_commands.txt");
+            dumpRenderCommandsRequested = false;
+        }
+        {
+            PROFILE_SCOPE("streaming");
+            updateTextureStreaming(&g_textureStreamer);
         }
 
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        // Keeps drawing while something is still changing without new input
+        if(inputHeld(&g_input) || g_idPicker.hoverChanged || idPickClickPending(&g_idPicker)
+           || g_textureStreamer.uploadedLevels || g_textureStreamer.evictedLevels) {
+            requestRedraw(&g_redraw, 1);
+        }
+        if(ImGui::GetIO().WantTextInput) {
+            requestRedrawAt(&g_redraw, glfwGetTime() + REDRAW_TEXT_CURSOR_INTERVAL);
+        }
+
+        {
+            PROFILE_SCOPE("imgui");
+            ImGui::Render();
+            renderImGui(&g_imguiRenderer, ImGui::GetDrawData());
+        }
+        endGpuRingFrame(&g_cameraRing);
+        endGpuRingFrame(&g_instanceRing);
+        if(benchMode) endBenchRendering(&g_bench);
 
         glfwSwapBuffers(window);
-        glfwPollEvents();
+        endPacedFrame(&g_framePacer);
+
+        endProfileFrame(&g_profiler);
+        if(benchMode) {
+            // The impostors are one instanced draw of two triangles each
+            uint impostors = g_renderCommands.impostorCount;
+            endBenchFrame(&g_bench, g_renderCommands.drawCalls + (impostors ? 1 : 0), g_renderCommands.triangles + impostors * 2,
+                          g_profiler.frameAllocationCount);
+        }
+        endFrameMemory();
+    }
+
+    if(benchMode) {
+        exitCode = finishBench(&g_bench, benchOutPath, benchBaselinePath);
     }
+    if(g_input.mode == INPUT_RECORDING) {
+        if(!finishInputRecording(&g_input)) exitCode = 1;
+    } else if(g_input.mode == INPUT_REPLAYING) {
+        printReplaySummary(&g_input);
+    }
+
+    shutdownTextureStreaming(&g_textureStreamer);
+    shutdownJobSystem(&g_jobs);
 
     glfwTerminate();
-    return 0;
+    return exitCode;
 }
+#endif
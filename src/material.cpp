@@ -0,0 +1,33 @@
+// Material texture slots. Every slot samples from its own texture unit, so the
+// sampler uniforms are set once when a shader is compiled and drawing a mesh
+// only has to bind arrays and set layer indices from its binding table.
+
+enum TextureSlot {
+    TEXTURE_SLOT_DIFFUSE,
+    TEXTURE_SLOT_SPECULAR,
+    TEXTURE_SLOT_NORMAL,
+    TEXTURE_SLOT_HEIGHT,
+
+    TEXTURE_SLOT_COUNT
+};
+
+// Sampler and layer uniforms of each slot
+static const StringId textureSlotSamplerIds[TEXTURE_SLOT_COUNT] = {
+    SID("texture_diffuse"), SID("texture_specular"), SID("texture_normal"), SID("texture_height")
+};
+static const StringId textureSlotLayerIds[TEXTURE_SLOT_COUNT] = {
+    SID("texture_diffuse_layer"), SID("texture_specular_layer"), SID("texture_normal_layer"), SID("texture_height_layer")
+};
+
+static inline uint
+textureSlotUnit(TextureSlot slot) {
+    return (uint)slot;
+}
+
+// Resolved once at load, everything drawMesh needs for one slot
+struct MaterialBinding {
+    TextureSlot slot;
+    uint unit;
+    uint texture; // Texture array, index into g_textureStreamer.textures
+    int layer;
+};
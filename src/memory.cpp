@@ -0,0 +1,170 @@
+// Linear arenas for temporary allocations.
+//
+// g_frameArena is reset at the end of every frame, so anything that only lives
+// for one frame can be pushed onto it and forgotten. Every thread also gets its
+// own scratch arena for temporaries inside a function, which is released with a
+// ScratchScope (or beginTemp/endTemp) when the function is done with it. Scopes
+// nest, the inner one just gets released first.
+//
+// With ARENA_DEBUG released memory is overwritten with ARENA_POISON, so anything
+// still pointing into it shows up quickly. Peak usage is always tracked.
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef ARENA_DEBUG
+#define ARENA_DEBUG 0
+#endif
+
+#define ARENA_POISON 0xcd
+
+#define FRAME_ARENA_SIZE   (16 * 1024 * 1024)
+#define SCRATCH_ARENA_SIZE (64 * 1024 * 1024)
+
+struct MemoryArena {
+    unsigned char* base;
+    size_t size;
+    size_t used;
+    size_t peak;      // Highest used since the last resetArenaPeak
+    const char* name; // For error messages
+};
+
+static void
+initArena(MemoryArena* arena, size_t size, const char* name) {
+    arena->base = (unsigned char*)malloc(size);
+    arena->size = size;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->name = name;
+    if (!arena->base) {
+        fprintf(stderr, "ERROR::ARENA:: could not reserve %zu bytes for %s\n", size, name);
+        abort();
+    }
+#if ARENA_DEBUG
+    memset(arena->base, ARENA_POISON, size);
+#endif
+}
+
+static void
+freeArena(MemoryArena* arena) {
+    free(arena->base);
+    *arena = {};
+}
+
+static void*
+pushSize(MemoryArena* arena, size_t size, size_t alignment = 16) {
+    size_t start = (arena->used + alignment - 1) & ~(alignment - 1);
+    if (start + size > arena->size) {
+        // Running out means the arena size is wrong for the workload, not something to recover from
+        fprintf(stderr, "ERROR::ARENA:: %s out of memory, %zu of %zu bytes used, %zu requested\n",
+                arena->name, arena->used, arena->size, size);
+        abort();
+    }
+    arena->used = start + size;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    return arena->base + start;
+}
+
+#define pushStruct(arena, type) ((type*)pushSize((arena), sizeof(type), alignof(type)))
+#define pushArray(arena, type, count) ((type*)pushSize((arena), (count) * sizeof(type), alignof(type)))
+
+// Releases everything above used
+static void
+popArenaTo(MemoryArena* arena, size_t used) {
+#if ARENA_DEBUG
+    memset(arena->base + used, ARENA_POISON, arena->used - used);
+#endif
+    arena->used = used;
+}
+
+static void
+resetArena(MemoryArena* arena) {
+    popArenaTo(arena, 0);
+}
+
+static void
+resetArenaPeak(MemoryArena* arena) {
+    arena->peak = arena->used;
+}
+
+struct TempMemory {
+    MemoryArena* arena;
+    size_t used;
+};
+
+static TempMemory
+beginTemp(MemoryArena* arena) {
+    TempMemory temp = { arena, arena->used };
+    return temp;
+}
+
+static void
+endTemp(TempMemory temp) {
+    popArenaTo(temp.arena, temp.used);
+}
+
+static thread_local MemoryArena t_scratchArena;
+
+static MemoryArena*
+getScratchArena() {
+    if (!t_scratchArena.base) initArena(&t_scratchArena, SCRATCH_ARENA_SIZE, "scratch arena");
+    return &t_scratchArena;
+}
+
+// Releases everything pushed on the calling thread's scratch arena during its lifetime
+struct ScratchScope {
+    TempMemory temp;
+
+    ScratchScope() : temp(beginTemp(getScratchArena())) {}
+    ~ScratchScope() { endTemp(temp); }
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+
+    MemoryArena* arena() { return temp.arena; }
+};
+
+// Standard allocator on top of an arena, deallocation is a no-op and the memory comes
+// back when the arena is popped. Containers that grow leave their old buffers behind,
+// so reserve up front where the size is known.
+template<typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    MemoryArena* arena;
+
+    ArenaAllocator(MemoryArena* arena) : arena(arena) {}
+    template<typename U> ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t count) { return pushArray(arena, T, count); }
+    void deallocate(T*, size_t) {}
+
+    template<typename U> bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template<typename U> bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+static MemoryArena g_frameArena;
+static size_t g_framePeakBytes;   // Peak of the frame that just ended
+static size_t g_scratchPeakBytes; // Peak of the main thread's scratch arena during the frame that just ended
+
+static void
+initFrameMemory() {
+    initArena(&g_frameArena, FRAME_ARENA_SIZE, "frame arena");
+    getScratchArena();
+}
+
+// Called once per frame after everything allocated from the frame arena has been used
+static void
+endFrameMemory() {
+    g_framePeakBytes = g_frameArena.peak;
+    g_scratchPeakBytes = t_scratchArena.peak;
+    if (t_scratchArena.used != 0) {
+        fprintf(stderr, "ERROR::ARENA:: %zu bytes of scratch memory still in use at the end of the frame\n", t_scratchArena.used);
+    }
+
+    resetArena(&g_frameArena);
+    resetArenaPeak(&g_frameArena);
+    resetArenaPeak(&t_scratchArena);
+}
@@ -0,0 +1,262 @@
+// Mesh simplification with quadric error metrics (Garland & Heckbert).
+//
+// Vertices are never moved, edges are only collapsed onto existing vertices,
+// so every level of detail can share the vertex buffer of the original mesh
+// and only needs its own index range.
+//
+// Vertices that share a position but not their attributes (UV seams, hard
+// normals) and vertices on open borders are locked: they can be collapsed
+// onto, but never collapsed away. This keeps seams and borders intact at the
+// cost of simplifying a bit less aggressively around them.
+
+struct Quadric {
+    // Symmetric 3x3 matrix A, vector b and constant c of
+    // error(v) = v^T A v + 2 b.v + c, accumulated with the triangle area as weight.
+    float a00, a11, a22, a10, a20, a21;
+    float b0, b1, b2;
+    float c;
+    float w;
+};
+
+static void
+addQuadric(Quadric* q, const Quadric& r) {
+    q->a00 += r.a00; q->a11 += r.a11; q->a22 += r.a22;
+    q->a10 += r.a10; q->a20 += r.a20; q->a21 += r.a21;
+    q->b0 += r.b0; q->b1 += r.b1; q->b2 += r.b2;
+    q->c += r.c;
+    q->w += r.w;
+}
+
+static Quadric
+planeQuadric(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2) {
+    Quadric q = {};
+    glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+    float length = glm::length(n);
+    if (length <= 0.0f) return q;
+
+    float area = length * 0.5f;
+    n /= length;
+    float d = -glm::dot(n, p0);
+
+    q.a00 = area * n.x * n.x; q.a11 = area * n.y * n.y; q.a22 = area * n.z * n.z;
+    q.a10 = area * n.y * n.x; q.a20 = area * n.z * n.x; q.a21 = area * n.z * n.y;
+    q.b0 = area * n.x * d; q.b1 = area * n.y * d; q.b2 = area * n.z * d;
+    q.c = area * d * d;
+    q.w = area;
+    return q;
+}
+
+// Returns the mean squared distance from v to the planes in the quadric
+static float
+quadricError(const Quadric& q, glm::vec3 v) {
+    float rx = q.a00 * v.x + q.a10 * v.y + q.a20 * v.z;
+    float ry = q.a10 * v.x + q.a11 * v.y + q.a21 * v.z;
+    float rz = q.a20 * v.x + q.a21 * v.y + q.a22 * v.z;
+    float error = rx * v.x + ry * v.y + rz * v.z;
+    error += 2.0f * (q.b0 * v.x + q.b1 * v.y + q.b2 * v.z);
+    error += q.c;
+    error = error > 0.0f ? error : 0.0f;
+    return q.w > 0.0f ? error / q.w : 0.0f;
+}
+
+struct Collapse {
+    uint from;
+    uint to;
+    float error;
+};
+
+// Fills remap with the first vertex that has the same first keyBytes bytes as each vertex
+static void
+buildVertexRemap(uint* remap, const unsigned char* vertexData, uint vertexCount, uint vertexStride, uint keyBytes) {
+    ScratchScope scratch;
+    uint* order = pushArray(scratch.arena(), uint, vertexCount);
+    for (uint i = 0; i < vertexCount; i++) order[i] = i;
+    std::sort(order, order + vertexCount, [&](uint a, uint b) {
+        int cmp = memcmp(vertexData + a * vertexStride, vertexData + b * vertexStride, keyBytes);
+        return cmp != 0 ? cmp < 0 : a < b;
+    });
+
+    for (uint i = 0; i < vertexCount; i++) {
+        uint v = order[i];
+        if (i > 0 && memcmp(vertexData + v * vertexStride, vertexData + remap[order[i - 1]] * vertexStride, keyBytes) == 0) {
+            remap[v] = remap[order[i - 1]];
+        } else {
+            remap[v] = v;
+        }
+    }
+}
+
+// Simplifies the triangle list down to around targetIndexCount indices, as long as the
+// error stays below targetError (object space distance). The vertex data has to start
+// with a glm::vec3 position, and the first attributeBytes bytes of each vertex decide
+// which vertices are identical. Writes at most indexCount indices to destination and
+// returns the number written; the reached error goes to resultError.
+static uint
+simplifyMesh(uint* destination, const uint* indices, uint indexCount,
+             const void* vertices, uint vertexCount, uint vertexStride, uint attributeBytes,
+             uint targetIndexCount, float targetError, float* resultError) {
+    const unsigned char* vertexData = (const unsigned char*)vertices;
+    #define SIMPLIFY_POSITION(v) (*(const glm::vec3*)(vertexData + (v) * vertexStride))
+
+    // All the temporaries live on the scratch arena, sized up front so nothing regrows
+    ScratchScope scratch;
+    MemoryArena* arena = scratch.arena();
+
+    // Merge vertices that are identical and find the ones that only share a position
+    uint* wedge = pushArray(arena, uint, vertexCount);
+    uint* position = pushArray(arena, uint, vertexCount);
+    buildVertexRemap(wedge, vertexData, vertexCount, vertexStride, attributeBytes);
+    buildVertexRemap(position, vertexData, vertexCount, vertexStride, sizeof(glm::vec3));
+
+    ArenaVector<unsigned char> locked(vertexCount, 0, arena);
+    ArenaVector<uint> firstWedge(vertexCount, ~0u, arena);
+    for (uint i = 0; i < vertexCount; i++) {
+        if (wedge[i] != i) continue;
+        uint p = position[i];
+        if (firstWedge[p] == ~0u) firstWedge[p] = i;
+        else locked[p] = 1;
+    }
+
+    for (uint i = 0; i < indexCount; i++) {
+        destination[i] = wedge[indices[i]];
+    }
+
+    // Lock open and non-manifold edges, found as position edges used by exactly one or more than two triangles
+    {
+        TempMemory edgeMemory = beginTemp(arena);
+        ArenaVector<unsigned long long> edges(arena);
+        edges.reserve(indexCount);
+        for (uint i = 0; i < indexCount; i += 3) {
+            for (uint e = 0; e < 3; e++) {
+                uint a = position[destination[i + e]];
+                uint b = position[destination[i + (e + 1) % 3]];
+                if (a > b) std::swap(a, b);
+                edges.push_back(((unsigned long long)a << 32) | b);
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size();) {
+            size_t j = i;
+            while (j < edges.size() && edges[j] == edges[i]) j++;
+            if (j - i != 2) {
+                locked[(uint)(edges[i] >> 32)] = 1;
+                locked[(uint)(edges[i] & 0xffffffff)] = 1;
+            }
+            i = j;
+        }
+        endTemp(edgeMemory);
+    }
+
+    ArenaVector<Quadric> quadrics(vertexCount, Quadric{}, arena);
+    for (uint i = 0; i < indexCount; i += 3) {
+        uint v0 = destination[i + 0], v1 = destination[i + 1], v2 = destination[i + 2];
+        Quadric q = planeQuadric(SIMPLIFY_POSITION(v0), SIMPLIFY_POSITION(v1), SIMPLIFY_POSITION(v2));
+        addQuadric(&quadrics[position[v0]], q);
+        addQuadric(&quadrics[position[v1]], q);
+        addQuadric(&quadrics[position[v2]], q);
+    }
+
+    float maxError = 0.0f;
+    float targetErrorSquared = targetError * targetError;
+
+    ArenaVector<uint> adjacencyOffsets(vertexCount + 1, 0, arena);
+    ArenaVector<uint> adjacency(arena);
+    adjacency.reserve(indexCount);
+    ArenaVector<Collapse> collapses(arena);
+    collapses.reserve(indexCount * 2); // Two directions for each edge of each triangle
+    ArenaVector<unsigned char> touched(vertexCount, 0, arena);
+    ArenaVector<uint> remap(vertexCount, 0, arena);
+
+    while (indexCount > targetIndexCount) {
+        // Vertex to triangle adjacency for the current index buffer
+        std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+        for (uint i = 0; i < indexCount; i++) adjacencyOffsets[destination[i] + 1]++;
+        for (uint i = 0; i < vertexCount; i++) adjacencyOffsets[i + 1] += adjacencyOffsets[i];
+        adjacency.resize(indexCount);
+        for (uint i = 0; i < indexCount; i++) adjacency[adjacencyOffsets[destination[i]]++] = i / 3;
+        for (uint i = vertexCount; i > 0; i--) adjacencyOffsets[i] = adjacencyOffsets[i - 1];
+        adjacencyOffsets[0] = 0;
+
+        collapses.clear();
+        for (uint i = 0; i < indexCount; i += 3) {
+            for (uint e = 0; e < 3; e++) {
+                uint a = destination[i + e];
+                uint b = destination[i + (e + 1) % 3];
+                Quadric q = quadrics[position[a]];
+                addQuadric(&q, quadrics[position[b]]);
+                if (!locked[position[a]]) collapses.push_back({ a, b, quadricError(q, SIMPLIFY_POSITION(b)) });
+                if (!locked[position[b]]) collapses.push_back({ b, a, quadricError(q, SIMPLIFY_POSITION(a)) });
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) {
+            return a.error < b.error;
+        });
+
+        for (uint i = 0; i < vertexCount; i++) remap[i] = i;
+        std::fill(touched.begin(), touched.end(), 0);
+
+        uint triangleCount = indexCount / 3;
+        uint collapseCount = 0;
+        for (size_t c = 0; c < collapses.size(); c++) {
+            Collapse collapse = collapses[c];
+            if (collapse.error > targetErrorSquared) break;
+            if (triangleCount * 3 <= targetIndexCount) break;
+            if (touched[collapse.from] || touched[collapse.to]) continue;
+
+            // Reject collapses that would flip a remaining triangle
+            glm::vec3 target = SIMPLIFY_POSITION(collapse.to);
+            bool flips = false;
+            uint removed = 0;
+            for (uint t = adjacencyOffsets[collapse.from]; t < adjacencyOffsets[collapse.from + 1]; t++) {
+                const uint* tri = destination + adjacency[t] * 3;
+                if (position[tri[0]] == position[collapse.to] || position[tri[1]] == position[collapse.to] || position[tri[2]] == position[collapse.to]) {
+                    removed++;
+                    continue;
+                }
+                glm::vec3 p[3] = { SIMPLIFY_POSITION(tri[0]), SIMPLIFY_POSITION(tri[1]), SIMPLIFY_POSITION(tri[2]) };
+                glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                for (int k = 0; k < 3; k++) {
+                    if (tri[k] == collapse.from) p[k] = target;
+                }
+                glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+                if (glm::dot(before, after) <= 1e-3f * glm::length(before) * glm::length(after)) {
+                    flips = true;
+                    break;
+                }
+            }
+            if (flips) continue;
+
+            remap[collapse.from] = collapse.to;
+            addQuadric(&quadrics[position[collapse.to]], quadrics[position[collapse.from]]);
+            for (uint t = adjacencyOffsets[collapse.from]; t < adjacencyOffsets[collapse.from + 1]; t++) {
+                const uint* tri = destination + adjacency[t] * 3;
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+            }
+            touched[collapse.to] = 1;
+
+            if (collapse.error > maxError) maxError = collapse.error;
+            triangleCount -= removed;
+            collapseCount++;
+        }
+
+        if (collapseCount == 0) break;
+
+        // Apply the collapses and drop the triangles that became degenerate
+        uint writeCount = 0;
+        for (uint i = 0; i < indexCount; i += 3) {
+            uint v0 = remap[destination[i + 0]];
+            uint v1 = remap[destination[i + 1]];
+            uint v2 = remap[destination[i + 2]];
+            if (position[v0] == position[v1] || position[v1] == position[v2] || position[v0] == position[v2]) continue;
+            destination[writeCount++] = v0;
+            destination[writeCount++] = v1;
+            destination[writeCount++] = v2;
+        }
+        indexCount = writeCount;
+    }
+
+    #undef SIMPLIFY_POSITION
+
+    if (resultError) *resultError = sqrtf(maxError);
+    return indexCount;
+}
@@ -0,0 +1,888 @@
+// Microbenchmarks of the math and scene kernels.
+//
+// Built as its own program by `make microbench`, from the same unity build as
+// the app with MICROBENCH defined so main.cpp leaves its main out. Every kernel
+// runs over a batch of elements prepared up front, and the batch size is swept
+// from one that fits in L1 to one that only fits in main memory.
+//
+// Each kernel and size is warmed up, then repeated enough times that a sample
+// takes at least MICROBENCH_MIN_SAMPLE_TIME, and that sample is taken a number of
+// times. The median sample is reported, with the median absolute deviation as
+// its noise, so the odd sample the scheduler interrupted doesn't move the
+// result. Cycles come from the time stamp counter where there is one, which on
+// current CPUs ticks at a fixed rate rather than with the core clock.
+//
+// Kernels add up what they compute and store it in g_microbenchSink, so the
+// compiler can't drop the work. New kernels go in the microbenchKernels table.
+//
+// Before anything is timed the batch math kernels are checked against the glm
+// code they stand in for, once for every instruction set the CPU has, and the
+// run fails if they disagree. The SSE2 mesh conversion is checked against the
+// scalar one the same way, and every version of the occlusion kernels has to
+// give the known answers for boxes around an occluder, including boxes behind
+// the camera. --verify only does the checks, and --isa=<name> caps the
+// instruction set for both the checks and the timings.
+
+#define MICROBENCH
+#include "main.cpp"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define MICROBENCH_CYCLE_COUNTER 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MICROBENCH_CYCLE_COUNTER 1
+#endif
+
+#include <chrono>
+
+#define MICROBENCH_MAX_ELEMENTS (1 << 20)
+#define MICROBENCH_MAX_SIZES 16
+#define MICROBENCH_DEFAULT_SAMPLES 25
+#define MICROBENCH_MAX_SAMPLES 1000
+#define MICROBENCH_WARMUP_TIME 0.05      // Seconds per kernel and size
+#define MICROBENCH_MIN_SAMPLE_TIME 0.002 // Seconds
+#define MICROBENCH_TRANSFORM_CHAIN 4     // Transforms per chain in the transform update
+#define MICROBENCH_VERIFY_COUNT 10005    // Not a multiple of any batch width, so the scalar tail is checked too
+#define MICROBENCH_EXACT_TOLERANCE 1e-5f // Relative, for kernels that should be bit-identical unless built with FMA
+#define MICROBENCH_TOLERANCE 1e-4f       // Relative, for kernels that round differently from glm
+
+// Element counts of the default sweep. A matrix is 64 bytes, so these are 1KB,
+// 64KB, 1MB, 16MB and 64MB of matrices.
+static const uint microbenchDefaultSizes[] = { 16, 1024, 16384, 262144, MICROBENCH_MAX_ELEMENTS };
+
+struct MicroBenchData {
+    MemoryArena arena;
+    uint count; // Elements in the current batch
+
+    glm::mat4* matrices;
+    glm::vec3* translations; // What the matrices were composed from, rotations in degrees
+    glm::vec3* rotations;
+    glm::vec3* scales;
+    glm::quat* quats;
+    glm::vec3* rayOrigins;
+    glm::vec3* rayDirections;
+    Sphere* spheres;
+    Camera* cameras;
+    AABB* bounds;
+    glm::mat4 viewProjection;
+    uint* programs;
+    uint* vaos;
+    float* depths;
+
+    // Batch math inputs, the same values as the ones above
+    glm::mat4* locals;
+    Mat4Soa matrixSoa;
+    Mat4Soa localSoa;
+    SphereSoa sphereSoa;
+    AABBSoa boundsSoa;
+    glm::vec4 frustumPlanes[BATCH_FRUSTUM_PLANES];
+
+    // Outputs, shared by the kernels
+    glm::mat4* outMatrices;
+    AABB* outBounds;
+    Mat4Soa outMatrixSoa;
+    AABBSoa outBoundsSoa;
+    Vec3Soa outPositions;
+    QuatSoa outRotations;
+    Vec3Soa outScales;
+    unsigned char* outFlags;
+    float* outDistances;
+};
+
+typedef void MicroBenchFunction(MicroBenchData* data);
+
+struct MicroBenchKernel {
+    const char* name;
+    MicroBenchFunction* run;
+    MicroBenchFunction* setup; // Called when the batch size changes, can be NULL
+};
+
+struct MicroBenchResult {
+    double nsPerElement; // Median
+    double madPercent;   // Median absolute deviation, relative to the median
+    double minNsPerElement;
+    double cyclesPerElement; // Median, 0 without a cycle counter
+    double opsPerSecond;
+    uint repeats; // Per sample
+};
+
+static volatile float g_microbenchSink;
+static OcclusionBuffer g_microbenchOcclusion;
+
+static inline double
+microbenchTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline unsigned long long
+readCycleCounter() {
+#if MICROBENCH_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline float
+randomFloat(uint* random) {
+    *random ^= *random << 13;
+    *random ^= *random >> 17;
+    *random ^= *random << 5;
+    return (*random & 0xffffff) / (float)0x1000000;
+}
+
+static inline glm::vec3
+randomVec3(uint* random, float min, float max) {
+    float x = randomFloat(random);
+    float y = randomFloat(random);
+    float z = randomFloat(random);
+    return glm::vec3(x, y, z) * (max - min) + min;
+}
+
+static void
+generateMicrobenchData(MicroBenchData* data) {
+    uint n = MICROBENCH_MAX_ELEMENTS;
+    initArena(&data->arena, (size_t)n * 1024, "microbench arena");
+    data->matrices = pushArray(&data->arena, glm::mat4, n);
+    data->translations = pushArray(&data->arena, glm::vec3, n);
+    data->rotations = pushArray(&data->arena, glm::vec3, n);
+    data->scales = pushArray(&data->arena, glm::vec3, n);
+    data->quats = pushArray(&data->arena, glm::quat, n);
+    data->rayOrigins = pushArray(&data->arena, glm::vec3, n);
+    data->rayDirections = pushArray(&data->arena, glm::vec3, n);
+    data->spheres = pushArray(&data->arena, Sphere, n);
+    data->cameras = pushArray(&data->arena, Camera, n);
+    data->bounds = pushArray(&data->arena, AABB, n);
+    data->programs = pushArray(&data->arena, uint, n);
+    data->vaos = pushArray(&data->arena, uint, n);
+    data->depths = pushArray(&data->arena, float, n);
+    data->locals = pushArray(&data->arena, glm::mat4, n);
+    data->matrixSoa = pushMat4Soa(&data->arena, n);
+    data->localSoa = pushMat4Soa(&data->arena, n);
+    data->sphereSoa = pushSphereSoa(&data->arena, n);
+    data->boundsSoa = pushAABBSoa(&data->arena, n);
+    data->outMatrices = pushArray(&data->arena, glm::mat4, n);
+    data->outBounds = pushArray(&data->arena, AABB, n);
+    data->outMatrixSoa = pushMat4Soa(&data->arena, n);
+    data->outBoundsSoa = pushAABBSoa(&data->arena, n);
+    data->outPositions = pushVec3Soa(&data->arena, n);
+    data->outRotations = pushQuatSoa(&data->arena, n);
+    data->outScales = pushVec3Soa(&data->arena, n);
+    data->outFlags = pushArray(&data->arena, unsigned char, n + BATCH_MAX_WIDTH);
+    data->outDistances = pushArray(&data->arena, float, n + BATCH_MAX_WIDTH);
+
+    uint random = 0x2545f491u; // Same data every run
+    for (uint i = 0; i < n; i++) {
+        data->translations[i] = randomVec3(&random, -100.0f, 100.0f);
+        data->rotations[i] = randomVec3(&random, -180.0f, 180.0f);
+        data->scales[i] = randomVec3(&random, 0.5f, 2.0f);
+        data->quats[i] = glm::quat(glm::radians(data->rotations[i]));
+        data->matrices[i] = composeTransform(data->translations[i], data->quats[i], data->scales[i]);
+
+        // About half of the rays hit their sphere
+        data->spheres[i].c = randomVec3(&random, -100.0f, 100.0f);
+        data->spheres[i].r = 1.0f + randomFloat(&random) * 4.0f;
+        data->rayOrigins[i] = randomVec3(&random, -100.0f, 100.0f);
+        glm::vec3 target = data->spheres[i].c + randomVec3(&random, -2.0f, 2.0f) * data->spheres[i].r;
+        data->rayDirections[i] = glm::normalize(target - data->rayOrigins[i]);
+
+        data->cameras[i] = constructCamera(data->translations[i].x, data->translations[i].y, data->translations[i].z,
+                                           0.0f, 1.0f, 0.0f, data->rotations[i].y, data->rotations[i].x * 0.45f);
+        data->cameras[i].fov = 30.0f + randomFloat(&random) * 60.0f;
+
+        glm::vec3 center = randomVec3(&random, -50.0f, 50.0f);
+        glm::vec3 extent = randomVec3(&random, 0.5f, 5.0f);
+        data->bounds[i].min = center - extent;
+        data->bounds[i].max = center + extent;
+
+        data->programs[i] = 1 + (uint)(randomFloat(&random) * 8);
+        data->vaos[i] = 1 + (uint)(randomFloat(&random) * 256);
+        data->depths[i] = randomFloat(&random) * Camera::FarPlane;
+
+        // Some of them mirrored, so decomposing them flips the scale
+        glm::vec3 localScale = randomVec3(&random, 0.5f, 2.0f);
+        if (randomFloat(&random) < 0.25f) localScale.x = -localScale.x;
+        glm::quat localRotation = glm::quat(glm::radians(randomVec3(&random, -180.0f, 180.0f)));
+        data->locals[i] = composeTransform(randomVec3(&random, -5.0f, 5.0f), localRotation, localScale);
+
+        setMat4Soa(&data->matrixSoa, i, data->matrices[i]);
+        setMat4Soa(&data->localSoa, i, data->locals[i]);
+        data->sphereSoa.center.x[i] = data->spheres[i].c.x;
+        data->sphereSoa.center.y[i] = data->spheres[i].c.y;
+        data->sphereSoa.center.z[i] = data->spheres[i].c.z;
+        data->sphereSoa.radius[i] = data->spheres[i].r;
+        data->boundsSoa.min.x[i] = data->bounds[i].min.x;
+        data->boundsSoa.min.y[i] = data->bounds[i].min.y;
+        data->boundsSoa.min.z[i] = data->bounds[i].min.z;
+        data->boundsSoa.max.x[i] = data->bounds[i].max.x;
+        data->boundsSoa.max.y[i] = data->bounds[i].max.y;
+        data->boundsSoa.max.z[i] = data->bounds[i].max.z;
+    }
+
+    // A wall in front of the camera that covers part of the screen, so both
+    // culled and visible boxes are tested and partially covered tiles are hit
+    Camera camera = constructCamera(0.0f, 0.0f, 80.0f, 0.0f, 1.0f, 0.0f, -90.0f, 0.0f);
+    data->viewProjection = calculateProjectionMatrix(&camera) * calculateViewMatrix(&camera);
+    glm::vec3 wall[] = { glm::vec3(-60, -40, 40), glm::vec3(20, -40, 40), glm::vec3(20, 40, 40), glm::vec3(-60, 40, 40) };
+    uint wallIndices[] = { 0, 1, 2, 0, 2, 3 };
+    clearOcclusionBuffer(&g_microbenchOcclusion);
+    rasterizeOccluder(&g_microbenchOcclusion, data->viewProjection, wall, 4, wallIndices, 6);
+    updateOcclusionTiles(&g_microbenchOcclusion);
+    extractFrustumPlanes(data->viewProjection, data->frustumPlanes);
+}
+
+// The glm versions of the batch math kernels without an existing scalar function
+
+static AABB
+referenceTransformAABB(const glm::mat4& matrix, AABB bounds) {
+    AABB result = { glm::vec3(INFINITY), glm::vec3(-INFINITY) };
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner = glm::vec3(i & 1 ? bounds.max.x : bounds.min.x, i & 2 ? bounds.max.y : bounds.min.y, i & 4 ? bounds.max.z : bounds.min.z);
+        glm::vec3 transformed = glm::vec3(matrix * glm::vec4(corner, 1.0f));
+        result.min = glm::min(result.min, transformed);
+        result.max = glm::max(result.max, transformed);
+    }
+    return result;
+}
+
+static inline bool
+referenceSphereInFrustum(const glm::vec4* planes, Sphere sphere) {
+    for (int i = 0; i < BATCH_FRUSTUM_PLANES; i++) {
+        if (glm::dot(glm::vec3(planes[i]), sphere.c) + planes[i].w < -sphere.r) return false;
+    }
+    return true;
+}
+
+static inline float
+referenceRayAABB(glm::vec3 origin, glm::vec3 inverseDirection, AABB bounds) {
+    glm::vec3 t0 = (bounds.min - origin) * inverseDirection;
+    glm::vec3 t1 = (bounds.max - origin) * inverseDirection;
+    glm::vec3 near = glm::min(t0, t1);
+    glm::vec3 far = glm::max(t0, t1);
+    float enter = glm::max(glm::max(near.x, near.y), glm::max(near.z, 0.0f));
+    float exit = glm::min(glm::min(far.x, far.y), far.z);
+    return enter <= exit ? enter : INFINITY;
+}
+
+static void
+benchRaySphere(MicroBenchData* data) {
+    uint hits = 0;
+    for (uint i = 0; i < data->count; i++) {
+        hits += intersectRaySphere(data->rayOrigins[i], data->rayDirections[i], data->spheres[i]);
+    }
+    g_microbenchSink = (float)hits;
+}
+
+static void
+benchGetScale(MicroBenchData* data) {
+    glm::vec3 sum = glm::vec3(0.0f);
+    for (uint i = 0; i < data->count; i++) {
+        sum += getScale(data->matrices[i]);
+    }
+    g_microbenchSink = sum.x + sum.y + sum.z;
+}
+
+static void
+benchViewMatrix(MicroBenchData* data) {
+    float sum = 0.0f;
+    for (uint i = 0; i < data->count; i++) {
+        sum += calculateViewMatrix(&data->cameras[i])[3][2];
+    }
+    g_microbenchSink = sum;
+}
+
+static void
+benchProjectionMatrix(MicroBenchData* data) {
+    float sum = 0.0f;
+    for (uint i = 0; i < data->count; i++) {
+        sum += calculateProjectionMatrix(&data->cameras[i])[1][1];
+    }
+    g_microbenchSink = sum;
+}
+
+static void
+benchGizmoDecompose(MicroBenchData* data) {
+    float sum = 0.0f;
+    for (uint i = 0; i < data->count; i++) {
+        float translation[3], rotation[3], scale[3];
+        ImGuizmo::DecomposeMatrixToComponents(&data->matrices[i][0][0], translation, rotation, scale);
+        sum += translation[0] + rotation[1] + scale[2];
+    }
+    g_microbenchSink = sum;
+}
+
+static void
+benchGizmoRecompose(MicroBenchData* data) {
+    float sum = 0.0f;
+    for (uint i = 0; i < data->count; i++) {
+        glm::mat4 matrix;
+        ImGuizmo::RecomposeMatrixFromComponents(&data->translations[i].x, &data->rotations[i].x, &data->scales[i].x, &matrix[0][0]);
+        sum += matrix[0][0] + matrix[3][1];
+    }
+    g_microbenchSink = sum;
+}
+
+static void
+benchDecomposeTransform(MicroBenchData* data) {
+    float sum = 0.0f;
+    for (uint i = 0; i < data->count; i++) {
+        glm::vec3 position, scale;
+        glm::quat rotation;
+        decomposeTransform(data->matrices[i], &position, &rotation, &scale);
+        sum += position.x + rotation.w + scale.z;
+    }
+    g_microbenchSink = sum;
+}
+
+static void
+benchComposeTransform(MicroBenchData* data) {
+    float sum = 0.0f;
+    for (uint i = 0; i < data->count; i++) {
+        glm::mat4 matrix = composeTransform(data->translations[i], data->quats[i], data->scales[i]);
+        sum += matrix[0][0] + matrix[3][1];
+    }
+    g_microbenchSink = sum;
+}
+
+// Chains of MICROBENCH_TRANSFORM_CHAIN transforms, so every level but the first has a parent
+static void
+setupTransforms(MicroBenchData* data) {
+    clearTransforms(&g_transforms);
+    for (uint i = 0; i < data->count; i++) {
+        uint parent = i % MICROBENCH_TRANSFORM_CHAIN == 0 ? NO_TRANSFORM : i - 1;
+        createTransform(&g_transforms, parent, data->matrices[i]);
+    }
+    updateTransforms(&g_transforms);
+    g_transforms.dirtyIndices.reserve(data->count);
+}
+
+static void
+benchUpdateTransforms(MicroBenchData* data) {
+    for (uint i = 0; i < data->count; i++) {
+        markTransformDirty(&g_transforms, i);
+    }
+    updateTransforms(&g_transforms);
+    g_microbenchSink = g_transforms.worlds[data->count - 1][3][0];
+}
+
+// Entities at the matrices' positions, looked at from above the middle of them
+static void
+setupPicking(MicroBenchData* data) {
+    setupTransforms(data);
+    entities.clear();
+    entities.resize(data->count);
+    for (uint i = 0; i < data->count; i++) {
+        entities[i].transform = i;
+    }
+    g_camera = constructCamera(0.0f, 0.0f, 150.0f, 0.0f, 1.0f, 0.0f, -90.0f, 0.0f);
+    g_entityIndicators.pixelRadius = ENTITY_INDICATOR_PIXEL_RADIUS;
+}
+
+static void
+benchPickEntities(MicroBenchData* data) {
+    g_microbenchSink = (float)findEntityUnderScreenPos(g_renderContext.width * 0.5f, g_renderContext.height * 0.5f);
+}
+
+static void
+benchOccludeeTest(MicroBenchData* data) {
+    uint visible = 0;
+    for (uint i = 0; i < data->count; i++) {
+        visible += testOccludee(&g_microbenchOcclusion, data->viewProjection, data->bounds[i]);
+    }
+    g_microbenchSink = (float)visible;
+}
+
+static void
+benchMat4Multiply(MicroBenchData* data) {
+    for (uint i = 0; i < data->count; i++) {
+        data->outMatrices[i] = data->matrices[i] * data->locals[i];
+    }
+    g_microbenchSink = data->outMatrices[data->count - 1][3][0];
+}
+
+static void
+benchBatchMat4Multiply(MicroBenchData* data) {
+    multiplyMat4Batch(&data->matrixSoa, &data->localSoa, &data->outMatrixSoa, data->count);
+    g_microbenchSink = data->outMatrixSoa.m[12][data->count - 1];
+}
+
+static void
+benchMat4Premultiply(MicroBenchData* data) {
+    for (uint i = 0; i < data->count; i++) {
+        data->outMatrices[i] = data->viewProjection * data->matrices[i];
+    }
+    g_microbenchSink = data->outMatrices[data->count - 1][3][0];
+}
+
+static void
+benchBatchMat4Premultiply(MicroBenchData* data) {
+    premultiplyMat4Batch(data->viewProjection, &data->matrixSoa, &data->outMatrixSoa, data->count);
+    g_microbenchSink = data->outMatrixSoa.m[12][data->count - 1];
+}
+
+static void
+benchAABBTransform(MicroBenchData* data) {
+    for (uint i = 0; i < data->count; i++) {
+        data->outBounds[i] = referenceTransformAABB(data->matrices[i], data->bounds[i]);
+    }
+    g_microbenchSink = data->outBounds[data->count - 1].min.x;
+}
+
+static void
+benchBatchAABBTransform(MicroBenchData* data) {
+    transformAABBBatch(&data->matrixSoa, &data->boundsSoa, &data->outBoundsSoa, data->count);
+    g_microbenchSink = data->outBoundsSoa.min.x[data->count - 1];
+}
+
+static void
+benchSphereFrustum(MicroBenchData* data) {
+    for (uint i = 0; i < data->count; i++) {
+        data->outFlags[i] = referenceSphereInFrustum(data->frustumPlanes, data->spheres[i]);
+    }
+    g_microbenchSink = data->outFlags[data->count - 1];
+}
+
+static void
+benchBatchSphereFrustum(MicroBenchData* data) {
+    spheresInFrustumBatch(data->frustumPlanes, &data->sphereSoa, data->outFlags, data->count);
+    g_microbenchSink = data->outFlags[data->count - 1];
+}
+
+// One ray against every sphere, like picking
+static void
+benchRaySpheres(MicroBenchData* data) {
+    for (uint i = 0; i < data->count; i++) {
+        data->outFlags[i] = intersectRaySphere(data->rayOrigins[0], data->rayDirections[0], data->spheres[i]);
+    }
+    g_microbenchSink = data->outFlags[data->count - 1];
+}
+
+static void
+benchBatchRaySpheres(MicroBenchData* data) {
+    intersectRaySphereBatch(data->rayOrigins[0], data->rayDirections[0], &data->sphereSoa, data->outFlags, data->count);
+    g_microbenchSink = data->outFlags[data->count - 1];
+}
+
+static void
+benchRayAABBs(MicroBenchData* data) {
+    glm::vec3 inverseDirection = 1.0f / data->rayDirections[0];
+    for (uint i = 0; i < data->count; i++) {
+        data->outDistances[i] = referenceRayAABB(data->rayOrigins[0], inverseDirection, data->bounds[i]);
+    }
+    g_microbenchSink = data->outDistances[data->count - 1];
+}
+
+static void
+benchBatchRayAABBs(MicroBenchData* data) {
+    intersectRayAABBBatch(data->rayOrigins[0], data->rayDirections[0], &data->boundsSoa, data->outDistances, data->count);
+    g_microbenchSink = data->outDistances[data->count - 1];
+}
+
+static void
+benchBatchDecompose(MicroBenchData* data) {
+    decomposeMat4Batch(&data->matrixSoa, &data->outPositions, &data->outRotations, &data->outScales, data->count);
+    g_microbenchSink = data->outRotations.w[data->count - 1];
+}
+
+static void
+benchRenderKey(MicroBenchData* data) {
+    unsigned long long sum = 0;
+    for (uint i = 0; i < data->count; i++) {
+        sum += makeRenderKey(data->programs[i], data->vaos[i], data->depths[i]);
+    }
+    g_microbenchSink = (float)sum;
+}
+
+static const MicroBenchKernel microbenchKernels[] = {
+    { "ray_sphere",                benchRaySphere,             NULL },
+    { "get_scale",                 benchGetScale,              NULL },
+    { "view_matrix",               benchViewMatrix,            NULL },
+    { "projection_matrix",         benchProjectionMatrix,      NULL },
+    { "gizmo_decompose",           benchGizmoDecompose,        NULL },
+    { "gizmo_recompose",           benchGizmoRecompose,        NULL },
+    { "decompose_transform",       benchDecomposeTransform,    NULL },
+    { "compose_transform",         benchComposeTransform,      NULL },
+    { "update_transforms",         benchUpdateTransforms,      setupTransforms },
+    { "pick_entities",             benchPickEntities,          setupPicking },
+    { "occludee_test",             benchOccludeeTest,          NULL },
+    { "render_key",                benchRenderKey,             NULL },
+    { "mat4_multiply",             benchMat4Multiply,          NULL },
+    { "batch_mat4_multiply",       benchBatchMat4Multiply,     NULL },
+    { "mat4_premultiply",          benchMat4Premultiply,       NULL },
+    { "batch_mat4_premultiply",    benchBatchMat4Premultiply,  NULL },
+    { "aabb_transform",            benchAABBTransform,         NULL },
+    { "batch_aabb_transform",      benchBatchAABBTransform,    NULL },
+    { "sphere_frustum",            benchSphereFrustum,         NULL },
+    { "batch_sphere_frustum",      benchBatchSphereFrustum,    NULL },
+    { "ray_spheres",               benchRaySpheres,            NULL },
+    { "batch_ray_spheres",         benchBatchRaySpheres,       NULL },
+    { "ray_aabbs",                 benchRayAABBs,              NULL },
+    { "batch_ray_aabbs",           benchBatchRayAABBs,         NULL },
+    { "batch_decompose_transform", benchBatchDecompose,        NULL },
+};
+
+struct BatchCheck {
+    const char* name;
+    uint values;
+    uint inexact; // Not bit-identical to glm
+    float maxError;
+    bool failed;
+};
+
+static inline void
+checkBatchValue(BatchCheck* check, float expected, float actual, float tolerance) {
+    check->values++;
+    if (memcmp(&expected, &actual, sizeof(float)) == 0) return;
+    check->inexact++;
+    float error = fabsf(actual - expected) / glm::max(fabsf(expected), 1.0f);
+    if (!(error <= tolerance)) check->failed = true; // Also when only one of them is infinite or NaN
+    check->maxError = glm::max(check->maxError, error);
+}
+
+static bool
+reportBatchCheck(BatchCheck* check) {
+    printf("%-26s %8u values, %6u not bit-identical, max relative error %g%s\n", check->name, check->values,
+           check->inexact, check->maxError, check->failed ? ", FAILED" : "");
+    return !check->failed;
+}
+
+// Checks the batch math kernels against glm on MICROBENCH_VERIFY_COUNT elements
+static bool
+verifyBatchMath(MicroBenchData* data) {
+    uint count = MICROBENCH_VERIFY_COUNT;
+    bool passed = true;
+    printf("Checking batch math (%s) against glm\n", cpuIsaNames[g_batchMath.isa]);
+
+    BatchCheck multiply = { "multiplyMat4Batch" };
+    multiplyMat4Batch(&data->matrixSoa, &data->localSoa, &data->outMatrixSoa, count);
+    for (uint i = 0; i < count; i++) {
+        glm::mat4 expected = data->matrices[i] * data->locals[i];
+        glm::mat4 actual = getMat4Soa(&data->outMatrixSoa, i);
+        for (int j = 0; j < 16; j++) checkBatchValue(&multiply, expected[j / 4][j % 4], actual[j / 4][j % 4], MICROBENCH_EXACT_TOLERANCE);
+    }
+    passed &= reportBatchCheck(&multiply);
+
+    BatchCheck premultiply = { "premultiplyMat4Batch" };
+    premultiplyMat4Batch(data->viewProjection, &data->matrixSoa, &data->outMatrixSoa, count);
+    for (uint i = 0; i < count; i++) {
+        glm::mat4 expected = data->viewProjection * data->matrices[i];
+        glm::mat4 actual = getMat4Soa(&data->outMatrixSoa, i);
+        for (int j = 0; j < 16; j++) checkBatchValue(&premultiply, expected[j / 4][j % 4], actual[j / 4][j % 4], MICROBENCH_EXACT_TOLERANCE);
+    }
+    passed &= reportBatchCheck(&premultiply);
+
+    BatchCheck aabb = { "transformAABBBatch" };
+    transformAABBBatch(&data->matrixSoa, &data->boundsSoa, &data->outBoundsSoa, count);
+    for (uint i = 0; i < count; i++) {
+        AABB expected = referenceTransformAABB(data->matrices[i], data->bounds[i]);
+        checkBatchValue(&aabb, expected.min.x, data->outBoundsSoa.min.x[i], MICROBENCH_TOLERANCE);
+        checkBatchValue(&aabb, expected.min.y, data->outBoundsSoa.min.y[i], MICROBENCH_TOLERANCE);
+        checkBatchValue(&aabb, expected.min.z, data->outBoundsSoa.min.z[i], MICROBENCH_TOLERANCE);
+        checkBatchValue(&aabb, expected.max.x, data->outBoundsSoa.max.x[i], MICROBENCH_TOLERANCE);
+        checkBatchValue(&aabb, expected.max.y, data->outBoundsSoa.max.y[i], MICROBENCH_TOLERANCE);
+        checkBatchValue(&aabb, expected.max.z, data->outBoundsSoa.max.z[i], MICROBENCH_TOLERANCE);
+    }
+    passed &= reportBatchCheck(&aabb);
+
+    BatchCheck frustum = { "spheresInFrustumBatch" };
+    spheresInFrustumBatch(data->frustumPlanes, &data->sphereSoa, data->outFlags, count);
+    for (uint i = 0; i < count; i++) {
+        checkBatchValue(&frustum, referenceSphereInFrustum(data->frustumPlanes, data->spheres[i]), data->outFlags[i], 0.0f);
+    }
+    passed &= reportBatchCheck(&frustum);
+
+    // Each group of spheres against the ray aimed at its first one, so some of them hit
+    BatchCheck raySphere = { "intersectRaySphereBatch" };
+    for (uint i = 0; i < count; i += BATCH_MAX_WIDTH) {
+        uint groupCount = glm::min(count - i, (uint)BATCH_MAX_WIDTH);
+        SphereSoa spheres = { { &data->sphereSoa.center.x[i], &data->sphereSoa.center.y[i], &data->sphereSoa.center.z[i] }, &data->sphereSoa.radius[i] };
+        intersectRaySphereBatch(data->rayOrigins[i], data->rayDirections[i], &spheres, &data->outFlags[i], groupCount);
+        for (uint j = 0; j < groupCount; j++) {
+            checkBatchValue(&raySphere, intersectRaySphere(data->rayOrigins[i], data->rayDirections[i], data->spheres[i + j]), data->outFlags[i + j], 0.0f);
+        }
+    }
+    passed &= reportBatchCheck(&raySphere);
+
+    BatchCheck rayAABB = { "intersectRayAABBBatch" };
+    for (uint i = 0; i < count; i += BATCH_MAX_WIDTH) {
+        uint groupCount = glm::min(count - i, (uint)BATCH_MAX_WIDTH);
+        AABBSoa bounds = {
+            { &data->boundsSoa.min.x[i], &data->boundsSoa.min.y[i], &data->boundsSoa.min.z[i] },
+            { &data->boundsSoa.max.x[i], &data->boundsSoa.max.y[i], &data->boundsSoa.max.z[i] },
+        };
+        intersectRayAABBBatch(data->rayOrigins[i], data->rayDirections[i], &bounds, &data->outDistances[i], groupCount);
+        glm::vec3 inverseDirection = 1.0f / data->rayDirections[i];
+        for (uint j = 0; j < groupCount; j++) {
+            checkBatchValue(&rayAABB, referenceRayAABB(data->rayOrigins[i], inverseDirection, data->bounds[i + j]), data->outDistances[i + j], MICROBENCH_TOLERANCE);
+        }
+    }
+    passed &= reportBatchCheck(&rayAABB);
+
+    BatchCheck decompose = { "decomposeMat4Batch" };
+    multiplyMat4Batch(&data->matrixSoa, &data->localSoa, &data->outMatrixSoa, count);
+    decomposeMat4Batch(&data->outMatrixSoa, &data->outPositions, &data->outRotations, &data->outScales, count);
+    for (uint i = 0; i < count; i++) {
+        glm::vec3 position, scale;
+        glm::quat rotation;
+        decomposeTransform(getMat4Soa(&data->outMatrixSoa, i), &position, &rotation, &scale);
+        checkBatchValue(&decompose, position.x, data->outPositions.x[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, position.y, data->outPositions.y[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, position.z, data->outPositions.z[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, rotation.x, data->outRotations.x[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, rotation.y, data->outRotations.y[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, rotation.z, data->outRotations.z[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, rotation.w, data->outRotations.w[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, scale.x, data->outScales.x[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, scale.y, data->outScales.y[i], MICROBENCH_EXACT_TOLERANCE);
+        checkBatchValue(&decompose, scale.z, data->outScales.z[i], MICROBENCH_EXACT_TOLERANCE);
+    }
+    passed &= reportBatchCheck(&decompose);
+
+    printf("\n");
+    return passed;
+}
+
+// The SSE2 mesh conversion has to give the same bytes as the scalar one, with
+// and without the optional streams
+static bool
+verifyVertexConversion(CpuIsa isa) {
+    if (isa < CPU_ISA_SSE2) return true;
+    ScratchScope scratch;
+    uint count = 1001;
+    float* streamData[5];
+    uint random = 0x9e3779b9u;
+    for (int s = 0; s < 5; s++) {
+        streamData[s] = pushArray(scratch.arena(), float, count * 3);
+        for (uint i = 0; i < count * 3; i++) streamData[s][i] = randomFloat(&random) * 2.0f - 1.0f;
+    }
+    Vertex* expected = pushArray(scratch.arena(), Vertex, count);
+    Vertex* actual = pushArray(scratch.arena(), Vertex, count);
+
+    bool passed = true;
+    // Positions are always there, so the first run has every stream
+    for (int missing = 0; missing < 5; missing++) {
+        const float* streams[5];
+        for (int s = 0; s < 5; s++) streams[s] = s == missing && s > 0 ? NULL : streamData[s];
+        VertexStreams vertexStreams = { streams[0], streams[1], streams[2], streams[3], streams[4] };
+        memset(actual, 0xff, count * sizeof(Vertex));
+        selectVertexConversion(CPU_ISA_SCALAR);
+        g_convertVertices(&vertexStreams, count, expected);
+        selectVertexConversion(isa);
+        g_convertVertices(&vertexStreams, count, actual);
+        if (memcmp(expected, actual, count * sizeof(Vertex)) != 0) passed = false;
+    }
+    printf("%-26s %8u vertices, %s\n\n", "convertVertices (sse2)", count, passed ? "bit-identical" : "FAILED");
+    return passed;
+}
+
+// A wall in front of the camera and boxes around it whose answer is known,
+// for one version of the occlusion kernels
+static bool
+verifyOcclusion(CpuIsa isa) {
+    selectOcclusionKernels(isa);
+    glm::mat4 viewProjection = glm::perspective(glm::radians(60.0f), (float)OCCLUSION_WIDTH / OCCLUSION_HEIGHT, 0.1f, 100.0f)
+                             * glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::vec3 wall[4] = {
+        glm::vec3(-2.0f, -2.0f, -10.0f), glm::vec3(2.0f, -2.0f, -10.0f),
+        glm::vec3(2.0f, 2.0f, -10.0f), glm::vec3(-2.0f, 2.0f, -10.0f),
+    };
+    uint wallIndices[6] = { 0, 1, 2, 0, 2, 3 };
+    clearOcclusionBuffer(&g_microbenchOcclusion);
+    rasterizeOccluder(&g_microbenchOcclusion, viewProjection, wall, 4, wallIndices, 6);
+    updateOcclusionTiles(&g_microbenchOcclusion);
+
+    struct OccludeeCase {
+        const char* name;
+        glm::vec3 center;
+        float halfSize;
+        bool visible;
+    };
+    OccludeeCase cases[] = {
+        { "behind the wall",         glm::vec3(0.0f, 0.0f, -20.0f), 0.5f, false },
+        { "in front of the wall",    glm::vec3(0.0f, 0.0f, -5.0f),  0.5f, true  },
+        { "beside the wall",         glm::vec3(6.0f, 0.0f, -20.0f), 0.5f, true  },
+        { "outside the frustum",     glm::vec3(0.0f, 50.0f, -20.0f), 0.5f, false },
+        { "behind the camera",       glm::vec3(0.0f, 0.0f, 10.0f),  0.5f, false },
+        { "across the near plane",   glm::vec3(0.0f, 0.0f, 0.0f),   1.0f, true  },
+    };
+    bool passed = true;
+    for (uint i = 0; i < arrayCount(cases); i++) {
+        AABB bounds = { cases[i].center - cases[i].halfSize, cases[i].center + cases[i].halfSize };
+        if (testOccludee(&g_microbenchOcclusion, viewProjection, bounds) != cases[i].visible) {
+            printf("  box %s should be %s\n", cases[i].name, cases[i].visible ? "visible" : "culled");
+            passed = false;
+        }
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "testOccludee (%s)", cpuIsaNames[isa]);
+    printf("%-26s %8u boxes, %s\n", name, (uint)arrayCount(cases), passed ? "as expected" : "FAILED");
+    return passed;
+}
+
+static double
+medianOf(double* values, uint count) {
+    std::sort(values, values + count);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) * 0.5;
+}
+
+static MicroBenchResult
+measureKernel(const MicroBenchKernel* kernel, MicroBenchData* data, uint sampleCount) {
+    // Warm up the caches, the branch predictors and the clock speed, and find
+    // how many repeats make a long enough sample
+    uint repeats = 1;
+    double start = microbenchTime();
+    double warmupEnd = start + MICROBENCH_WARMUP_TIME;
+    for (;;) {
+        double sampleStart = microbenchTime();
+        for (uint i = 0; i < repeats; i++) kernel->run(data);
+        double now = microbenchTime();
+        if (now - sampleStart < MICROBENCH_MIN_SAMPLE_TIME) {
+            repeats *= 2;
+        } else if (now >= warmupEnd) {
+            break;
+        }
+    }
+
+    double times[MICROBENCH_MAX_SAMPLES];
+    double cycles[MICROBENCH_MAX_SAMPLES];
+    for (uint i = 0; i < sampleCount; i++) {
+        double sampleStart = microbenchTime();
+        unsigned long long cycleStart = readCycleCounter();
+        for (uint j = 0; j < repeats; j++) kernel->run(data);
+        unsigned long long cycleEnd = readCycleCounter();
+        double elements = (double)repeats * data->count;
+        times[i] = (microbenchTime() - sampleStart) * 1e9 / elements;
+        cycles[i] = (cycleEnd - cycleStart) / elements;
+    }
+
+    MicroBenchResult result = {};
+    result.repeats = repeats;
+    result.nsPerElement = medianOf(times, sampleCount);
+    result.minNsPerElement = times[0]; // Sorted by medianOf
+    result.cyclesPerElement = medianOf(cycles, sampleCount);
+    result.opsPerSecond = 1e9 / result.nsPerElement;
+    for (uint i = 0; i < sampleCount; i++) {
+        times[i] = fabs(times[i] - result.nsPerElement);
+    }
+    result.madPercent = medianOf(times, sampleCount) / result.nsPerElement * 100.0;
+    return result;
+}
+
+static uint
+parseMicrobenchSizes(const char* list, uint* sizes) {
+    uint count = 0;
+    while (*list && count < MICROBENCH_MAX_SIZES) {
+        uint size = (uint)strtoul(list, (char**)&list, 10);
+        if (size > 0) sizes[count++] = glm::min(size, (uint)MICROBENCH_MAX_ELEMENTS);
+        if (*list == ',') list++;
+        else if (*list) break;
+    }
+    return count;
+}
+
+int main(int argc, char** argv) {
+    const char* filter = NULL;
+    const char* outPath = NULL;
+    bool verifyOnly = false;
+    uint sampleCount = MICROBENCH_DEFAULT_SAMPLES;
+    uint threadCount = 0;
+    detectCpuFeatures(&g_cpu);
+    uint sizes[MICROBENCH_MAX_SIZES];
+    uint sizeCount = arrayCount(microbenchDefaultSizes);
+    memcpy(sizes, microbenchDefaultSizes, sizeof(microbenchDefaultSizes));
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--sizes=", 8) == 0) {
+            sizeCount = parseMicrobenchSizes(argv[i] + 8, sizes);
+        } else if (strncmp(argv[i], "--samples=", 10) == 0) {
+            sampleCount = glm::clamp((uint)atoi(argv[i] + 10), 1u, (uint)MICROBENCH_MAX_SAMPLES);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threadCount = (uint)atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--out=", 6) == 0) {
+            outPath = argv[i] + 6;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verifyOnly = true;
+        } else if (strncmp(argv[i], "--isa=", 6) == 0) {
+            CpuIsa isa;
+            if (!parseCpuIsa(argv[i] + 6, &isa)) {
+                fprintf(stderr, "Unknown instruction set: %s\n", argv[i] + 6);
+                return 1;
+            }
+            limitCpuIsa(&g_cpu, isa);
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            fprintf(stderr, "Usage: microbench [--filter=name] [--sizes=16,1024,...] [--samples=N] [--threads=N] [--out=file.json] [--verify] [--isa=name]\n");
+            return 1;
+        }
+    }
+
+    initFrameMemory();
+    initJobSystem(&g_jobs, threadCount);
+    g_renderContext.width = 1280;
+    g_renderContext.height = 720;
+
+    MicroBenchData data = {};
+    generateMicrobenchData(&data);
+    printf("CPU: %s, %s (using %s)\n\n", cpuBrand(&g_cpu), cpuIsaNames[g_cpu.detected], cpuIsaNames[g_cpu.active]);
+    // Every batch math version up to the active one, each only once
+    bool verified = true;
+    for (int isa = CPU_ISA_SCALAR; isa <= g_cpu.active; isa++) {
+        selectBatchMathKernels((CpuIsa)isa);
+        if (isa != CPU_ISA_SCALAR && g_batchMath.isa != isa) continue;
+        verified &= verifyBatchMath(&data);
+    }
+    verified &= verifyOcclusion(CPU_ISA_SCALAR);
+    if (g_cpu.active >= CPU_ISA_SSE2) verified &= verifyOcclusion(CPU_ISA_SSE2);
+    if (g_cpu.active >= CPU_ISA_AVX) verified &= verifyOcclusion(CPU_ISA_AVX);
+    printf("\n");
+    verified &= verifyVertexConversion(g_cpu.active);
+    selectBatchMathKernels(g_cpu.active);
+    selectOcclusionKernels(g_cpu.active);
+    selectVertexConversion(g_cpu.active);
+    FILE* out = NULL;
+    if (verified && !verifyOnly && outPath) {
+        out = fopen(outPath, "w");
+        if (!out) {
+            fprintf(stderr, "ERROR::MICROBENCH:: could not open %s\n", outPath);
+            verified = false;
+        }
+    }
+    if (!verified || verifyOnly) {
+        shutdownJobSystem(&g_jobs);
+        return verified ? 0 : 1;
+    }
+
+    printf("%-26s %8s %11s %7s %11s %11s %14s\n", "kernel", "size", "ns/elem", "mad", "min ns", "cycles/elem", "ops/s");
+    if (out) fprintf(out, "[\n");
+    bool first = true;
+    for (uint k = 0; k < arrayCount(microbenchKernels); k++) {
+        const MicroBenchKernel* kernel = &microbenchKernels[k];
+        if (filter && !strstr(kernel->name, filter)) continue;
+        for (uint s = 0; s < sizeCount; s++) {
+            data.count = sizes[s];
+            if (kernel->setup) kernel->setup(&data);
+            MicroBenchResult result = measureKernel(kernel, &data, sampleCount);
+
+            printf("%-26s %8u %11.3f %6.1f%% %11.3f %11.2f %14.4g\n", kernel->name, data.count, result.nsPerElement,
+                   result.madPercent, result.minNsPerElement, result.cyclesPerElement, result.opsPerSecond);
+            fflush(stdout);
+            if (out) {
+                fprintf(out, "%s{\"kernel\": \"%s\", \"size\": %u, \"ns_per_element\": %.4f, \"mad_percent\": %.2f, "
+                        "\"min_ns_per_element\": %.4f, \"cycles_per_element\": %.3f, \"ops_per_second\": %.6g, \"repeats\": %u}",
+                        first ? "" : ",\n", kernel->name, data.count, result.nsPerElement, result.madPercent,
+                        result.minNsPerElement, result.cyclesPerElement, result.opsPerSecond, result.repeats);
+                first = false;
+            }
+        }
+    }
+    if (out) {
+        fprintf(out, "\n]\n");
+        fclose(out);
+        printf("Wrote %s\n", outPath);
+    }
+
+    shutdownJobSystem(&g_jobs);
+    return 0;
+}
@@ -10,44 +10,172 @@ struct Vertex {
     glm::vec3 Bitangent;
 };
 
+struct AABB {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+static AABB
+transformAABB(AABB bounds, const glm::mat4& matrix) {
+    AABB result = { glm::vec3(INFINITY), glm::vec3(-INFINITY) };
+    for(int i = 0; i < 8; i++) {
+        glm::vec3 corner = glm::vec3((i & 1) ? bounds.max.x : bounds.min.x,
+                                     (i & 2) ? bounds.max.y : bounds.min.y,
+                                     (i & 4) ? bounds.max.z : bounds.min.z);
+        corner = glm::vec3(matrix * glm::vec4(corner, 1.0f));
+        result.min = glm::min(result.min, corner);
+        result.max = glm::max(result.max, corner);
+    }
+    return result;
+}
+
 struct Texture {
-    uint id;
-    std::string type;
-    std::string path;
+    uint streamed; // Texture array, index into g_textureStreamer.textures
+    uint layer;
+    TextureSlot type;
+    StringId path; // As written in the model file, interned
+};
+
+#define MAX_LODS 5
+
+struct MeshLod {
+    uint indexOffset;
+    uint indexCount;
+    float error; // Largest deviation from the full detail mesh, in model space
 };
 
 struct Mesh {
     uint VAO;
+    uint VBO;
+    uint EBO;
+    uint node;           // Node of the model the mesh hangs from
+    glm::mat4 transform; // Node space to model space
     std::vector<Vertex> vertices;
-    std::vector<uint> indices;
+    std::vector<uint> indices; // All the LODs one after another, LOD 0 first
     std::vector<Texture> textures;
+    // Only the first texture of each slot is used
+    MaterialBinding bindings[TEXTURE_SLOT_COUNT];
+    uint bindingCount;
+    AABB bounds; // In node space
+    MeshLod lods[MAX_LODS];
+    uint lodCount;
+};
+
+// Node hierarchy of the imported file, meshes keep their node's transform
+struct ModelNode {
+    uint parent;         // ~0u for the root
+    glm::mat4 transform; // Relative to the parent, mTransformation
+    glm::mat4 global;    // Relative to the root
 };
 
+struct Impostor;
+
 struct Model {
     std::vector<Texture> textures_loaded; // stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
     std::vector<Mesh> meshes;
+    std::vector<ModelNode> nodes;
+    AABB bounds; // In model space, with the node transforms applied
+    // Per LOD values over all the meshes, meshes with less LODs use their last one
+    uint lodCount;
+    float lodErrors[MAX_LODS];
+    uint lodTriangleCounts[MAX_LODS];
+    // Positions only copy of the model for the software occlusion culler
+    std::vector<glm::vec3> occluderVertices;
+    std::vector<uint> occluderIndices;
+    Impostor* impostor; // Set when the model has been baked into an impostor
     std::string directory;
     bool gammaCorrection;
 };
 
+// Simplifies the mesh to half the triangles per level until it can't be reduced
+// further, appending the index ranges of each level after the original indices
+static uint
+generateLods(std::vector<uint>* indices, const std::vector<Vertex>& vertices, AABB bounds, MeshLod* lods) {
+    const float maxRelativeError = 0.1f;
+    const float minReduction = 0.9f;
+
+    uint baseIndexCount = indices->size();
+    lods[0].indexOffset = 0;
+    lods[0].indexCount = baseIndexCount;
+    lods[0].error = 0.f;
+    if(baseIndexCount == 0) return 1;
+
+    float maxError = glm::length(bounds.max - bounds.min) * maxRelativeError;
+    ScratchScope scratch;
+    uint* lodIndices = pushArray(scratch.arena(), uint, baseIndexCount);
+
+    uint lodCount = 1;
+    while(lodCount < MAX_LODS) {
+        MeshLod* previous = &lods[lodCount - 1];
+        uint target = baseIndexCount >> lodCount;
+        target -= target % 3;
+
+        float error;
+        uint indexCount = simplifyMesh(lodIndices, &(*indices)[0], baseIndexCount,
+                                       &vertices[0], vertices.size(), sizeof(Vertex), offsetof(Vertex, Tangent),
+                                       target, maxError, &error);
+        if(indexCount == 0 || indexCount > previous->indexCount * minReduction) break;
+
+        MeshLod* lod = &lods[lodCount++];
+        lod->indexOffset = indices->size();
+        lod->indexCount = indexCount;
+        lod->error = error;
+        indices->insert(indices->end(), lodIndices, lodIndices + indexCount);
+    }
+
+    return lodCount;
+}
+
+// The LODs and the GL buffers are made later by buildMeshLods and uploadMesh, so
+// the LODs of all the meshes can be built in parallel
 static Mesh
 setupMesh(std::vector<Vertex> vertices, std::vector<uint> indices, std::vector<Texture> textures) {
     Mesh mesh = {};
-    mesh.vertices = vertices;
-    mesh.indices = indices;
-    mesh.textures = textures;
+    mesh.vertices = std::move(vertices);
+    mesh.indices = std::move(indices);
+    mesh.textures = std::move(textures);
+
+    bool slotUsed[TEXTURE_SLOT_COUNT] = {};
+    for(int i = 0; i < mesh.textures.size(); i++) {
+        TextureSlot slot = mesh.textures[i].type;
+        if(slotUsed[slot]) continue;
+        slotUsed[slot] = true;
+
+        MaterialBinding* binding = &mesh.bindings[mesh.bindingCount++];
+        binding->slot = slot;
+        binding->unit = textureSlotUnit(slot);
+        binding->texture = mesh.textures[i].streamed;
+        binding->layer = mesh.textures[i].layer;
+    }
 
-    uint VBO, EBO;
-    glGenVertexArrays(1, &mesh.VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
+    mesh.bounds.min = glm::vec3(INFINITY);
+    mesh.bounds.max = glm::vec3(-INFINITY);
+    for(int i = 0; i < mesh.vertices.size(); i++) {
+        mesh.bounds.min = glm::min(mesh.bounds.min, mesh.vertices[i].Position);
+        mesh.bounds.max = glm::max(mesh.bounds.max, mesh.vertices[i].Position);
+    }
+
+    return mesh;
+}
+
+// Safe to call from any thread
+static void
+buildMeshLods(Mesh* mesh) {
+    mesh->lodCount = generateLods(&mesh->indices, mesh->vertices, mesh->bounds, mesh->lods);
+}
+
+static void
+uploadMesh(Mesh* mesh) {
+    glGenVertexArrays(1, &mesh->VAO);
+    glGenBuffers(1, &mesh->VBO);
+    glGenBuffers(1, &mesh->EBO);
 
-    glBindVertexArray(mesh.VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+    glBindVertexArray(mesh->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->VBO);
+    glBufferData(GL_ARRAY_BUFFER, mesh->vertices.size() * sizeof(Vertex), &mesh->vertices[0], GL_STATIC_DRAW);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint), &indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->indices.size() * sizeof(uint), &mesh->indices[0], GL_STATIC_DRAW);
 
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
@@ -61,154 +189,175 @@ setupMesh(std::vector<Vertex> vertices, std::vector<uint> indices, std::vector<T
     glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
 
     glBindVertexArray(0);
-
-    return mesh;
 }
 
-void drawMesh(Mesh* mesh, Shader shader) {
-    uint diffuseNr  = 1;
-    uint specularNr = 1;
-    uint normalNr   = 1;
-    uint heightNr   = 1;
+// Texture array bound to each slot's texture unit, so meshes sharing arrays don't rebind anything
+static uint g_boundTextureArrays[TEXTURE_SLOT_COUNT];
 
-    use(shader);
-    for(uint i = 0; i < mesh->textures.size(); i++) {
-        glActiveTexture(GL_TEXTURE0 + i);
-
-        std::string number;
-        std::string name = mesh->textures[i].type;
-        if(name == "texture_diffuse")
-            number = std::to_string(diffuseNr++);
-        else if(name == "texture_specular")
-            number = std::to_string(specularNr++);
-        else if(name == "texture_normal")
-            number = std::to_string(normalNr++);
-            else if(name == "texture_height")
-            number = std::to_string(heightNr++);
-
-        setInt(shader, (name + number).c_str(), i);
-        glBindTexture(GL_TEXTURE_2D, mesh->textures[i].id);
+// Binds the mesh's texture arrays and sets its layers, the shader has to be in use
+static void
+bindMeshMaterial(Mesh* mesh, Shader shader) {
+    for(uint i = 0; i < mesh->bindingCount; i++) {
+        MaterialBinding* binding = &mesh->bindings[i];
+        uint id = g_textureStreamer.textures[binding->texture].id;
+        if(g_boundTextureArrays[binding->unit] != id) {
+            glActiveTexture(GL_TEXTURE0 + binding->unit);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+            g_boundTextureArrays[binding->unit] = id;
+        }
+        int location = shader.materialLayerLocations[binding->slot];
+        if(location >= 0) glUniform1i(location, binding->layer);
     }
+}
 
+void drawMesh(Mesh* mesh, Shader shader, uint lod) {
+    use(shader);
+    bindMeshMaterial(mesh, shader);
+
+    MeshLod* meshLod = &mesh->lods[glm::min(lod, mesh->lodCount - 1)];
     glBindVertexArray(mesh->VAO);
-    glDrawElements(GL_TRIANGLES, mesh->indices.size(), GL_UNSIGNED_INT, 0);
+    glDrawElements(GL_TRIANGLES, meshLod->indexCount, GL_UNSIGNED_INT, (void*)(meshLod->indexOffset * sizeof(uint)));
     glBindVertexArray(0);
 
     glActiveTexture(GL_TEXTURE0);
 }
 
 static void
-drawModel(Model* model, Shader shader) {
+drawModel(Model* model, Shader shader, uint lod, const glm::mat4& modelMatrix) {
+    use(shader);
     for(int i = 0; i < model->meshes.size(); i++) {
-        drawMesh(&model->meshes[i], shader);
+        Mesh* mesh = &model->meshes[i];
+        setMat4(shader, SID("model"), modelMatrix * mesh->transform);
+        drawMesh(mesh, shader, lod);
     }
 }
 
-static uint
-textureFromFile(const char *path, std::string directory, bool gamma) {
+// Only registers the image as a layer of a texture array, the arrays are created
+// by createTextureArrays once everything is loaded
+static TextureLayer
+textureFromFile(const char *path, std::string directory, TextureSlot slot, bool gamma) {
     std::string filename = directory + '/' + std::string(path);
-
-    uint textureID;
-    glGenTextures(1, &textureID);
-
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data) {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
-    } else {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
-    }
-
-    return textureID;
+    return addTextureLayer(&g_textureStreamer, internString(filename.c_str(), filename.size()), slot);
 }
 
-static std::vector<Texture>
-loadMaterialTextures(Model* model, aiMaterial *mat, aiTextureType type, std::string typeName) {
-    std::vector<Texture> textures;
+// Appends the material's textures of the given type to textures
+static void
+loadMaterialTextures(std::vector<Texture>* textures, Model* model, aiMaterial *mat, aiTextureType type, TextureSlot slot) {
     for(int i = 0; i < mat->GetTextureCount(type); i++) {
         aiString str;
         mat->GetTexture(type, i, &str);
+        StringId path = internString(str.C_Str(), str.length);
         bool skip = false;
         for(int j = 0; j < model->textures_loaded.size(); j++) {
-            if(std::strcmp(model->textures_loaded[j].path.data(), str.C_Str()) == 0)
+            if(model->textures_loaded[j].path == path)
             {
-                textures.push_back(model->textures_loaded[j]);
+                textures->push_back(model->textures_loaded[j]);
                 skip = true;
                 break;
             }
         }
         if(!skip) {
             Texture texture;
-            texture.id = textureFromFile(str.C_Str(), model->directory, model->gammaCorrection);
-            texture.type = typeName;
-            texture.path = str.C_Str();
-            textures.push_back(texture);
+            TextureLayer textureLayer = textureFromFile(str.C_Str(), model->directory, slot, model->gammaCorrection);
+            texture.streamed = textureLayer.texture;
+            texture.layer = textureLayer.layer;
+            texture.type = slot;
+            texture.path = path;
+            textures->push_back(texture);
             model->textures_loaded.push_back(texture);  // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
         }
     }
-    return textures;
+}
+
+// The per vertex attributes of an assimp mesh, NULL where it has none
+struct VertexStreams {
+    const float* positions;
+    const float* normals;
+    const float* texCoords; // 3 floats per vertex, only x and y are used
+    const float* tangents;
+    const float* bitangents;
+};
+
+static_assert(sizeof(aiVector3D) == 3 * sizeof(float), "assimp vectors are read as floats");
+static_assert(sizeof(Vertex) == 14 * sizeof(float), "Vertex is written as floats");
+
+static inline void
+convertVertexScalar(const VertexStreams* streams, uint i, Vertex* vertex) {
+    *vertex = {};
+    const float* p = streams->positions + i * 3;
+    vertex->Position = glm::vec3(p[0], p[1], p[2]);
+    if (streams->normals) {
+        const float* n = streams->normals + i * 3;
+        vertex->Normal = glm::vec3(n[0], n[1], n[2]);
+    }
+    if (streams->texCoords) {
+        const float* t = streams->texCoords + i * 3;
+        vertex->TexCoords = glm::vec2(t[0], t[1]);
+    }
+    if (streams->tangents) {
+        const float* t = streams->tangents + i * 3;
+        vertex->Tangent = glm::vec3(t[0], t[1], t[2]);
+    }
+    if (streams->bitangents) {
+        const float* b = streams->bitangents + i * 3;
+        vertex->Bitangent = glm::vec3(b[0], b[1], b[2]);
+    }
+}
+
+static void
+convertVerticesScalar(const VertexStreams* streams, uint count, Vertex* vertices) {
+    for (uint i = 0; i < count; i++) convertVertexScalar(streams, i, &vertices[i]);
+}
+
+#if CPU_X86
+CPU_TARGET_BEGIN("sse2")
+// Every attribute is moved as one 16 byte load and store. The fourth float
+// belongs to the next vertex in the source and to the next attribute in the
+// destination, which the following store overwrites, so the attributes are
+// written in order and the last vertex, whose stores would run past the end,
+// is done by the scalar code.
+static void
+convertVerticesSse2(const VertexStreams* streams, uint count, Vertex* vertices) {
+    if (count == 0) return;
+    __m128 zero = _mm_setzero_ps();
+    for (uint i = 0; i + 1 < count; i++) {
+        float* out = (float*)&vertices[i];
+        uint offset = i * 3;
+        _mm_storeu_ps(out + 0, _mm_loadu_ps(streams->positions + offset));
+        _mm_storeu_ps(out + 3, streams->normals ? _mm_loadu_ps(streams->normals + offset) : zero);
+        _mm_storel_pi((__m64*)(out + 6), streams->texCoords ? _mm_loadu_ps(streams->texCoords + offset) : zero);
+        _mm_storeu_ps(out + 8, streams->tangents ? _mm_loadu_ps(streams->tangents + offset) : zero);
+        _mm_storeu_ps(out + 11, streams->bitangents ? _mm_loadu_ps(streams->bitangents + offset) : zero);
+    }
+    convertVertexScalar(streams, count - 1, &vertices[count - 1]);
+}
+CPU_TARGET_END
+#endif
+
+static void (*g_convertVertices)(const VertexStreams* streams, uint count, Vertex* vertices) = convertVerticesScalar;
+
+static void
+selectVertexConversion(CpuIsa isa) {
+    g_convertVertices = convertVerticesScalar;
+#if CPU_X86
+    if (isa >= CPU_ISA_SSE2) g_convertVertices = convertVerticesSse2;
+#endif
 }
 
 static Mesh
 processMesh(Model* model, aiMesh *mesh, const aiScene *scene) {
-    std::vector<Vertex> vertices;
+    std::vector<Vertex> vertices(mesh->mNumVertices);
     std::vector<uint> indices;
     std::vector<Texture> textures;
+    indices.reserve(mesh->mNumFaces * 3);
 
-    for(int i = 0; i < mesh->mNumVertices; i++) {
-        Vertex vertex = {};
-        glm::vec3 vector;
-
-        vector.x = mesh->mVertices[i].x;
-        vector.y = mesh->mVertices[i].y;
-        vector.z = mesh->mVertices[i].z;
-        vertex.Position = vector;
-
-        vector.x = mesh->mNormals[i].x;
-        vector.y = mesh->mNormals[i].y;
-        vector.z = mesh->mNormals[i].z;
-        vertex.Normal = vector;
-
-        if(mesh->mTextureCoords[0]) {
-            glm::vec2 vec;
-            vec.x = mesh->mTextureCoords[0][i].x;
-            vec.y = mesh->mTextureCoords[0][i].y;
-            vertex.TexCoords = vec;
-        }
-
-        if(mesh->mTangents) {
-            vector.x = mesh->mTangents[i].x;
-            vector.y = mesh->mTangents[i].y;
-            vector.z = mesh->mTangents[i].z;
-            vertex.Tangent = vector;
-        }
-
-        if(mesh->mBitangents) {
-            vector.x = mesh->mBitangents[i].x;
-            vector.y = mesh->mBitangents[i].y;
-            vector.z = mesh->mBitangents[i].z;
-            vertex.Bitangent = vector;
-        }
-        vertices.push_back(vertex);
-    }
+    VertexStreams streams;
+    streams.positions = (const float*)mesh->mVertices;
+    streams.normals = (const float*)mesh->mNormals;
+    streams.texCoords = (const float*)mesh->mTextureCoords[0];
+    streams.tangents = (const float*)mesh->mTangents;
+    streams.bitangents = (const float*)mesh->mBitangents;
+    g_convertVertices(&streams, mesh->mNumVertices, vertices.data());
 
     for(int i = 0; i < mesh->mNumFaces; i++) {
         aiFace face = mesh->mFaces[i];
@@ -219,51 +368,158 @@ processMesh(Model* model, aiMesh *mesh, const aiScene *scene) {
 
     aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
 
-    std::vector<Texture> diffuseMaps = loadMaterialTextures(model, material, aiTextureType_DIFFUSE, "texture_diffuse");
-    textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-
-    std::vector<Texture> specularMaps = loadMaterialTextures(model, material, aiTextureType_SPECULAR, "texture_specular");
-    textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
-
-    std::vector<Texture> normalMaps = loadMaterialTextures(model, material, aiTextureType_HEIGHT, "texture_normal");
-    textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
-
-    std::vector<Texture> heightMaps = loadMaterialTextures(model, material, aiTextureType_AMBIENT, "texture_height");
-    textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
+    loadMaterialTextures(&textures, model, material, aiTextureType_DIFFUSE, TEXTURE_SLOT_DIFFUSE);
+    loadMaterialTextures(&textures, model, material, aiTextureType_SPECULAR, TEXTURE_SLOT_SPECULAR);
+    loadMaterialTextures(&textures, model, material, aiTextureType_HEIGHT, TEXTURE_SLOT_NORMAL);
+    loadMaterialTextures(&textures, model, material, aiTextureType_AMBIENT, TEXTURE_SLOT_HEIGHT);
 
-    return setupMesh(vertices, indices, textures);
+    return setupMesh(std::move(vertices), std::move(indices), std::move(textures));
 }
 
 static void
-processNode(Model* model, aiNode *node, const aiScene *scene) {
+processNode(Model* model, aiNode *node, const aiScene *scene, uint parent) {
+    ModelNode modelNode;
+    modelNode.parent = parent;
+    // Assimp matrices are row major
+    for(int row = 0; row < 4; row++) {
+        for(int column = 0; column < 4; column++) {
+            modelNode.transform[column][row] = node->mTransformation[row][column];
+        }
+    }
+    modelNode.global = parent == ~0u ? modelNode.transform : model->nodes[parent].global * modelNode.transform;
+    uint nodeIndex = model->nodes.size();
+    model->nodes.push_back(modelNode);
+
     for(int i = 0; i < node->mNumMeshes; i++) {
         aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
         model->meshes.push_back(processMesh(model, mesh, scene));
+        model->meshes.back().node = nodeIndex;
+        model->meshes.back().transform = modelNode.global;
     }
 
     for(int i = 0; i < node->mNumChildren; i++) {
-        processNode(model, node->mChildren[i], scene);
+        processNode(model, node->mChildren[i], scene, nodeIndex);
     }
 
 }
 
-static Model
-loadModel(std::string path, bool gammaCorrection = false) {
-    Model model = {};
-    model.gammaCorrection = gammaCorrection;
+// Bounds, per LOD stats and the occluder, once the meshes have their LODs
+static void
+finishModel(Model* model) {
+    model->bounds.min = glm::vec3(INFINITY);
+    model->bounds.max = glm::vec3(-INFINITY);
+    model->lodCount = 1;
+    for(int i = 0; i < model->meshes.size(); i++) {
+        Mesh* mesh = &model->meshes[i];
+        AABB meshBounds = transformAABB(mesh->bounds, mesh->transform);
+        model->bounds.min = glm::min(model->bounds.min, meshBounds.min);
+        model->bounds.max = glm::max(model->bounds.max, meshBounds.max);
+        model->lodCount = glm::max(model->lodCount, mesh->lodCount);
+    }
 
+    for(uint lod = 0; lod < model->lodCount; lod++) {
+        model->lodErrors[lod] = 0.f;
+        model->lodTriangleCounts[lod] = 0;
+        for(int i = 0; i < model->meshes.size(); i++) {
+            Mesh* mesh = &model->meshes[i];
+            MeshLod* meshLod = &mesh->lods[glm::min(lod, mesh->lodCount - 1)];
+            model->lodErrors[lod] = glm::max(model->lodErrors[lod], meshLod->error);
+            model->lodTriangleCounts[lod] += meshLod->indexCount / 3;
+        }
+    }
+
+    // Occlude with the coarsest LOD that still stays close to the real silhouette
+    const float maxOccluderRelativeError = 0.01f;
+    float maxOccluderError = glm::length(model->bounds.max - model->bounds.min) * maxOccluderRelativeError;
+    for(int i = 0; i < model->meshes.size(); i++) {
+        Mesh* mesh = &model->meshes[i];
+        uint occluderLod = 0;
+        while(occluderLod + 1 < mesh->lodCount && mesh->lods[occluderLod + 1].error <= maxOccluderError) {
+            occluderLod++;
+        }
+        MeshLod* meshLod = &mesh->lods[occluderLod];
+
+        // Only keep the vertices the LOD uses
+        ScratchScope scratch;
+        uint* occluderRemap = pushArray(scratch.arena(), uint, mesh->vertices.size());
+        memset(occluderRemap, 0xff, mesh->vertices.size() * sizeof(uint));
+        for(uint j = 0; j < meshLod->indexCount; j++) {
+            uint index = mesh->indices[meshLod->indexOffset + j];
+            if(occluderRemap[index] == ~0u) {
+                occluderRemap[index] = model->occluderVertices.size();
+                model->occluderVertices.push_back(glm::vec3(mesh->transform * glm::vec4(mesh->vertices[index].Position, 1.0f)));
+            }
+            model->occluderIndices.push_back(occluderRemap[index]);
+        }
+    }
+}
+
+struct ModelImport {
+    const char* path;
     Assimp::Importer importer;
-    // Scene is freed during Importer's destructor
-    const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
-    if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
-        std::cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << std::endl;
-        return model;
+    const aiScene* scene; // Freed with the importer
+};
+
+static void
+importModelJob(void* data, uint first, uint last) {
+    ModelImport* imports = (ModelImport*)data;
+    for(uint i = first; i < last; i++) {
+        imports[i].scene = imports[i].importer.ReadFile(imports[i].path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+    }
+}
+
+// The files are imported and the LODs built on the job system. Textures are
+// registered and the meshes uploaded on the calling thread, which has to own
+// the GL context.
+static void
+loadModels(Model* models, const char** paths, uint count, bool gammaCorrection = false) {
+    ModelImport* imports = new ModelImport[count];
+    JobCounter imported;
+    for(uint i = 0; i < count; i++) {
+        imports[i].path = paths[i];
+        runJob(importModelJob, imports, i, i + 1, &imported);
     }
+    waitForCounter(&imported);
+
+    std::vector<Mesh*> meshes;
+    for(uint i = 0; i < count; i++) {
+        Model* model = &models[i];
+        *model = {};
+        model->gammaCorrection = gammaCorrection;
+
+        const aiScene* scene = imports[i].scene;
+        if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+            std::cout << "ERROR::ASSIMP:: " << imports[i].importer.GetErrorString() << std::endl;
+            continue;
+        }
 
-    model.directory = path.substr(0, path.find_last_of('/'));
+        std::string path = paths[i];
+        model->directory = path.substr(0, path.find_last_of('/'));
 
-    processNode(&model, scene->mRootNode, scene);
+        processNode(model, scene->mRootNode, scene, ~0u);
+        for(int j = 0; j < model->meshes.size(); j++) {
+            meshes.push_back(&model->meshes[j]);
+        }
+    }
+    delete[] imports;
 
-    return model;
+    parallelFor(meshes.size(), 1, [&meshes](uint first, uint last) {
+        for(uint i = first; i < last; i++) {
+            buildMeshLods(meshes[i]);
+        }
+    });
+
+    for(int i = 0; i < meshes.size(); i++) {
+        uploadMesh(meshes[i]);
+    }
+    for(uint i = 0; i < count; i++) {
+        finishModel(&models[i]);
+    }
 }
 
+static Model
+loadModel(const char* path, bool gammaCorrection = false) {
+    Model model;
+    loadModels(&model, &path, 1, gammaCorrection);
+    return model;
+}
@@ -0,0 +1,406 @@
+// Software occlusion culling.
+//
+// A handful of occluders are rasterized on the CPU into a small depth buffer,
+// which is split into 8x8 pixel tiles that also remember the farthest depth
+// they contain. Entity bounds are then tested against the buffer: a tile whose
+// farthest depth is still in front of the box hides the box without touching
+// its pixels, and only the partially covered tiles are tested per pixel.
+//
+// Depth is NDC z remapped to [0,1] (smaller is nearer) so it matches GL_LESS.
+// Rows start at the bottom of the screen, like GL window coordinates.
+//
+// The pixel loops have scalar, SSE2 and AVX versions, picked at startup by
+// selectOcclusionKernels. AVX2 only adds integer instructions, so AVX2 CPUs use
+// the AVX version. The SIMD ones step the edge functions incrementally, four or
+// eight pixels at a time, so they can differ in rounding along triangle edges.
+
+#define OCCLUSION_WIDTH     320
+#define OCCLUSION_HEIGHT    192
+#define OCCLUSION_TILE_SIZE 8
+#define OCCLUSION_TILES_X   (OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE)
+#define OCCLUSION_TILES_Y   (OCCLUSION_HEIGHT / OCCLUSION_TILE_SIZE)
+
+struct OcclusionBuffer {
+    alignas(32) float depth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+    float tileMaxDepth[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+
+    // Stats for the last frame
+    uint occluderCount;
+    uint occluderTriangles;
+    uint testedCount;
+    uint culledCount;
+};
+
+static void
+clearOcclusionBuffer(OcclusionBuffer* buffer) {
+    for(int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; i++) {
+        buffer->depth[i] = 1.0f;
+    }
+    for(int i = 0; i < OCCLUSION_TILES_X * OCCLUSION_TILES_Y; i++) {
+        buffer->tileMaxDepth[i] = 1.0f;
+    }
+    buffer->occluderCount = 0;
+    buffer->occluderTriangles = 0;
+    buffer->testedCount = 0;
+    buffer->culledCount = 0;
+}
+
+// Screen space vertex, x and y in pixels and z in [0,1]
+struct RasterVertex {
+    float x, y, z;
+};
+
+// Edge functions e(x, y) = a*x + b*y + c are positive inside the triangle,
+// depth is z(x, y) = za*x + zb*y + zc
+struct TriangleSetup {
+    int x0, x1, y0, y1;
+    float a0, b0, c0;
+    float a1, b1, c1;
+    float a2, b2, c2;
+    float za, zb, zc;
+};
+
+static void
+fillTriangleScalar(OcclusionBuffer* buffer, const TriangleSetup* t) {
+    for (int y = t->y0; y < t->y1; y++) {
+        float py = (float)y + 0.5f;
+        float* row = buffer->depth + y * OCCLUSION_WIDTH;
+        for (int x = t->x0; x < t->x1; x++) {
+            float px = (float)x + 0.5f;
+            float e0 = t->a0 * px + t->b0 * py + t->c0;
+            float e1 = t->a1 * px + t->b1 * py + t->c1;
+            float e2 = t->a2 * px + t->b2 * py + t->c2;
+            if (e0 >= 0.0f && e1 >= 0.0f && e2 >= 0.0f) {
+                float z = t->za * px + t->zb * py + t->zc;
+                if (z < row[x]) row[x] = z;
+            }
+        }
+    }
+}
+
+static void
+updateOcclusionTilesScalar(OcclusionBuffer* buffer) {
+    for (int ty = 0; ty < OCCLUSION_TILES_Y; ty++) {
+        for (int tx = 0; tx < OCCLUSION_TILES_X; tx++) {
+            float* tile = buffer->depth + ty * OCCLUSION_TILE_SIZE * OCCLUSION_WIDTH + tx * OCCLUSION_TILE_SIZE;
+            float maxDepth = 0.0f;
+            for (int y = 0; y < OCCLUSION_TILE_SIZE; y++) {
+                for (int x = 0; x < OCCLUSION_TILE_SIZE; x++) {
+                    maxDepth = fmaxf(maxDepth, tile[y * OCCLUSION_WIDTH + x]);
+                }
+            }
+            buffer->tileMaxDepth[ty * OCCLUSION_TILES_X + tx] = maxDepth;
+        }
+    }
+}
+
+#if CPU_X86
+CPU_TARGET_BEGIN("sse2")
+// Blocks of four pixels, x0 is a multiple of 4 and so is the buffer width
+static void
+fillTriangleSse2(OcclusionBuffer* buffer, const TriangleSetup* t) {
+    __m128 pixelOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 stepE0 = _mm_set1_ps(t->a0 * 4.0f);
+    __m128 stepE1 = _mm_set1_ps(t->a1 * 4.0f);
+    __m128 stepE2 = _mm_set1_ps(t->a2 * 4.0f);
+    __m128 stepZ  = _mm_set1_ps(t->za * 4.0f);
+
+    for (int y = t->y0; y < t->y1; y++) {
+        float py = (float)y + 0.5f;
+        __m128 px = _mm_add_ps(_mm_set1_ps((float)t->x0), pixelOffsets);
+        __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t->a0), px), _mm_set1_ps(t->b0 * py + t->c0));
+        __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t->a1), px), _mm_set1_ps(t->b1 * py + t->c1));
+        __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t->a2), px), _mm_set1_ps(t->b2 * py + t->c2));
+        __m128 z  = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t->za), px), _mm_set1_ps(t->zb * py + t->zc));
+
+        float* row = buffer->depth + y * OCCLUSION_WIDTH;
+        for (int x = t->x0; x < t->x1; x += 4) {
+            __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+            if (_mm_movemask_ps(inside)) {
+                __m128 old = _mm_load_ps(row + x);
+                __m128 nearest = _mm_min_ps(old, z);
+                _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+            }
+            e0 = _mm_add_ps(e0, stepE0);
+            e1 = _mm_add_ps(e1, stepE1);
+            e2 = _mm_add_ps(e2, stepE2);
+            z  = _mm_add_ps(z, stepZ);
+        }
+    }
+}
+
+static void
+updateOcclusionTilesSse2(OcclusionBuffer* buffer) {
+    for (int ty = 0; ty < OCCLUSION_TILES_Y; ty++) {
+        for (int tx = 0; tx < OCCLUSION_TILES_X; tx++) {
+            float* tile = buffer->depth + ty * OCCLUSION_TILE_SIZE * OCCLUSION_WIDTH + tx * OCCLUSION_TILE_SIZE;
+            __m128 maxDepth = _mm_setzero_ps();
+            for (int y = 0; y < OCCLUSION_TILE_SIZE; y++) {
+                float* row = tile + y * OCCLUSION_WIDTH;
+                maxDepth = _mm_max_ps(maxDepth, _mm_max_ps(_mm_load_ps(row), _mm_load_ps(row + 4)));
+            }
+            maxDepth = _mm_max_ps(maxDepth, _mm_shuffle_ps(maxDepth, maxDepth, _MM_SHUFFLE(1, 0, 3, 2)));
+            maxDepth = _mm_max_ps(maxDepth, _mm_shuffle_ps(maxDepth, maxDepth, _MM_SHUFFLE(2, 3, 0, 1)));
+            buffer->tileMaxDepth[ty * OCCLUSION_TILES_X + tx] = _mm_cvtss_f32(maxDepth);
+        }
+    }
+}
+CPU_TARGET_END
+
+CPU_TARGET_BEGIN("avx")
+// Blocks of eight pixels, x0 is rounded down to a multiple of 8 and the buffer
+// width is one, so the blocks never cross a row
+static void
+fillTriangleAvx(OcclusionBuffer* buffer, const TriangleSetup* t) {
+    __m256 pixelOffsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 stepE0 = _mm256_set1_ps(t->a0 * 8.0f);
+    __m256 stepE1 = _mm256_set1_ps(t->a1 * 8.0f);
+    __m256 stepE2 = _mm256_set1_ps(t->a2 * 8.0f);
+    __m256 stepZ  = _mm256_set1_ps(t->za * 8.0f);
+    int x0 = t->x0 & ~7;
+
+    for (int y = t->y0; y < t->y1; y++) {
+        float py = (float)y + 0.5f;
+        __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x0), pixelOffsets);
+        __m256 e0 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(t->a0), px), _mm256_set1_ps(t->b0 * py + t->c0));
+        __m256 e1 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(t->a1), px), _mm256_set1_ps(t->b1 * py + t->c1));
+        __m256 e2 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(t->a2), px), _mm256_set1_ps(t->b2 * py + t->c2));
+        __m256 z  = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(t->za), px), _mm256_set1_ps(t->zb * py + t->zc));
+
+        float* row = buffer->depth + y * OCCLUSION_WIDTH;
+        for (int x = x0; x < t->x1; x += 8) {
+            __m256 inside = _mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ),
+                                          _mm256_and_ps(_mm256_cmp_ps(e1, zero, _CMP_GE_OQ), _mm256_cmp_ps(e2, zero, _CMP_GE_OQ)));
+            if (_mm256_movemask_ps(inside)) {
+                __m256 old = _mm256_load_ps(row + x);
+                _mm256_store_ps(row + x, _mm256_blendv_ps(old, _mm256_min_ps(old, z), inside));
+            }
+            e0 = _mm256_add_ps(e0, stepE0);
+            e1 = _mm256_add_ps(e1, stepE1);
+            e2 = _mm256_add_ps(e2, stepE2);
+            z  = _mm256_add_ps(z, stepZ);
+        }
+    }
+}
+
+// A tile row is one register
+static void
+updateOcclusionTilesAvx(OcclusionBuffer* buffer) {
+    for (int ty = 0; ty < OCCLUSION_TILES_Y; ty++) {
+        for (int tx = 0; tx < OCCLUSION_TILES_X; tx++) {
+            float* tile = buffer->depth + ty * OCCLUSION_TILE_SIZE * OCCLUSION_WIDTH + tx * OCCLUSION_TILE_SIZE;
+            __m256 maxDepth = _mm256_load_ps(tile);
+            for (int y = 1; y < OCCLUSION_TILE_SIZE; y++) {
+                maxDepth = _mm256_max_ps(maxDepth, _mm256_load_ps(tile + y * OCCLUSION_WIDTH));
+            }
+            __m128 half = _mm_max_ps(_mm256_castps256_ps128(maxDepth), _mm256_extractf128_ps(maxDepth, 1));
+            half = _mm_max_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(1, 0, 3, 2)));
+            half = _mm_max_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(2, 3, 0, 1)));
+            buffer->tileMaxDepth[ty * OCCLUSION_TILES_X + tx] = _mm_cvtss_f32(half);
+        }
+    }
+}
+CPU_TARGET_END
+#endif
+
+struct OcclusionKernels {
+    void (*fillTriangle)(OcclusionBuffer* buffer, const TriangleSetup* t);
+    void (*updateTiles)(OcclusionBuffer* buffer);
+};
+
+static OcclusionKernels g_occlusionKernels = { fillTriangleScalar, updateOcclusionTilesScalar };
+
+static void
+selectOcclusionKernels(CpuIsa isa) {
+    g_occlusionKernels = { fillTriangleScalar, updateOcclusionTilesScalar };
+#if CPU_X86
+    if (isa >= CPU_ISA_SSE2) g_occlusionKernels = { fillTriangleSse2, updateOcclusionTilesSse2 };
+    if (isa >= CPU_ISA_AVX) g_occlusionKernels = { fillTriangleAvx, updateOcclusionTilesAvx };
+#endif
+}
+
+static void
+rasterizeTriangle(OcclusionBuffer* buffer, RasterVertex v0, RasterVertex v1, RasterVertex v2) {
+    float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+    if (fabsf(area) < 1e-8f) return;
+
+    // Occluders are rasterized double sided, so just fix up the winding
+    if (area < 0.0f) {
+        RasterVertex tmp = v1;
+        v1 = v2;
+        v2 = tmp;
+        area = -area;
+    }
+
+    float minX = fminf(v0.x, fminf(v1.x, v2.x));
+    float maxX = fmaxf(v0.x, fmaxf(v1.x, v2.x));
+    float minY = fminf(v0.y, fminf(v1.y, v2.y));
+    float maxY = fmaxf(v0.y, fmaxf(v1.y, v2.y));
+
+    TriangleSetup t;
+    t.x0 = (int)fmaxf(minX, 0.0f);
+    t.x1 = (int)fminf(maxX + 1.0f, (float)OCCLUSION_WIDTH);
+    t.y0 = (int)fmaxf(minY, 0.0f);
+    t.y1 = (int)fminf(maxY + 1.0f, (float)OCCLUSION_HEIGHT);
+    if (t.x0 >= t.x1 || t.y0 >= t.y1) return;
+
+    // Step in blocks of four pixels
+    t.x0 &= ~3;
+
+    t.a0 = v1.y - v2.y; t.b0 = v2.x - v1.x; t.c0 = v1.x * v2.y - v1.y * v2.x;
+    t.a1 = v2.y - v0.y; t.b1 = v0.x - v2.x; t.c1 = v2.x * v0.y - v2.y * v0.x;
+    t.a2 = v0.y - v1.y; t.b2 = v1.x - v0.x; t.c2 = v0.x * v1.y - v0.y * v1.x;
+
+    float invArea = 1.0f / area;
+    t.za = (t.a0 * v0.z + t.a1 * v1.z + t.a2 * v2.z) * invArea;
+    t.zb = (t.b0 * v0.z + t.b1 * v1.z + t.b2 * v2.z) * invArea;
+    t.zc = (t.c0 * v0.z + t.c1 * v1.z + t.c2 * v2.z) * invArea;
+
+    g_occlusionKernels.fillTriangle(buffer, &t);
+}
+
+static inline RasterVertex
+toRasterVertex(glm::vec4 clip) {
+    float invW = 1.0f / clip.w;
+    RasterVertex result;
+    result.x = (clip.x * invW * 0.5f + 0.5f) * (float)OCCLUSION_WIDTH;
+    result.y = (clip.y * invW * 0.5f + 0.5f) * (float)OCCLUSION_HEIGHT;
+    result.z = clip.z * invW * 0.5f + 0.5f;
+    return result;
+}
+
+// Distance to the near plane (z = -w) in clip space, positive in front of it
+static inline float
+nearPlaneDistance(glm::vec4 clip) {
+    return clip.z + clip.w;
+}
+
+static void
+rasterizeOccluder(OcclusionBuffer* buffer, const glm::mat4& mvp,
+                  const glm::vec3* vertices, uint vertexCount, const uint* indices, uint indexCount) {
+    ScratchScope scratch;
+    glm::vec4* clipVertices = pushArray(scratch.arena(), glm::vec4, vertexCount);
+    for (uint i = 0; i < vertexCount; i++) {
+        clipVertices[i] = mvp * glm::vec4(vertices[i], 1.0f);
+    }
+
+    for (uint i = 0; i + 2 < indexCount; i += 3) {
+        glm::vec4 c[3] = {
+            clipVertices[indices[i + 0]],
+            clipVertices[indices[i + 1]],
+            clipVertices[indices[i + 2]],
+        };
+
+        // Trivially reject triangles fully outside one of the side planes
+        if (c[0].x >  c[0].w && c[1].x >  c[1].w && c[2].x >  c[2].w) continue;
+        if (c[0].x < -c[0].w && c[1].x < -c[1].w && c[2].x < -c[2].w) continue;
+        if (c[0].y >  c[0].w && c[1].y >  c[1].w && c[2].y >  c[2].w) continue;
+        if (c[0].y < -c[0].w && c[1].y < -c[1].w && c[2].y < -c[2].w) continue;
+
+        float d[3] = { nearPlaneDistance(c[0]), nearPlaneDistance(c[1]), nearPlaneDistance(c[2]) };
+        if (d[0] >= 0.0f && d[1] >= 0.0f && d[2] >= 0.0f) {
+            rasterizeTriangle(buffer, toRasterVertex(c[0]), toRasterVertex(c[1]), toRasterVertex(c[2]));
+            buffer->occluderTriangles++;
+            continue;
+        }
+        if (d[0] < 0.0f && d[1] < 0.0f && d[2] < 0.0f) continue;
+
+        // Clip against the near plane, which gives at most a quad
+        glm::vec4 clipped[4];
+        int clippedCount = 0;
+        for (int j = 0; j < 3; j++) {
+            int k = (j + 1) % 3;
+            if (d[j] >= 0.0f) clipped[clippedCount++] = c[j];
+            if ((d[j] >= 0.0f) != (d[k] >= 0.0f)) {
+                float t = d[j] / (d[j] - d[k]);
+                clipped[clippedCount++] = c[j] + (c[k] - c[j]) * t;
+            }
+        }
+        for (int j = 1; j + 1 < clippedCount; j++) {
+            rasterizeTriangle(buffer, toRasterVertex(clipped[0]), toRasterVertex(clipped[j]), toRasterVertex(clipped[j + 1]));
+            buffer->occluderTriangles++;
+        }
+    }
+    buffer->occluderCount++;
+}
+
+// Call after all occluders are rasterized, before testing anything
+static void
+updateOcclusionTiles(OcclusionBuffer* buffer) {
+    g_occlusionKernels.updateTiles(buffer);
+}
+
+// Returns false if the box is outside the frustum or hidden behind occluders.
+// Boxes crossing the near plane can't be projected and are always visible.
+// Only reads the buffer, so it can be called from many threads at once; the
+// caller keeps the counts.
+static bool
+testOccludee(const OcclusionBuffer* buffer, const glm::mat4& mvp, AABB bounds) {
+    float minX = INFINITY, minY = INFINITY, minZ = INFINITY;
+    float maxX = -INFINITY, maxY = -INFINITY;
+    int outside[4] = {};
+    int behind = 0;
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner = glm::vec3(
+            (i & 1) ? bounds.max.x : bounds.min.x,
+            (i & 2) ? bounds.max.y : bounds.min.y,
+            (i & 4) ? bounds.max.z : bounds.min.z
+        );
+        glm::vec4 clip = mvp * glm::vec4(corner, 1.0f);
+
+        // The plane tests are linear in clip space, so they hold behind the camera too
+        outside[0] += clip.x >  clip.w;
+        outside[1] += clip.x < -clip.w;
+        outside[2] += clip.y >  clip.w;
+        outside[3] += clip.y < -clip.w;
+        if (nearPlaneDistance(clip) <= 0.0f) {
+            behind++;
+            continue;
+        }
+
+        RasterVertex v = toRasterVertex(clip);
+        minX = fminf(minX, v.x); maxX = fmaxf(maxX, v.x);
+        minY = fminf(minY, v.y); maxY = fmaxf(maxY, v.y);
+        minZ = fminf(minZ, v.z);
+    }
+
+    if (behind == 8 || outside[0] == 8 || outside[1] == 8 || outside[2] == 8 || outside[3] == 8) {
+        return false;
+    }
+    if (behind > 0) return true;
+    if (minZ > 1.0f) return false;
+
+    int x0 = (int)fmaxf(minX, 0.0f);
+    int x1 = (int)fminf(maxX + 1.0f, (float)OCCLUSION_WIDTH);
+    int y0 = (int)fmaxf(minY, 0.0f);
+    int y1 = (int)fminf(maxY + 1.0f, (float)OCCLUSION_HEIGHT);
+    if (x0 >= x1 || y0 >= y1) {
+        return false;
+    }
+
+    // Bias a bit so an occluder can never hide its own bounds
+    float testDepth = minZ - 1e-6f;
+
+    int tx0 = x0 / OCCLUSION_TILE_SIZE, tx1 = (x1 - 1) / OCCLUSION_TILE_SIZE;
+    int ty0 = y0 / OCCLUSION_TILE_SIZE, ty1 = (y1 - 1) / OCCLUSION_TILE_SIZE;
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            if (buffer->tileMaxDepth[ty * OCCLUSION_TILES_X + tx] < testDepth) continue;
+
+            int px0 = glm::max(x0, tx * OCCLUSION_TILE_SIZE);
+            int px1 = glm::min(x1, (tx + 1) * OCCLUSION_TILE_SIZE);
+            int py0 = glm::max(y0, ty * OCCLUSION_TILE_SIZE);
+            int py1 = glm::min(y1, (ty + 1) * OCCLUSION_TILE_SIZE);
+            for (int y = py0; y < py1; y++) {
+                const float* row = buffer->depth + y * OCCLUSION_WIDTH;
+                for (int x = px0; x < px1; x++) {
+                    if (row[x] >= testDepth) return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
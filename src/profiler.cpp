@@ -0,0 +1,205 @@
+// Frame profiler with allocation tracking.
+//
+// Every heap allocation made through operator new and ImGui's allocator is
+// counted for the thread that made it. Each thread gets a slot in a global
+// table the first time it allocates, and the frame totals are summed over all
+// of them, so allocations on the job workers and the texture streaming worker
+// count too. The main loop brackets each frame with
+// beginProfileFrame/endProfileFrame, and PROFILE_SCOPE records time and
+// allocations of a named part of the frame. Scopes are meant for the main
+// thread only and only see its allocations.
+//
+// In strict mode (--strict-allocations) a frame that allocates once the scene has
+// been steady for ALLOCATION_WARMUP_FRAMES frames prints the scopes it happened
+// in and exits with an error, so a headless run fails on it.
+
+#include <new>
+#include <atomic>
+
+#define MAX_PROFILE_SCOPES 32
+#define ALLOCATION_WARMUP_FRAMES 120
+#define MAX_ALLOCATION_THREADS 64 // Threads past this share the last slot
+
+struct AllocationCounters {
+    unsigned long long count;
+    unsigned long long bytes;
+    unsigned long long frees;
+};
+
+// Written by the thread that owns the slot, read by the main thread at frame boundaries
+struct alignas(64) ThreadAllocationCounters {
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> bytes;
+    std::atomic<unsigned long long> frees;
+};
+
+static ThreadAllocationCounters g_threadAllocations[MAX_ALLOCATION_THREADS];
+static std::atomic<uint> g_allocationThreadCount;
+static thread_local ThreadAllocationCounters* t_allocations;
+
+static inline ThreadAllocationCounters*
+threadAllocationCounters() {
+    if (!t_allocations) {
+        uint slot = g_allocationThreadCount.fetch_add(1, std::memory_order_relaxed);
+        t_allocations = &g_threadAllocations[slot < MAX_ALLOCATION_THREADS ? slot : MAX_ALLOCATION_THREADS - 1];
+    }
+    return t_allocations;
+}
+
+static AllocationCounters
+readAllocationCounters(ThreadAllocationCounters* counters) {
+    AllocationCounters result;
+    result.count = counters->count.load(std::memory_order_relaxed);
+    result.bytes = counters->bytes.load(std::memory_order_relaxed);
+    result.frees = counters->frees.load(std::memory_order_relaxed);
+    return result;
+}
+
+// Of every thread that allocated so far
+static AllocationCounters
+totalAllocationCounters() {
+    AllocationCounters result = {};
+    uint threadCount = glm::min(g_allocationThreadCount.load(std::memory_order_relaxed), (uint)MAX_ALLOCATION_THREADS);
+    for (uint i = 0; i < threadCount; i++) {
+        AllocationCounters counters = readAllocationCounters(&g_threadAllocations[i]);
+        result.count += counters.count;
+        result.bytes += counters.bytes;
+        result.frees += counters.frees;
+    }
+    return result;
+}
+
+static void*
+trackedMalloc(size_t size) {
+    ThreadAllocationCounters* counters = threadAllocationCounters();
+    counters->count.fetch_add(1, std::memory_order_relaxed);
+    counters->bytes.fetch_add(size, std::memory_order_relaxed);
+    return malloc(size);
+}
+
+static void
+trackedFree(void* ptr) {
+    if (!ptr) return;
+    threadAllocationCounters()->frees.fetch_add(1, std::memory_order_relaxed);
+    free(ptr);
+}
+
+void* operator new(size_t size) {
+    void* ptr = trackedMalloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return trackedMalloc(size ? size : 1); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return trackedMalloc(size ? size : 1); }
+void operator delete(void* ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+
+static void*
+imguiAlloc(size_t size, void*) {
+    return trackedMalloc(size);
+}
+
+static void
+imguiFree(void* ptr, void*) {
+    trackedFree(ptr);
+}
+
+struct ProfileScopeStats {
+    const char* name;
+    float time; // Seconds
+    uint allocationCount;
+    size_t allocationBytes;
+};
+
+struct Profiler {
+    ProfileScopeStats scopes[MAX_PROFILE_SCOPES];
+    uint scopeCount;
+
+    AllocationCounters frameStart;
+    uint frameAllocationCount; // Of the last finished frame
+    size_t frameAllocationBytes;
+
+    bool strictAllocations;
+    uint steadyFrames; // Frames since the scene last changed
+};
+
+static Profiler g_profiler;
+
+static ProfileScopeStats*
+getProfileScope(Profiler* profiler, const char* name) {
+    for (uint i = 0; i < profiler->scopeCount; i++) {
+        if (profiler->scopes[i].name == name || strcmp(profiler->scopes[i].name, name) == 0) return &profiler->scopes[i];
+    }
+    if (profiler->scopeCount == MAX_PROFILE_SCOPES) return NULL;
+    ProfileScopeStats* scope = &profiler->scopes[profiler->scopeCount++];
+    *scope = {};
+    scope->name = name;
+    return scope;
+}
+
+// Adds to the stats of the named scope, a scope entered many times in a frame adds up
+struct ProfileScope {
+    const char* name;
+    double startTime;
+    AllocationCounters start;
+
+    ProfileScope(const char* name) : name(name), startTime(glfwGetTime()), start(readAllocationCounters(threadAllocationCounters())) {}
+    ~ProfileScope() {
+        ProfileScopeStats* scope = getProfileScope(&g_profiler, name);
+        if (!scope) return;
+        scope->time += (float)(glfwGetTime() - startTime);
+        AllocationCounters end = readAllocationCounters(threadAllocationCounters());
+        scope->allocationCount += (uint)(end.count - start.count);
+        scope->allocationBytes += (size_t)(end.bytes - start.bytes);
+    }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PROFILE_SCOPE_NAME_(line) profileScope##line
+#define PROFILE_SCOPE_NAME(line) PROFILE_SCOPE_NAME_(line)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_SCOPE_NAME(__LINE__)(name)
+
+// Anything that is expected to allocate (spawning entities, resizing) calls this
+// so strict mode waits for the next steady state
+static void
+resetSteadyState(Profiler* profiler) {
+    profiler->steadyFrames = 0;
+}
+
+static void
+beginProfileFrame(Profiler* profiler) {
+    for (uint i = 0; i < profiler->scopeCount; i++) {
+        profiler->scopes[i].time = 0.f;
+        profiler->scopes[i].allocationCount = 0;
+        profiler->scopes[i].allocationBytes = 0;
+    }
+    profiler->frameStart = totalAllocationCounters();
+}
+
+static void
+endProfileFrame(Profiler* profiler) {
+    AllocationCounters end = totalAllocationCounters();
+    profiler->frameAllocationCount = (uint)(end.count - profiler->frameStart.count);
+    profiler->frameAllocationBytes = (size_t)(end.bytes - profiler->frameStart.bytes);
+
+    if (profiler->steadyFrames < ALLOCATION_WARMUP_FRAMES) {
+        profiler->steadyFrames++;
+        return;
+    }
+    if (profiler->strictAllocations && profiler->frameAllocationCount > 0) {
+        fprintf(stderr, "ERROR::PROFILER:: steady state frame made %u allocations (%zu bytes) across all threads, main thread scopes:\n",
+                profiler->frameAllocationCount, profiler->frameAllocationBytes);
+        for (uint i = 0; i < profiler->scopeCount; i++) {
+            ProfileScopeStats* scope = &profiler->scopes[i];
+            if (scope->allocationCount == 0) continue;
+            fprintf(stderr, "  %s: %u allocations (%zu bytes)\n", scope->name, scope->allocationCount, scope->allocationBytes);
+        }
+        exit(1);
+    }
+}
@@ -0,0 +1,257 @@
+// Render command generation.
+//
+// Instead of walking the entities and issuing GL calls for each, the entity
+// array is split into segments that are recorded on the job system. Every
+// segment writes a packed command for each mesh it draws, with a sort key that
+// groups draws by shader and mesh and orders them front to back within that,
+// and sorts its own commands. The sorted segments are merged pairwise, also in
+// parallel, and the GL thread replays the result with a thin loop that only
+// changes state when the key says it changed.
+//
+// Commands live in their own arena, which is reset when the next frame is
+// recorded, so they can be dumped for debugging any time after recording. The
+// number of commands is known before they are written, so the arena is
+// replaced with a bigger one when a frame needs more, rather than sized for the
+// biggest scene up front.
+
+#define RENDER_ARENA_INITIAL_SIZE (16 * 1024 * 1024)
+#define RENDER_SEGMENT_SIZE 1024 // Entities per segment
+
+#define RENDER_KEY_IMPOSTOR_BIT 63
+#define RENDER_KEY_SHADER_SHIFT 48 // 15 bits
+#define RENDER_KEY_MESH_SHIFT   24 // 24 bits, the mesh's VAO
+#define RENDER_KEY_DEPTH_BITS   24
+
+#define RENDER_IMPOSTOR_MESH 0xffff
+
+// 16 bytes, so a million entities with a handful of meshes each still sort quickly
+struct RenderCommand {
+    unsigned long long key;
+    uint entity;
+    unsigned short mesh; // Index into the entity's model, RENDER_IMPOSTOR_MESH for impostors
+    unsigned short lod;
+};
+
+struct RenderCommandBuffer {
+    MemoryArena arena;
+    RenderCommand* commands; // Sorted by key once recorded
+    uint count;
+    uint impostorCount;
+
+    // Stats of the last replay
+    uint programChanges;
+    uint meshChanges;
+    uint drawCalls;
+    unsigned long long triangles;
+};
+
+static RenderCommandBuffer g_renderCommands;
+
+static inline unsigned long long
+makeRenderKey(uint program, uint vao, float depth) {
+    unsigned long long depthBits = (unsigned long long)(glm::clamp(depth / Camera::FarPlane, 0.0f, 1.0f) * ((1 << RENDER_KEY_DEPTH_BITS) - 1));
+    return ((unsigned long long)(program & 0x7fff) << RENDER_KEY_SHADER_SHIFT)
+         | ((unsigned long long)(vao & 0xffffff) << RENDER_KEY_MESH_SHIFT)
+         | depthBits;
+}
+
+static inline bool
+renderCommandLess(const RenderCommand& a, const RenderCommand& b) {
+    return a.key < b.key;
+}
+
+// Number of commands recordSegment will write for these entities
+static uint
+countSegmentCommands(const Entity* entities, uint first, uint last) {
+    uint count = 0;
+    for (uint i = first; i < last; i++) {
+        const Entity* entity = &entities[i];
+        if (!entity->visible) continue;
+        count += entity->impostor ? 1 : entity->model->meshes.size();
+    }
+    return count;
+}
+
+static uint
+recordSegment(RenderCommand* commands, const Entity* entities, uint first, uint last, TransformHierarchy* transforms, Camera* camera) {
+    uint count = 0;
+    for (uint i = first; i < last; i++) {
+        const Entity* entity = &entities[i];
+        if (!entity->visible) continue;
+
+        if (entity->impostor) {
+            // Order doesn't matter, they are gathered into one instanced draw
+            RenderCommand* command = &commands[count++];
+            command->key = (1ull << RENDER_KEY_IMPOSTOR_BIT) | i;
+            command->entity = i;
+            command->mesh = RENDER_IMPOSTOR_MESH;
+            command->lod = 0;
+            continue;
+        }
+
+        glm::vec3 position = glm::vec3(worldMatrix(transforms, entity->transform)[3]);
+        float depth = glm::dot(position - camera->position, camera->front);
+        Model* model = entity->model;
+        for (uint j = 0; j < model->meshes.size(); j++) {
+            RenderCommand* command = &commands[count++];
+            command->key = makeRenderKey(entity->shader.ID, model->meshes[j].VAO, depth);
+            command->entity = i;
+            command->mesh = (unsigned short)j;
+            command->lod = (unsigned short)entity->lod;
+        }
+    }
+    return count;
+}
+
+// Replaces the arena with one that has room for size more bytes, keeping the segment offsets already in it
+static uint*
+growRenderArena(RenderCommandBuffer* buffer, const uint* offsets, uint offsetCount, size_t size) {
+    size_t used = offsetCount * sizeof(uint) + size;
+    MemoryArena grown;
+    initArena(&grown, glm::max(buffer->arena.size * 2, used + used / 4), "render command arena");
+    uint* copy = pushArray(&grown, uint, offsetCount);
+    memcpy(copy, offsets, offsetCount * sizeof(uint));
+    freeArena(&buffer->arena);
+    buffer->arena = grown;
+    return copy;
+}
+
+// Records the draws of all the visible entities, sorted by key
+static void
+recordRenderCommands(RenderCommandBuffer* buffer, const Entity* entities, uint entityCount, TransformHierarchy* transforms, Camera* camera) {
+    if (!buffer->arena.base) initArena(&buffer->arena, RENDER_ARENA_INITIAL_SIZE, "render command arena");
+    resetArena(&buffer->arena);
+    buffer->commands = NULL;
+    buffer->count = 0;
+    buffer->impostorCount = 0;
+    if (entityCount == 0) return;
+
+    uint segmentCount = (entityCount + RENDER_SEGMENT_SIZE - 1) / RENDER_SEGMENT_SIZE;
+    uint* offsets = pushArray(&buffer->arena, uint, segmentCount + 1);
+    parallelFor(segmentCount, 1, [entities, entityCount, offsets](uint first, uint last) {
+        for (uint segment = first; segment < last; segment++) {
+            uint entityFirst = segment * RENDER_SEGMENT_SIZE;
+            uint entityLast = glm::min(entityFirst + RENDER_SEGMENT_SIZE, entityCount);
+            offsets[segment + 1] = countSegmentCommands(entities, entityFirst, entityLast);
+        }
+    });
+    offsets[0] = 0;
+    for (uint i = 0; i < segmentCount; i++) offsets[i + 1] += offsets[i];
+
+    uint count = offsets[segmentCount];
+    size_t commandBytes = 2 * ((size_t)count * sizeof(RenderCommand) + alignof(RenderCommand));
+    if (buffer->arena.used + commandBytes > buffer->arena.size) {
+        offsets = growRenderArena(buffer, offsets, segmentCount + 1, commandBytes);
+    }
+    RenderCommand* commands = pushArray(&buffer->arena, RenderCommand, count);
+    RenderCommand* merged = pushArray(&buffer->arena, RenderCommand, count);
+    parallelFor(segmentCount, 1, [=](uint first, uint last) {
+        for (uint segment = first; segment < last; segment++) {
+            uint entityFirst = segment * RENDER_SEGMENT_SIZE;
+            uint entityLast = glm::min(entityFirst + RENDER_SEGMENT_SIZE, entityCount);
+            RenderCommand* segmentCommands = commands + offsets[segment];
+            uint recorded = recordSegment(segmentCommands, entities, entityFirst, entityLast, transforms, camera);
+            std::sort(segmentCommands, segmentCommands + recorded, renderCommandLess);
+        }
+    });
+
+    // Merge neighbouring runs of sorted segments until there is one left
+    for (uint width = 1; width < segmentCount; width *= 2) {
+        uint pairCount = (segmentCount + 2 * width - 1) / (2 * width);
+        parallelFor(pairCount, 1, [=](uint first, uint last) {
+            for (uint pair = first; pair < last; pair++) {
+                uint start = offsets[pair * 2 * width];
+                uint middle = offsets[glm::min((pair * 2 + 1) * width, segmentCount)];
+                uint end = offsets[glm::min((pair * 2 + 2) * width, segmentCount)];
+                std::merge(commands + start, commands + middle, commands + middle, commands + end, merged + start, renderCommandLess);
+            }
+        });
+        std::swap(commands, merged);
+    }
+
+    buffer->commands = commands;
+    buffer->count = count;
+    // Impostors sort last
+    for (uint i = count; i > 0 && (commands[i - 1].key >> RENDER_KEY_IMPOSTOR_BIT); i--) {
+        buffer->impostorCount++;
+    }
+}
+
+// Issues the recorded draws, the camera comes from the camera uniform block.
+// Impostors are only gathered into their impostor's instances,
+// drawImpostorInstances still has to be called for them.
+static void
+replayRenderCommands(RenderCommandBuffer* buffer, Entity* entities, TransformHierarchy* transforms) {
+    buffer->programChanges = 0;
+    buffer->meshChanges = 0;
+    buffer->drawCalls = 0;
+    buffer->triangles = 0;
+
+    uint currentProgram = 0;
+    int modelLocation = -1;
+    Mesh* currentMesh = NULL;
+    for (uint i = 0; i < buffer->count; i++) {
+        RenderCommand* command = &buffer->commands[i];
+        Entity* entity = &entities[command->entity];
+        const glm::mat4& world = worldMatrix(transforms, entity->transform);
+
+        if (command->mesh == RENDER_IMPOSTOR_MESH) {
+            pushImpostorInstance(entity->model->impostor, world);
+            continue;
+        }
+
+        Shader shader = entity->shader;
+        if (shader.ID != currentProgram) {
+            use(shader);
+            modelLocation = uniformLocation(shader, SID("model"));
+            currentProgram = shader.ID;
+            currentMesh = NULL; // The material layers are per program
+            buffer->programChanges++;
+        }
+
+        Mesh* mesh = &entity->model->meshes[command->mesh];
+        if (mesh != currentMesh) {
+            bindMeshMaterial(mesh, shader);
+            glBindVertexArray(mesh->VAO);
+            currentMesh = mesh;
+            buffer->meshChanges++;
+        }
+        for (uint j = 0; j < mesh->bindingCount; j++) {
+            markTextureUsed(&g_textureStreamer, mesh->bindings[j].texture, entity->screenSize);
+        }
+
+        glm::mat4 model = world * mesh->transform;
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &model[0][0]);
+        MeshLod* meshLod = &mesh->lods[glm::min((uint)command->lod, mesh->lodCount - 1)];
+        glDrawElements(GL_TRIANGLES, meshLod->indexCount, GL_UNSIGNED_INT, (void*)(meshLod->indexOffset * sizeof(uint)));
+        buffer->drawCalls++;
+        buffer->triangles += meshLod->indexCount / 3;
+    }
+    glBindVertexArray(0);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+static bool
+dumpRenderCommands(RenderCommandBuffer* buffer, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "ERROR::RENDER_COMMANDS:: could not open %s\n", path);
+        return false;
+    }
+
+    fprintf(file, "# %u commands, %u impostors\n", buffer->count, buffer->impostorCount);
+    fprintf(file, "# index key impostor program vao depth entity mesh lod\n");
+    for (uint i = 0; i < buffer->count; i++) {
+        RenderCommand* command = &buffer->commands[i];
+        unsigned long long key = command->key;
+        fprintf(file, "%u %016llx %u %u %u %u %u %u %u\n", i, key,
+                (uint)(key >> RENDER_KEY_IMPOSTOR_BIT),
+                (uint)((key >> RENDER_KEY_SHADER_SHIFT) & 0x7fff),
+                (uint)((key >> RENDER_KEY_MESH_SHIFT) & 0xffffff),
+                (uint)(key & ((1 << RENDER_KEY_DEPTH_BITS) - 1)),
+                command->entity, command->mesh, command->lod);
+    }
+    fclose(file);
+    printf("Dumped %u render commands to %s\n", buffer->count, path);
+    return true;
+}
@@ -0,0 +1,490 @@
+// Scene files.
+//
+// The binary format is made to be used straight from a memory mapping: a
+// header, then the entity data as separate arrays (world transforms, parents,
+// model ids, shader ids) and a table of the assets the ids refer to. Ids are StringIds of
+// the asset names, so a scene stays valid as long as the assets keep their
+// names. Every section starts on a SCENE_SECTION_ALIGNMENT boundary.
+//
+// The text format holds the same data one entity per line, for diffing and
+// editing by hand. Either can be converted to the other by loading and saving.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define SCENE_MAGIC   0x4e435346 // "FSCN"
+#define SCENE_VERSION 2
+#define SCENE_SECTION_ALIGNMENT 64
+
+enum SceneAssetKind {
+    SCENE_ASSET_MODEL,
+    SCENE_ASSET_SHADER,
+};
+
+struct SceneFileHeader {
+    uint magic;
+    uint version;
+    uint entityCount;
+    uint assetCount;
+    // Byte offsets from the start of the file
+    unsigned long long transformsOffset; // glm::mat4[entityCount], world space
+    unsigned long long parentsOffset;    // uint[entityCount], entity index or ~0u
+    unsigned long long modelIdsOffset;   // uint[entityCount]
+    unsigned long long shaderIdsOffset;  // uint[entityCount]
+    unsigned long long assetsOffset;     // SceneFileAsset[assetCount]
+    unsigned long long namesOffset;      // Asset names, each zero terminated
+    unsigned long long fileSize;
+};
+
+struct SceneFileAsset {
+    uint id;
+    uint kind;
+    uint nameOffset; // From namesOffset
+    uint nameLength;
+};
+
+// Assets a scene can refer to, registered by name once they're loaded
+struct SceneAssets {
+    std::vector<StringId> modelIds;
+    std::vector<Model*> models;
+    std::vector<StringId> shaderIds;
+    std::vector<Shader> shaders;
+};
+
+static SceneAssets g_sceneAssets;
+
+static void
+registerSceneModel(SceneAssets* assets, const char* name, Model* model) {
+    assets->modelIds.push_back(internString(name));
+    assets->models.push_back(model);
+}
+
+static void
+registerSceneShader(SceneAssets* assets, const char* name, Shader shader) {
+    assets->shaderIds.push_back(internString(name));
+    assets->shaders.push_back(shader);
+}
+
+static int
+findSceneModel(SceneAssets* assets, StringId id) {
+    for (int i = 0; i < assets->modelIds.size(); i++) {
+        if (assets->modelIds[i] == id) return i;
+    }
+    return -1;
+}
+
+static int
+findSceneShader(SceneAssets* assets, StringId id) {
+    for (int i = 0; i < assets->shaderIds.size(); i++) {
+        if (assets->shaderIds[i] == id) return i;
+    }
+    return -1;
+}
+
+static StringId
+sceneModelId(SceneAssets* assets, Model* model) {
+    for (int i = 0; i < assets->models.size(); i++) {
+        if (assets->models[i] == model) return assets->modelIds[i];
+    }
+    return StringId{};
+}
+
+static StringId
+sceneShaderId(SceneAssets* assets, Shader shader) {
+    for (int i = 0; i < assets->shaders.size(); i++) {
+        if (assets->shaders[i].ID == shader.ID) return assets->shaderIds[i];
+    }
+    return StringId{};
+}
+
+static inline unsigned long long
+alignSceneOffset(unsigned long long offset) {
+    return (offset + SCENE_SECTION_ALIGNMENT - 1) & ~(unsigned long long)(SCENE_SECTION_ALIGNMENT - 1);
+}
+
+// Parent of each entity as an entity index, ~0u for roots
+static std::vector<uint>
+sceneParents(const std::vector<Entity>& entities, TransformHierarchy* transforms) {
+    std::vector<uint> entityOfTransform(transforms->indices.size(), ~0u);
+    for (uint i = 0; i < entities.size(); i++) entityOfTransform[entities[i].transform] = i;
+    std::vector<uint> parents(entities.size());
+    for (uint i = 0; i < entities.size(); i++) {
+        uint parent = parentTransform(transforms, entities[i].transform);
+        parents[i] = parent == NO_TRANSFORM ? ~0u : entityOfTransform[parent];
+    }
+    return parents;
+}
+
+static bool
+saveSceneBinary(const char* path, const std::vector<Entity>& entities, TransformHierarchy* transforms, SceneAssets* assets) {
+    uint entityCount = entities.size();
+    std::vector<uint> parents = sceneParents(entities, transforms);
+
+    // Only the assets the entities use go into the file
+    std::vector<SceneFileAsset> fileAssets;
+    std::string names;
+    std::vector<uint> modelIds(entityCount);
+    std::vector<uint> shaderIds(entityCount);
+    for (uint i = 0; i < entityCount; i++) {
+        StringId ids[2] = { sceneModelId(assets, entities[i].model), sceneShaderId(assets, entities[i].shader) };
+        modelIds[i] = ids[0].hash;
+        shaderIds[i] = ids[1].hash;
+        for (uint kind = 0; kind < 2; kind++) {
+            bool found = false;
+            for (int j = fileAssets.size() - 1; j >= 0 && !found; j--) {
+                found = fileAssets[j].id == ids[kind].hash && fileAssets[j].kind == kind;
+            }
+            if (found) continue;
+
+            const char* name = stringIdName(ids[kind]);
+            SceneFileAsset asset = { ids[kind].hash, kind, (uint)names.size(), (uint)strlen(name) };
+            names.append(name, asset.nameLength + 1);
+            fileAssets.push_back(asset);
+        }
+    }
+
+    SceneFileHeader header = {};
+    header.magic = SCENE_MAGIC;
+    header.version = SCENE_VERSION;
+    header.entityCount = entityCount;
+    header.assetCount = fileAssets.size();
+    header.transformsOffset = alignSceneOffset(sizeof(SceneFileHeader));
+    header.parentsOffset = alignSceneOffset(header.transformsOffset + (unsigned long long)entityCount * sizeof(glm::mat4));
+    header.modelIdsOffset = alignSceneOffset(header.parentsOffset + (unsigned long long)entityCount * sizeof(uint));
+    header.shaderIdsOffset = alignSceneOffset(header.modelIdsOffset + (unsigned long long)entityCount * sizeof(uint));
+    header.assetsOffset = alignSceneOffset(header.shaderIdsOffset + (unsigned long long)entityCount * sizeof(uint));
+    header.namesOffset = alignSceneOffset(header.assetsOffset + fileAssets.size() * sizeof(SceneFileAsset));
+    header.fileSize = header.namesOffset + names.size();
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        std::cout << "ERROR::SCENE:: could not open " << path << " for writing" << std::endl;
+        return false;
+    }
+
+    static const char padding[SCENE_SECTION_ALIGNMENT] = {};
+    unsigned long long written = 0;
+    auto writeSection = [&](unsigned long long offset, const void* data, size_t size) {
+        fwrite(padding, 1, offset - written, file);
+        if (size) fwrite(data, 1, size, file);
+        written = offset + size;
+    };
+
+    writeSection(0, &header, sizeof(header));
+    writeSection(header.transformsOffset, NULL, 0);
+    for (uint i = 0; i < entityCount; i++) {
+        fwrite(glm::value_ptr(worldMatrix(transforms, entities[i].transform)), sizeof(glm::mat4), 1, file);
+    }
+    written += (unsigned long long)entityCount * sizeof(glm::mat4);
+    writeSection(header.parentsOffset, parents.data(), entityCount * sizeof(uint));
+    writeSection(header.modelIdsOffset, modelIds.data(), entityCount * sizeof(uint));
+    writeSection(header.shaderIdsOffset, shaderIds.data(), entityCount * sizeof(uint));
+    writeSection(header.assetsOffset, fileAssets.data(), fileAssets.size() * sizeof(SceneFileAsset));
+    writeSection(header.namesOffset, names.data(), names.size());
+
+    bool ok = !ferror(file);
+    fclose(file);
+    if (!ok) std::cout << "ERROR::SCENE:: failed writing " << path << std::endl;
+    return ok;
+}
+
+struct MappedFile {
+    void* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+static bool
+mapFile(MappedFile* mapped, const char* path) {
+    *mapped = {};
+#ifdef _WIN32
+    mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    GetFileSizeEx(mapped->file, &size);
+    mapped->size = (size_t)size.QuadPart;
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapped->mapping) mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mapped->data) {
+        if (mapped->mapping) CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return false;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    mapped->size = (size_t)st.st_size;
+    mapped->data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped->data == MAP_FAILED) {
+        mapped->data = NULL;
+        return false;
+    }
+#endif
+    return true;
+}
+
+static void
+unmapFile(MappedFile* mapped) {
+#ifdef _WIN32
+    UnmapViewOfFile(mapped->data);
+    CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+#else
+    munmap(mapped->data, mapped->size);
+#endif
+    *mapped = {};
+}
+
+// Points into a mapped scene file, valid until the file is unmapped
+struct SceneView {
+    uint entityCount;
+    const glm::mat4* transforms;
+    const uint* parents;
+    const uint* modelIds;
+    const uint* shaderIds;
+    uint assetCount;
+    const SceneFileAsset* assets;
+    const char* names;
+};
+
+static bool
+sceneSectionFits(const SceneFileHeader* header, unsigned long long offset, unsigned long long size) {
+    return offset % SCENE_SECTION_ALIGNMENT == 0 && offset <= header->fileSize && size <= header->fileSize - offset;
+}
+
+// Only checks the header and that the sections are inside the file, nothing is parsed
+static bool
+viewScene(SceneView* view, const void* data, size_t size) {
+    const SceneFileHeader* header = (const SceneFileHeader*)data;
+    if (size < sizeof(SceneFileHeader) || header->magic != SCENE_MAGIC || header->version != SCENE_VERSION || header->fileSize > size) {
+        return false;
+    }
+    unsigned long long count = header->entityCount;
+    if (!sceneSectionFits(header, header->transformsOffset, count * sizeof(glm::mat4))
+        || !sceneSectionFits(header, header->parentsOffset, count * sizeof(uint))
+        || !sceneSectionFits(header, header->modelIdsOffset, count * sizeof(uint))
+        || !sceneSectionFits(header, header->shaderIdsOffset, count * sizeof(uint))
+        || !sceneSectionFits(header, header->assetsOffset, (unsigned long long)header->assetCount * sizeof(SceneFileAsset))
+        || !sceneSectionFits(header, header->namesOffset, 0)) {
+        return false;
+    }
+
+    const unsigned char* bytes = (const unsigned char*)data;
+    view->entityCount = header->entityCount;
+    view->transforms = (const glm::mat4*)(bytes + header->transformsOffset);
+    view->parents = (const uint*)(bytes + header->parentsOffset);
+    view->modelIds = (const uint*)(bytes + header->modelIdsOffset);
+    view->shaderIds = (const uint*)(bytes + header->shaderIdsOffset);
+    view->assetCount = header->assetCount;
+    view->assets = (const SceneFileAsset*)(bytes + header->assetsOffset);
+    view->names = (const char*)(bytes + header->namesOffset);
+
+    unsigned long long namesSize = header->fileSize - header->namesOffset;
+    for (uint i = 0; i < view->assetCount; i++) {
+        const SceneFileAsset* asset = &view->assets[i];
+        if ((unsigned long long)asset->nameOffset + asset->nameLength >= namesSize || view->names[asset->nameOffset + asset->nameLength] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const char*
+sceneAssetName(SceneView* view, uint id, uint kind) {
+    for (uint i = 0; i < view->assetCount; i++) {
+        if (view->assets[i].id == id && view->assets[i].kind == kind) return view->names + view->assets[i].nameOffset;
+    }
+    return "<missing>";
+}
+
+// Entities are created as roots with their world transform, so parenting them afterwards
+// keeps them where they are no matter which order parents and children come in
+static void
+attachSceneParents(std::vector<Entity>* entities, TransformHierarchy* transforms, const uint* parents, const uint* fileToEntity, uint count) {
+    for (uint i = 0; i < count; i++) {
+        uint parent = parents[i];
+        if (fileToEntity[i] == ~0u || parent >= count || fileToEntity[parent] == ~0u) continue;
+        if (!setParentTransform(transforms, (*entities)[fileToEntity[i]].transform, (*entities)[fileToEntity[parent]].transform)) {
+            std::cout << "ERROR::SCENE:: entity " << i << " is its own ancestor, left as a root" << std::endl;
+        }
+    }
+}
+
+// Replaces the entities with the ones in the scene. Entities whose assets
+// aren't registered are skipped.
+static bool
+loadSceneBinary(const char* path, std::vector<Entity>* entities, TransformHierarchy* transforms, SceneAssets* assets) {
+    MappedFile mapped;
+    if (!mapFile(&mapped, path)) {
+        std::cout << "ERROR::SCENE:: could not map " << path << std::endl;
+        return false;
+    }
+
+    SceneView view;
+    if (!viewScene(&view, mapped.data, mapped.size)) {
+        std::cout << "ERROR::SCENE:: " << path << " is not a valid scene file" << std::endl;
+        unmapFile(&mapped);
+        return false;
+    }
+
+    entities->clear();
+    entities->reserve(view.entityCount);
+    clearTransforms(transforms);
+    ScratchScope scratch;
+    uint* fileToEntity = pushArray(scratch.arena(), uint, view.entityCount);
+
+    // Entities using the same assets tend to come in runs, so remember the last lookup
+    uint lastModelId = 0, lastShaderId = 0;
+    int model = -1, shader = -1;
+    bool first = true;
+    uint skipped = 0;
+    for (uint i = 0; i < view.entityCount; i++) {
+        if (first || view.modelIds[i] != lastModelId) {
+            lastModelId = view.modelIds[i];
+            model = findSceneModel(assets, StringId{ lastModelId });
+        }
+        if (first || view.shaderIds[i] != lastShaderId) {
+            lastShaderId = view.shaderIds[i];
+            shader = findSceneShader(assets, StringId{ lastShaderId });
+        }
+        first = false;
+        fileToEntity[i] = ~0u;
+        if (model < 0 || shader < 0) {
+            if (skipped++ == 0) {
+                std::cout << "ERROR::SCENE:: unknown asset " << (model < 0 ? sceneAssetName(&view, lastModelId, SCENE_ASSET_MODEL) : sceneAssetName(&view, lastShaderId, SCENE_ASSET_SHADER)) << std::endl;
+            }
+            continue;
+        }
+
+        Entity entity = {};
+        entity.transform = createTransform(transforms, NO_TRANSFORM, view.transforms[i]);
+        entity.model = assets->models[model];
+        entity.shader = assets->shaders[shader];
+        entity.visible = true;
+        fileToEntity[i] = entities->size();
+        entities->push_back(entity);
+    }
+    attachSceneParents(entities, transforms, view.parents, fileToEntity, view.entityCount);
+    if (skipped) std::cout << "ERROR::SCENE:: skipped " << skipped << " entities with unknown assets" << std::endl;
+
+    unmapFile(&mapped);
+    return true;
+}
+
+static bool
+saveSceneText(const char* path, const std::vector<Entity>& entities, TransformHierarchy* transforms, SceneAssets* assets) {
+    std::vector<uint> parents = sceneParents(entities, transforms);
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        std::cout << "ERROR::SCENE:: could not open " << path << " for writing" << std::endl;
+        return false;
+    }
+
+    fprintf(file, "scene %u\n", SCENE_VERSION);
+    fprintf(file, "entities %u\n", (uint)entities.size());
+    for (uint i = 0; i < entities.size(); i++) {
+        const Entity* entity = &entities[i];
+        // Names can't have spaces in them, asset paths here never do
+        fprintf(file, "%s %s %d", stringIdName(sceneModelId(assets, entity->model)), stringIdName(sceneShaderId(assets, entity->shader)), (int)parents[i]);
+        const float* m = glm::value_ptr(worldMatrix(transforms, entity->transform));
+        for (int j = 0; j < 16; j++) fprintf(file, " %.9g", m[j]);
+        fprintf(file, "\n");
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+static bool
+loadSceneText(const char* path, std::vector<Entity>* entities, TransformHierarchy* transforms, SceneAssets* assets) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        std::cout << "ERROR::SCENE:: could not open " << path << std::endl;
+        return false;
+    }
+
+    uint version, entityCount;
+    if (fscanf(file, " scene %u entities %u", &version, &entityCount) != 2 || version != SCENE_VERSION) {
+        std::cout << "ERROR::SCENE:: " << path << " is not a valid scene text file" << std::endl;
+        fclose(file);
+        return false;
+    }
+
+    entities->clear();
+    entities->reserve(entityCount);
+    clearTransforms(transforms);
+    std::vector<uint> parents(entityCount);
+    std::vector<uint> fileToEntity(entityCount, ~0u);
+    for (uint i = 0; i < entityCount; i++) {
+        char modelName[512], shaderName[512];
+        int parent;
+        float m[16];
+        int read = fscanf(file, " %511s %511s %d", modelName, shaderName, &parent);
+        for (int j = 0; j < 16 && read == 3 + j; j++) read += fscanf(file, " %f", &m[j]);
+        if (read != 19) {
+            std::cout << "ERROR::SCENE:: " << path << " is truncated at entity " << i << std::endl;
+            entities->clear();
+            clearTransforms(transforms);
+            fclose(file);
+            return false;
+        }
+        parents[i] = (uint)parent;
+
+        int model = findSceneModel(assets, makeStringId(modelName));
+        int shader = findSceneShader(assets, makeStringId(shaderName));
+        if (model < 0 || shader < 0) {
+            std::cout << "ERROR::SCENE:: unknown asset " << (model < 0 ? modelName : shaderName) << std::endl;
+            continue;
+        }
+
+        Entity entity = {};
+        entity.transform = createTransform(transforms, NO_TRANSFORM, glm::make_mat4(m));
+        entity.model = assets->models[model];
+        entity.shader = assets->shaders[shader];
+        entity.visible = true;
+        fileToEntity[i] = entities->size();
+        entities->push_back(entity);
+    }
+    attachSceneParents(entities, transforms, parents.data(), fileToEntity.data(), entityCount);
+
+    fclose(file);
+    return true;
+}
+
+static bool
+isSceneTextPath(const char* path) {
+    size_t length = strlen(path);
+    return length >= 4 && strcmp(path + length - 4, ".txt") == 0;
+}
+
+// Picks the format from the extension, .txt is text and anything else binary
+static bool
+loadScene(const char* path, std::vector<Entity>* entities, TransformHierarchy* transforms, SceneAssets* assets) {
+    double startTime = glfwGetTime();
+    bool ok = isSceneTextPath(path) ? loadSceneText(path, entities, transforms, assets) : loadSceneBinary(path, entities, transforms, assets);
+    if (ok) printf("Loaded scene %s: %u entities in %.2f ms\n", path, (uint)entities->size(), (glfwGetTime() - startTime) * 1000.0);
+    return ok;
+}
+
+static bool
+saveScene(const char* path, const std::vector<Entity>& entities, TransformHierarchy* transforms, SceneAssets* assets) {
+    return isSceneTextPath(path) ? saveSceneText(path, entities, transforms, assets) : saveSceneBinary(path, entities, transforms, assets);
+}
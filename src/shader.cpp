@@ -1,12 +1,64 @@
+// Uniform buffer binding of CameraBlock in every shader that declares it
+#define CAMERA_UNIFORM_BINDING 0
+
+struct ShaderUniform {
+    StringId name;
+    int location;
+};
+
+// Uniforms of all the shaders, each shader owns a range
+static std::vector<ShaderUniform> g_shaderUniforms;
+
 struct Shader {
     uint ID;
+    uint uniformOffset; // Range in g_shaderUniforms
+    uint uniformCount;
+    // Locations of the material layer uniforms, -1 for slots the shader doesn't use
+    int materialLayerLocations[TEXTURE_SLOT_COUNT];
 };
 
+// Shaders only have a handful of uniforms, a linear search beats anything fancier
+static int
+uniformLocation(Shader shader, StringId name) {
+    const ShaderUniform* uniforms = &g_shaderUniforms[shader.uniformOffset];
+    for (uint i = 0; i < shader.uniformCount; i++) {
+        if (uniforms[i].name == name) return uniforms[i].location;
+    }
+    return -1;
+}
+
+// Records the active uniforms of the linked program, arrays by their name without the [0]
+static void
+gatherShaderUniforms(Shader* shader) {
+    int uniformCount = 0;
+    glGetProgramiv(shader->ID, GL_ACTIVE_UNIFORMS, &uniformCount);
+    shader->uniformOffset = g_shaderUniforms.size();
+    for (int i = 0; i < uniformCount; i++) {
+        char name[256];
+        GLsizei length = 0;
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(shader->ID, i, sizeof(name), &length, &size, &type, name);
+        int location = glGetUniformLocation(shader->ID, name);
+        if (length > 3 && strcmp(name + length - 3, "[0]") == 0) length -= 3;
+
+        ShaderUniform uniform;
+#if STRING_ID_DEBUG
+        uniform.name = internString(name, length);
+#else
+        uniform.name = makeStringId(name, length);
+#endif
+        uniform.location = location;
+        g_shaderUniforms.push_back(uniform);
+    }
+    shader->uniformCount = g_shaderUniforms.size() - shader->uniformOffset;
+}
+
 static bool
-checkShaderCompileErrors(GLuint shader, std::string type) {
+checkShaderCompileErrors(GLuint shader, const char* type) {
     GLint success;
     GLchar infoLog[1024];
-    if (type != "PROGRAM") {
+    if (strcmp(type, "PROGRAM") != 0) {
         glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
         if (!success) {
             glGetShaderInfoLog(shader, 1024, NULL, infoLog);
@@ -97,6 +149,20 @@ compileShader(std::string vertexPath, std::string fragmentPath, std::string geom
     glLinkProgram(result.ID);
     checkShaderCompileErrors(result.ID, "PROGRAM");
 
+    gatherShaderUniforms(&result);
+
+    // Material samplers always read from their slot's unit, so they only need to be set once
+    glUseProgram(result.ID);
+    for (int slot = 0; slot < TEXTURE_SLOT_COUNT; slot++) {
+        int samplerLocation = uniformLocation(result, textureSlotSamplerIds[slot]);
+        if (samplerLocation >= 0) glUniform1i(samplerLocation, textureSlotUnit((TextureSlot)slot));
+        result.materialLayerLocations[slot] = uniformLocation(result, textureSlotLayerIds[slot]);
+    }
+    glUseProgram(0);
+
+    uint cameraBlock = glGetUniformBlockIndex(result.ID, "CameraBlock");
+    if (cameraBlock != GL_INVALID_INDEX) glUniformBlockBinding(result.ID, cameraBlock, CAMERA_UNIFORM_BINDING);
+
     glDeleteShader(vertex);
     glDeleteShader(fragment);
     if (!geometryPath.empty()) {
@@ -112,61 +178,61 @@ use(Shader shader) {
 }
 
 static void
-setBool(Shader shader, const std::string &name, bool value) {
-    glUniform1i(glGetUniformLocation(shader.ID, name.c_str()), (int)value);
+setBool(Shader shader, StringId name, bool value) {
+    glUniform1i(uniformLocation(shader, name), (int)value);
 }
 
 static void
-setInt(Shader shader, const std::string &name, int value) {
-    glUniform1i(glGetUniformLocation(shader.ID, name.c_str()), value);
+setInt(Shader shader, StringId name, int value) {
+    glUniform1i(uniformLocation(shader, name), value);
 }
 
 static void
-setFloat(Shader shader, const std::string &name, float value) {
-    glUniform1f(glGetUniformLocation(shader.ID, name.c_str()), value);
+setFloat(Shader shader, StringId name, float value) {
+    glUniform1f(uniformLocation(shader, name), value);
 }
 
 static void
-setVec2(Shader shader, const std::string &name, const glm::vec2 &value) {
-    glUniform2fv(glGetUniformLocation(shader.ID, name.c_str()), 1, &value[0]);
+setVec2(Shader shader, StringId name, const glm::vec2 &value) {
+    glUniform2fv(uniformLocation(shader, name), 1, &value[0]);
 }
 
 static void
-setVec2(Shader shader, const std::string &name, float x, float y) {
-    glUniform2f(glGetUniformLocation(shader.ID, name.c_str()), x, y);
+setVec2(Shader shader, StringId name, float x, float y) {
+    glUniform2f(uniformLocation(shader, name), x, y);
 }
 
 static void
-setVec3(Shader shader, const std::string &name, const glm::vec3 &value) {
-    glUniform3fv(glGetUniformLocation(shader.ID, name.c_str()), 1, &value[0]);
+setVec3(Shader shader, StringId name, const glm::vec3 &value) {
+    glUniform3fv(uniformLocation(shader, name), 1, &value[0]);
 }
 
 static void
-setVec3(Shader shader, const std::string &name, float x, float y, float z) {
-    glUniform3f(glGetUniformLocation(shader.ID, name.c_str()), x, y, z);
+setVec3(Shader shader, StringId name, float x, float y, float z) {
+    glUniform3f(uniformLocation(shader, name), x, y, z);
 }
 
 static void
-setVec4(Shader shader, const std::string &name, const glm::vec4 &value) {
-    glUniform4fv(glGetUniformLocation(shader.ID, name.c_str()), 1, &value[0]);
+setVec4(Shader shader, StringId name, const glm::vec4 &value) {
+    glUniform4fv(uniformLocation(shader, name), 1, &value[0]);
 }
 
 static void
-setVec4(Shader shader, const std::string &name, float x, float y, float z, float w) {
-    glUniform4f(glGetUniformLocation(shader.ID, name.c_str()), x, y, z, w);
+setVec4(Shader shader, StringId name, float x, float y, float z, float w) {
+    glUniform4f(uniformLocation(shader, name), x, y, z, w);
 }
 
 static void
-setMat2(Shader shader, const std::string &name, const glm::mat2 &mat) {
-    glUniformMatrix2fv(glGetUniformLocation(shader.ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+setMat2(Shader shader, StringId name, const glm::mat2 &mat) {
+    glUniformMatrix2fv(uniformLocation(shader, name), 1, GL_FALSE, &mat[0][0]);
 }
 
 static void
-setMat3(Shader shader, const std::string &name, const glm::mat3 &mat) {
-    glUniformMatrix3fv(glGetUniformLocation(shader.ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+setMat3(Shader shader, StringId name, const glm::mat3 &mat) {
+    glUniformMatrix3fv(uniformLocation(shader, name), 1, GL_FALSE, &mat[0][0]);
 }
 
 static void
-setMat4(Shader shader, const std::string &name, const glm::mat4 &mat) {
-    glUniformMatrix4fv(glGetUniformLocation(shader.ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+setMat4(Shader shader, StringId name, const glm::mat4 &mat) {
+    glUniformMatrix4fv(uniformLocation(shader, name), 1, GL_FALSE, &mat[0][0]);
 }
@@ -215,6 +215,10 @@ RECENT REVISION HISTORY:
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
+// (Local change) To decide at run time yourself, define STBI_SSE2_AVAILABLE
+// to an expression that's nonzero when the SSE2 loops should be used. It's
+// evaluated every time a JPEG decoder is set up.
+//
 // ===========================================================================
 //
 // HDR image support   (disable by defining STBI_NO_HDR)
@@ -651,18 +655,26 @@ static int stbi__cpuid3(void)
 
 static int stbi__sse2_available(void)
 {
+#ifdef STBI_SSE2_AVAILABLE
+   return STBI_SSE2_AVAILABLE;
+#else
    int info3 = stbi__cpuid3();
    return ((info3 >> 26) & 1) != 0;
+#endif
 }
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
 static int stbi__sse2_available(void)
 {
+#ifdef STBI_SSE2_AVAILABLE
+   return STBI_SSE2_AVAILABLE;
+#else
    // If we're even attempting to compile this on GCC/Clang, that means
    // -msse2 is on, which means the compiler is allowed to use SSE2
    // instructions at will, and so are we.
    return 1;
+#endif
 }
 #endif
 #endif
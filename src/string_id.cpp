@@ -0,0 +1,94 @@
+// Hashed string identifiers.
+//
+// A StringId is the 32 bit FNV-1a hash of a string. SID("name") hashes a literal
+// at compile time, so code that looks things up by name (uniforms, material
+// slots) only compares integers at runtime. Strings that have to be kept around
+// (texture paths) are interned with internString, which copies them into a
+// table that lives for the whole program and checks for hash collisions.
+//
+// stringIdName turns an interned id back into its string. With STRING_ID_DEBUG
+// the names of all the shader uniforms are interned as well, so ids seen while
+// debugging can be printed.
+
+#include <unordered_map>
+#include <mutex>
+
+#ifndef STRING_ID_DEBUG
+#define STRING_ID_DEBUG 1
+#endif
+
+#define STRING_ARENA_SIZE (1024 * 1024)
+
+struct StringId {
+    uint hash;
+};
+
+static inline bool operator==(StringId a, StringId b) { return a.hash == b.hash; }
+static inline bool operator!=(StringId a, StringId b) { return a.hash != b.hash; }
+static inline bool operator<(StringId a, StringId b) { return a.hash < b.hash; }
+
+static constexpr uint
+hashString(const char* string, size_t length) {
+    uint hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)string[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Forces the hash to be computed at compile time, only for string literals
+#define SID(literal) (StringId{ std::integral_constant<uint, hashString(literal, sizeof(literal) - 1)>::value })
+
+static inline StringId
+makeStringId(const char* string, size_t length) {
+    StringId id = { hashString(string, length) };
+    return id;
+}
+
+static inline StringId
+makeStringId(const char* string) {
+    return makeStringId(string, strlen(string));
+}
+
+struct StringTable {
+    std::mutex mutex; // The streaming worker looks up paths
+    MemoryArena arena;
+    std::unordered_map<uint, const char*> names;
+};
+
+static StringTable g_stringTable;
+
+// Copies the string into the table, if it isn't there already, and returns its id
+static StringId
+internString(const char* string, size_t length) {
+    StringId id = makeStringId(string, length);
+
+    std::lock_guard<std::mutex> lock(g_stringTable.mutex);
+    auto it = g_stringTable.names.find(id.hash);
+    if (it != g_stringTable.names.end()) {
+        if (strncmp(it->second, string, length) != 0 || it->second[length] != 0) {
+            fprintf(stderr, "ERROR::STRING_ID:: hash collision between \"%s\" and \"%.*s\"\n", it->second, (int)length, string);
+        }
+        return id;
+    }
+
+    if (!g_stringTable.arena.base) initArena(&g_stringTable.arena, STRING_ARENA_SIZE, "string table");
+    char* copy = pushArray(&g_stringTable.arena, char, length + 1);
+    memcpy(copy, string, length);
+    copy[length] = 0;
+    g_stringTable.names[id.hash] = copy;
+    return id;
+}
+
+static StringId
+internString(const char* string) {
+    return internString(string, strlen(string));
+}
+
+// Interned strings are never freed, so the result stays valid
+static const char*
+stringIdName(StringId id) {
+    std::lock_guard<std::mutex> lock(g_stringTable.mutex);
+    auto it = g_stringTable.names.find(id.hash);
+    return it != g_stringTable.names.end() ? it->second : "<unknown string id>";
+}
@@ -0,0 +1,507 @@
+// Mip level texture streaming.
+//
+// Images are packed into GL_TEXTURE_2D_ARRAYs, one array per material slot and
+// image size/format, so meshes only need a layer index and don't have to
+// rebind textures. Images are first registered with addTextureLayer and the
+// arrays get created by createTextureArrays once the models are loaded.
+//
+// Arrays are created with only their last 1x1 mip level, and the mip tail
+// (levels up to STREAMING_TAIL_SIZE) is loaded right away in the background.
+// Every frame the renderer tells the streamer which level each array would
+// need for how large it is on screen, and finer levels are decoded on a worker
+// thread and uploaded by the main thread. GL_TEXTURE_BASE_LEVEL and
+// GL_TEXTURE_MIN_LOD clamp sampling to the finest level that is resident.
+//
+// When the resident levels go over the memory budget, the finest levels of the
+// least recently used arrays are evicted.
+//
+// Requesting and uploading levels doesn't allocate once the arrays exist: a
+// load only carries the texture's index, the worker looks up the layer paths
+// itself, and the request and result queues are reserved for one load per
+// array when the arrays are created.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define STREAMING_TAIL_SIZE 64
+#define STREAMING_MAX_LAYERS 256 // Minimum GL_MAX_ARRAY_TEXTURE_LAYERS in GL 3.3
+// Texture unit used for uploads, past the ones the material slots use
+#define STREAMING_UPLOAD_UNIT 8
+
+struct StreamedTexture {
+    uint id; // GL_TEXTURE_2D_ARRAY, 0 until createTextureArrays
+    uint slot;
+    std::vector<StringId> layerPaths; // Interned
+    int width;
+    int height;
+    int components;
+    int levelCount;
+    int tailLevel;      // First level of the tail that is always kept resident
+    int residentLevel;  // Finest resident level, same as GL_TEXTURE_BASE_LEVEL
+    int wantedLevel;    // Finest level asked for since the last update
+    bool loading;       // A load is queued or in flight
+    bool placeholder;   // Only the 1x1 grey level is there
+    uint lastUsedFrame;
+};
+
+// Levels from firstLevel down to 1x1 of every layer, decoded on the worker.
+// The whole tail is always reloaded, it's tiny and means a load can never leave holes
+// in the chain, even if levels got evicted while it was in flight.
+struct TextureLoad {
+    uint texture;
+    int firstLevel;
+    int levelCount;
+    int layerCount;
+    int width;
+    int height;
+    int components;
+    unsigned char* pixels; // Level by level, all layers of a level one after another. NULL if the load failed.
+};
+
+struct TextureStreamer {
+    std::vector<StreamedTexture> textures;
+    size_t budgetBytes;
+    size_t residentBytes;
+    uint frame;
+    uint uploadedLevels; // Stats for the last update
+    uint evictedLevels;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::vector<TextureLoad> requests; // Guarded by mutex
+    std::vector<TextureLoad> results;  // Guarded by mutex
+    std::vector<TextureLoad> uploads;  // Swapped with results, so neither gives up its capacity
+    bool quit;
+};
+
+// Where an image ended up
+struct TextureLayer {
+    uint texture; // Index into TextureStreamer::textures
+    uint layer;
+};
+
+static inline int
+levelSize(int size, int level) {
+    int result = size >> level;
+    return result > 0 ? result : 1;
+}
+
+static inline size_t
+levelBytes(StreamedTexture* texture, int level) {
+    // 3 component textures usually end up padded to 4 on the GPU
+    int bytesPerTexel = texture->components == 3 ? 4 : texture->components;
+    return (size_t)levelSize(texture->width, level) * levelSize(texture->height, level) * bytesPerTexel * texture->layerPaths.size();
+}
+
+static size_t
+residentBytes(StreamedTexture* texture) {
+    size_t result = 0;
+    for (int level = texture->residentLevel; level < texture->levelCount; level++) {
+        result += levelBytes(texture, level);
+    }
+    return result;
+}
+
+static GLenum
+textureFormat(int components) {
+    if (components == 1) return GL_RED;
+    if (components == 2) return GL_RG;
+    if (components == 3) return GL_RGB;
+    return GL_RGBA;
+}
+
+// 2x2 box filter, odd sizes just drop the last row/column
+static void
+downsampleLevel(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int dstWidth, int dstHeight, int components) {
+    for (int y = 0; y < dstHeight; y++) {
+        int y0 = glm::min(y * 2, srcHeight - 1);
+        int y1 = glm::min(y * 2 + 1, srcHeight - 1);
+        for (int x = 0; x < dstWidth; x++) {
+            int x0 = glm::min(x * 2, srcWidth - 1);
+            int x1 = glm::min(x * 2 + 1, srcWidth - 1);
+            for (int c = 0; c < components; c++) {
+                int sum = src[(y0 * srcWidth + x0) * components + c] + src[(y0 * srcWidth + x1) * components + c]
+                        + src[(y1 * srcWidth + x0) * components + c] + src[(y1 * srcWidth + x1) * components + c];
+                dst[(y * dstWidth + x) * components + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// Decodes the images and builds the requested levels. Safe to call from the worker.
+static void
+decodeTextureLevels(TextureStreamer* streamer, TextureLoad* load) {
+    int layerCount = load->layerCount;
+    size_t levelOffsets[32];
+    size_t totalBytes = 0;
+    for (int level = load->firstLevel; level < load->levelCount; level++) {
+        levelOffsets[level] = totalBytes;
+        totalBytes += (size_t)levelSize(load->width, level) * levelSize(load->height, level) * load->components * layerCount;
+    }
+    load->pixels = (unsigned char*)malloc(totalBytes);
+
+    for (int layer = 0; layer < layerCount; layer++) {
+        int width, height, components;
+        // The layers of a created array don't change, but the main thread can add arrays meanwhile
+        StringId pathId;
+        {
+            std::lock_guard<std::mutex> lock(streamer->mutex);
+            pathId = streamer->textures[load->texture].layerPaths[layer];
+        }
+        const char* path = stringIdName(pathId);
+        unsigned char* data = stbi_load(path, &width, &height, &components, 0);
+        if (!data || width != load->width || height != load->height || components != load->components) {
+            std::cout << "Texture failed to stream at path: " << path << std::endl;
+            stbi_image_free(data);
+            free(load->pixels);
+            load->pixels = NULL;
+            return;
+        }
+
+        // Walk down the whole chain, keeping only the levels that were asked for
+        unsigned char* current = data;
+        for (int level = 0; level < load->levelCount; level++) {
+            int w = levelSize(width, level);
+            int h = levelSize(height, level);
+            size_t imageBytes = (size_t)w * h * components;
+            if (level >= load->firstLevel) {
+                memcpy(load->pixels + levelOffsets[level] + layer * imageBytes, current, imageBytes);
+            }
+            if (level + 1 < load->levelCount) {
+                int nextW = levelSize(width, level + 1);
+                int nextH = levelSize(height, level + 1);
+                unsigned char* next = (unsigned char*)malloc((size_t)nextW * nextH * components);
+                downsampleLevel(current, w, h, next, nextW, nextH, components);
+                if (current != data) free(current);
+                current = next;
+            }
+        }
+        if (current != data) free(current);
+        stbi_image_free(data);
+    }
+}
+
+static void
+textureStreamingWorker(TextureStreamer* streamer) {
+    for (;;) {
+        TextureLoad load;
+        {
+            std::unique_lock<std::mutex> lock(streamer->mutex);
+            streamer->condition.wait(lock, [streamer] { return streamer->quit || !streamer->requests.empty(); });
+            if (streamer->quit) return;
+            load = streamer->requests.front();
+            streamer->requests.erase(streamer->requests.begin());
+        }
+
+        decodeTextureLevels(streamer, &load);
+
+        {
+            std::lock_guard<std::mutex> lock(streamer->mutex);
+            streamer->results.push_back(load);
+        }
+        requestRedrawAsync(&g_redraw);
+    }
+}
+
+static void
+initTextureStreaming(TextureStreamer* streamer, size_t budgetBytes) {
+    streamer->budgetBytes = budgetBytes;
+    streamer->residentBytes = 0;
+    streamer->frame = 0;
+    streamer->quit = false;
+    streamer->worker = std::thread(textureStreamingWorker, streamer);
+}
+
+static void
+shutdownTextureStreaming(TextureStreamer* streamer) {
+    {
+        std::lock_guard<std::mutex> lock(streamer->mutex);
+        streamer->quit = true;
+    }
+    streamer->condition.notify_one();
+    streamer->worker.join();
+
+    for (int i = 0; i < streamer->results.size(); i++) {
+        free(streamer->results[i].pixels);
+    }
+    streamer->results.clear();
+}
+
+static TextureLoad
+textureLoad(TextureStreamer* streamer, uint index, int firstLevel) {
+    StreamedTexture* texture = &streamer->textures[index];
+    TextureLoad load = {};
+    load.texture = index;
+    load.firstLevel = firstLevel;
+    load.levelCount = texture->levelCount;
+    load.layerCount = texture->layerPaths.size();
+    load.width = texture->width;
+    load.height = texture->height;
+    load.components = texture->components;
+    return load;
+}
+
+static void
+requestTextureLevels(TextureStreamer* streamer, uint index, int firstLevel) {
+    TextureLoad load = textureLoad(streamer, index, firstLevel);
+    streamer->textures[index].loading = true;
+    {
+        std::lock_guard<std::mutex> lock(streamer->mutex);
+        streamer->requests.push_back(load);
+    }
+    streamer->condition.notify_one();
+}
+
+// Expects the array to be bound
+static void
+setResidentLevel(StreamedTexture* texture, int level) {
+    texture->residentLevel = level;
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, level);
+    glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_LOD, (float)level);
+}
+
+// Binds the array on the upload unit, so the bindings of the material slots stay as they are
+static void
+bindForUpload(StreamedTexture* texture) {
+    glActiveTexture(GL_TEXTURE0 + STREAMING_UPLOAD_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture->id);
+}
+
+static void
+endUpload() {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+static void
+uploadTextureLevels(TextureStreamer* streamer, TextureLoad* load) {
+    StreamedTexture* texture = &streamer->textures[load->texture];
+    texture->loading = false;
+    if (!load->pixels) return;
+    // Something finer got resident in the meantime
+    if (load->firstLevel >= texture->residentLevel && !texture->placeholder) return;
+
+    GLenum format = textureFormat(texture->components);
+    int layerCount = texture->layerPaths.size();
+    bindForUpload(texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    unsigned char* pixels = load->pixels;
+    for (int level = load->firstLevel; level < load->levelCount; level++) {
+        int w = levelSize(texture->width, level);
+        int h = levelSize(texture->height, level);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, layerCount, 0, format, GL_UNSIGNED_BYTE, pixels);
+        pixels += (size_t)w * h * texture->components * layerCount;
+        if (level < texture->residentLevel) streamer->uploadedLevels++;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    streamer->residentBytes -= residentBytes(texture);
+    setResidentLevel(texture, glm::min(load->firstLevel, texture->residentLevel));
+    streamer->residentBytes += residentBytes(texture);
+    texture->placeholder = false;
+    endUpload();
+}
+
+// Finds or makes an array for the image and appends it as a new layer, or returns the
+// layer it already has if another model registered the same image for the same slot.
+// The path has to be interned. Nothing is loaded until createTextureArrays is called.
+static TextureLayer
+addTextureLayer(TextureStreamer* streamer, StringId path, uint slot) {
+    TextureLayer result = {};
+    for (uint i = 0; i < streamer->textures.size(); i++) {
+        StreamedTexture* texture = &streamer->textures[i];
+        if (texture->slot != slot) continue;
+        for (uint layer = 0; layer < texture->layerPaths.size(); layer++) {
+            if (texture->layerPaths[layer] == path) {
+                result.texture = i;
+                result.layer = layer;
+                return result;
+            }
+        }
+    }
+
+    int width, height, components;
+    if (!stbi_info(stringIdName(path), &width, &height, &components)) {
+        std::cout << "Texture failed to load at path: " << stringIdName(path) << std::endl;
+        width = height = 1;
+        components = 4;
+    }
+
+    for (uint i = 0; i < streamer->textures.size(); i++) {
+        StreamedTexture* texture = &streamer->textures[i];
+        if (texture->id == 0 && texture->slot == slot && texture->width == width && texture->height == height
+            && texture->components == components && texture->layerPaths.size() < STREAMING_MAX_LAYERS) {
+            result.texture = i;
+            result.layer = texture->layerPaths.size();
+            texture->layerPaths.push_back(path);
+            return result;
+        }
+    }
+
+    StreamedTexture texture = {};
+    texture.slot = slot;
+    texture.width = width;
+    texture.height = height;
+    texture.components = components;
+    texture.layerPaths.push_back(path);
+
+    result.texture = streamer->textures.size();
+    result.layer = 0;
+    {
+        // The worker reads layer paths of the arrays already created
+        std::lock_guard<std::mutex> lock(streamer->mutex);
+        streamer->textures.push_back(texture);
+    }
+    return result;
+}
+
+// Creates the arrays added since the last call, with only their 1x1 level, and queues their mip tails
+static void
+createTextureArrays(TextureStreamer* streamer) {
+    // Every array has at most one load queued or in flight
+    {
+        std::lock_guard<std::mutex> lock(streamer->mutex);
+        streamer->requests.reserve(streamer->textures.size());
+        streamer->results.reserve(streamer->textures.size());
+    }
+    streamer->uploads.reserve(streamer->textures.size());
+
+    for (uint i = 0; i < streamer->textures.size(); i++) {
+        StreamedTexture* texture = &streamer->textures[i];
+        if (texture->id != 0) continue;
+
+        int maxSize = glm::max(texture->width, texture->height);
+        texture->levelCount = 1;
+        while ((maxSize >> texture->levelCount) > 0) texture->levelCount++;
+        texture->tailLevel = 0;
+        while (texture->tailLevel < texture->levelCount - 1 && levelSize(maxSize, texture->tailLevel) > STREAMING_TAIL_SIZE) {
+            texture->tailLevel++;
+        }
+        texture->lastUsedFrame = streamer->frame;
+        texture->wantedLevel = texture->tailLevel;
+
+        glGenTextures(1, &texture->id);
+        bindForUpload(texture);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        // Mid grey until the tail comes in
+        int lastLevel = texture->levelCount - 1;
+        int layerCount = texture->layerPaths.size();
+        std::vector<unsigned char> placeholder(layerCount * texture->components, 128);
+        GLenum format = textureFormat(texture->components);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, lastLevel, format, 1, 1, layerCount, 0, format, GL_UNSIGNED_BYTE, &placeholder[0]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, lastLevel);
+        setResidentLevel(texture, lastLevel);
+        endUpload();
+        texture->placeholder = true;
+
+        streamer->residentBytes += residentBytes(texture);
+        requestTextureLevels(streamer, i, texture->tailLevel);
+    }
+}
+
+// Loads the levels on the calling thread, for when a texture is needed right now (like baking)
+static void
+makeTextureResident(TextureStreamer* streamer, uint index, int level) {
+    StreamedTexture* texture = &streamer->textures[index];
+    texture->lastUsedFrame = streamer->frame;
+    if (level >= texture->residentLevel && !texture->placeholder) return;
+
+    // Whatever is in flight gets ignored when it arrives, since it isn't finer anymore
+    TextureLoad load = textureLoad(streamer, index, level);
+    decodeTextureLevels(streamer, &load);
+    uploadTextureLevels(streamer, &load);
+    free(load.pixels);
+}
+
+// Called by the renderer for every texture it draws with, screenSize is the
+// size in pixels the texture is roughly stretched over on screen
+static void
+markTextureUsed(TextureStreamer* streamer, uint index, float screenSize) {
+    StreamedTexture* texture = &streamer->textures[index];
+    float texelsPerPixel = (float)glm::max(texture->width, texture->height) / glm::max(screenSize, 1.0f);
+    int level = texelsPerPixel > 1.0f ? (int)log2f(texelsPerPixel) : 0;
+    level = glm::min(level, texture->tailLevel);
+    if (texture->lastUsedFrame != streamer->frame || level < texture->wantedLevel) {
+        texture->wantedLevel = level;
+    }
+    texture->lastUsedFrame = streamer->frame;
+}
+
+static void
+evictTextureLevel(TextureStreamer* streamer, StreamedTexture* texture) {
+    int level = texture->residentLevel;
+    GLenum format = textureFormat(texture->components);
+    streamer->residentBytes -= levelBytes(texture, level);
+    bindForUpload(texture);
+    setResidentLevel(texture, level + 1);
+    // A zero sized image releases the level's storage
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, 0, 0, 0, 0, format, GL_UNSIGNED_BYTE, NULL);
+    endUpload();
+    streamer->evictedLevels++;
+}
+
+// Call once per frame after all the textures for the frame have been marked
+static void
+updateTextureStreaming(TextureStreamer* streamer) {
+    streamer->uploadedLevels = 0;
+    streamer->evictedLevels = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(streamer->mutex);
+        streamer->uploads.swap(streamer->results);
+    }
+    for (int i = 0; i < streamer->uploads.size(); i++) {
+        uploadTextureLevels(streamer, &streamer->uploads[i]);
+        free(streamer->uploads[i].pixels);
+    }
+    streamer->uploads.clear();
+
+    // Evict the finest levels of the least recently used textures while over budget,
+    // never touching the ones used this frame so they don't thrash
+    if (streamer->residentBytes > streamer->budgetBytes) {
+        ScratchScope scratch;
+        uint* order = pushArray(scratch.arena(), uint, streamer->textures.size());
+        uint orderCount = 0;
+        for (uint i = 0; i < streamer->textures.size(); i++) {
+            StreamedTexture* texture = &streamer->textures[i];
+            if (texture->lastUsedFrame != streamer->frame && texture->residentLevel < texture->tailLevel) {
+                order[orderCount++] = i;
+            }
+        }
+        std::sort(order, order + orderCount, [streamer](uint a, uint b) {
+            return streamer->textures[a].lastUsedFrame < streamer->textures[b].lastUsedFrame;
+        });
+        for (uint i = 0; i < orderCount && streamer->residentBytes > streamer->budgetBytes; i++) {
+            StreamedTexture* texture = &streamer->textures[order[i]];
+            while (texture->residentLevel < texture->tailLevel && streamer->residentBytes > streamer->budgetBytes) {
+                evictTextureLevel(streamer, texture);
+            }
+        }
+    }
+
+    // Stream in what was asked for, as long as it fits in the budget
+    size_t pendingBytes = 0;
+    for (uint i = 0; i < streamer->textures.size(); i++) {
+        StreamedTexture* texture = &streamer->textures[i];
+        if (texture->id == 0 || texture->loading || texture->lastUsedFrame != streamer->frame) continue;
+        if (texture->wantedLevel >= texture->residentLevel) continue;
+
+        size_t bytes = 0;
+        for (int level = texture->wantedLevel; level < texture->residentLevel; level++) {
+            bytes += levelBytes(texture, level);
+        }
+        if (streamer->residentBytes + pendingBytes + bytes > streamer->budgetBytes) continue;
+        pendingBytes += bytes;
+        requestTextureLevels(streamer, i, texture->wantedLevel);
+    }
+
+    streamer->frame++;
+}
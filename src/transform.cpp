@@ -0,0 +1,335 @@
+// Transform hierarchy.
+//
+// The local position, rotation and scale of every transform are stored in
+// arrays sorted by depth. A parent always comes before its children, so world
+// matrices can be computed front to back, and every depth level can be split
+// over threads since nothing in a level depends on the rest of it. Transforms
+// are referred to by handles because sorting moves them around.
+//
+// Changing a transform marks it dirty. An update with only a few dirty
+// transforms walks just their subtrees. One with many does the full pass,
+// carrying the dirty flags down level by level. When nothing changed the
+// update returns right away.
+
+#include <glm/gtc/quaternion.hpp>
+#include <atomic>
+
+#define NO_TRANSFORM (~0u)
+#define TRANSFORM_CHUNK_SIZE 1024 // Smallest chunk given to a job
+// Fewer dirty transforms than count / this walks subtrees instead of doing the full pass
+#define TRANSFORM_SUBTREE_RATIO 8
+
+struct TransformHierarchy {
+    // Indexed in depth order
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> scales;
+    std::vector<uint> parents; // NO_TRANSFORM for roots
+    std::vector<uint> depths;
+    std::vector<uint> firstChildren;
+    std::vector<uint> nextSiblings;
+    std::vector<glm::mat4> worlds;
+    std::vector<unsigned char> dirty;
+    std::vector<uint> handles; // Handle of each index
+
+    std::vector<uint> indices;      // Index of each handle
+    std::vector<uint> levelStarts;  // First index of each depth, and the count at the end
+    std::vector<uint> dirtyIndices; // Marked since the last update, can have repeats
+    bool needsSort;                 // Transforms were added or moved out of depth order
+    bool levelsChanged;
+
+    uint updatedCount; // Transforms recomputed by the last update
+};
+
+static void
+decomposeTransform(const glm::mat4& matrix, glm::vec3* position, glm::quat* rotation, glm::vec3* scale) {
+    *position = glm::vec3(matrix[3]);
+    glm::vec3 axes[3] = { glm::vec3(matrix[0]), glm::vec3(matrix[1]), glm::vec3(matrix[2]) };
+    *scale = glm::vec3(glm::length(axes[0]), glm::length(axes[1]), glm::length(axes[2]));
+    if (glm::dot(glm::cross(axes[0], axes[1]), axes[2]) < 0.0f) scale->x = -scale->x;
+    glm::mat3 rotationMatrix;
+    for (int i = 0; i < 3; i++) {
+        rotationMatrix[i] = (*scale)[i] != 0.0f ? axes[i] / (*scale)[i] : glm::vec3(0.0f);
+    }
+    *rotation = glm::normalize(glm::quat_cast(rotationMatrix));
+}
+
+static inline glm::mat4
+composeTransform(glm::vec3 position, glm::quat rotation, glm::vec3 scale) {
+    glm::mat3 r = glm::mat3_cast(rotation);
+    glm::mat4 result;
+    result[0] = glm::vec4(r[0] * scale.x, 0.0f);
+    result[1] = glm::vec4(r[1] * scale.y, 0.0f);
+    result[2] = glm::vec4(r[2] * scale.z, 0.0f);
+    result[3] = glm::vec4(position, 1.0f);
+    return result;
+}
+
+static inline void
+computeWorld(TransformHierarchy* h, uint index) {
+    glm::mat4 local = composeTransform(h->positions[index], h->rotations[index], h->scales[index]);
+    uint parent = h->parents[index];
+    h->worlds[index] = parent == NO_TRANSFORM ? local : h->worlds[parent] * local;
+}
+
+static void
+clearTransforms(TransformHierarchy* h) {
+    *h = TransformHierarchy();
+}
+
+static void
+markTransformDirty(TransformHierarchy* h, uint index) {
+    if (!h->dirty[index]) h->dirtyIndices.push_back(index);
+    h->dirty[index] = 1;
+}
+
+static uint
+createTransform(TransformHierarchy* h, uint parentHandle, const glm::mat4& local) {
+    uint handle = h->indices.size();
+    uint index = h->handles.size();
+    uint parent = parentHandle == NO_TRANSFORM ? NO_TRANSFORM : h->indices[parentHandle];
+    uint depth = parent == NO_TRANSFORM ? 0 : h->depths[parent] + 1;
+    if (index > 0 && depth < h->depths[index - 1]) h->needsSort = true;
+    h->levelsChanged = true;
+
+    glm::vec3 position, scale;
+    glm::quat rotation;
+    decomposeTransform(local, &position, &rotation, &scale);
+    h->positions.push_back(position);
+    h->rotations.push_back(rotation);
+    h->scales.push_back(scale);
+    h->parents.push_back(parent);
+    h->depths.push_back(depth);
+    h->firstChildren.push_back(NO_TRANSFORM);
+    h->nextSiblings.push_back(parent == NO_TRANSFORM ? NO_TRANSFORM : h->firstChildren[parent]);
+    if (parent != NO_TRANSFORM) h->firstChildren[parent] = index;
+    h->worlds.push_back(local);
+    h->dirty.push_back(0);
+    h->handles.push_back(handle);
+    h->indices.push_back(index);
+    markTransformDirty(h, index);
+    return handle;
+}
+
+static const glm::mat4&
+worldMatrix(TransformHierarchy* h, uint handle) {
+    return h->worlds[h->indices[handle]];
+}
+
+static uint
+parentTransform(TransformHierarchy* h, uint handle) {
+    uint parent = h->parents[h->indices[handle]];
+    return parent == NO_TRANSFORM ? NO_TRANSFORM : h->handles[parent];
+}
+
+static void
+setLocalTransform(TransformHierarchy* h, uint handle, glm::vec3 position, glm::quat rotation, glm::vec3 scale) {
+    uint index = h->indices[handle];
+    h->positions[index] = position;
+    h->rotations[index] = rotation;
+    h->scales[index] = scale;
+    markTransformDirty(h, index);
+}
+
+static glm::mat4
+composeWorld(TransformHierarchy* h, uint index) {
+    glm::mat4 local = composeTransform(h->positions[index], h->rotations[index], h->scales[index]);
+    uint parent = h->parents[index];
+    return parent == NO_TRANSFORM ? local : composeWorld(h, parent) * local;
+}
+
+// The world matrix as the next update will compute it. The stored one is stale
+// if the transform or one of its ancestors changed since the last update.
+static glm::mat4
+currentWorldMatrix(TransformHierarchy* h, uint index) {
+    for (uint i = index; i != NO_TRANSFORM; i = h->parents[i]) {
+        if (h->dirty[i]) return composeWorld(h, index);
+    }
+    return h->worlds[index];
+}
+
+// Sets the local transform that gives this world matrix under the current parent
+static void
+setWorldMatrix(TransformHierarchy* h, uint handle, const glm::mat4& world) {
+    uint index = h->indices[handle];
+    uint parent = h->parents[index];
+    glm::mat4 local = parent == NO_TRANSFORM ? world : glm::inverse(currentWorldMatrix(h, parent)) * world;
+    decomposeTransform(local, &h->positions[index], &h->rotations[index], &h->scales[index]);
+    markTransformDirty(h, index);
+}
+
+// Moves the transform under a new parent, keeping where it is in the world.
+// Returns false if the new parent is inside the transform's own subtree.
+static bool
+setParentTransform(TransformHierarchy* h, uint handle, uint parentHandle) {
+    uint index = h->indices[handle];
+    uint parent = parentHandle == NO_TRANSFORM ? NO_TRANSFORM : h->indices[parentHandle];
+    for (uint p = parent; p != NO_TRANSFORM; p = h->parents[p]) {
+        if (p == index) return false;
+    }
+    uint oldParent = h->parents[index];
+    if (oldParent == parent) return true;
+
+    // Unlink from the old parent's children
+    if (oldParent != NO_TRANSFORM) {
+        uint* link = &h->firstChildren[oldParent];
+        while (*link != index) link = &h->nextSiblings[*link];
+        *link = h->nextSiblings[index];
+    }
+    h->nextSiblings[index] = parent == NO_TRANSFORM ? NO_TRANSFORM : h->firstChildren[parent];
+    if (parent != NO_TRANSFORM) h->firstChildren[parent] = index;
+
+    glm::mat4 world = currentWorldMatrix(h, index);
+    h->parents[index] = parent;
+    setWorldMatrix(h, handle, world);
+
+    // The depth of the whole subtree changes, they get moved into place by the next update
+    ScratchScope scratch;
+    uint* stack = pushArray(scratch.arena(), uint, h->handles.size());
+    uint stackCount = 0;
+    stack[stackCount++] = index;
+    while (stackCount) {
+        uint i = stack[--stackCount];
+        h->depths[i] = h->parents[i] == NO_TRANSFORM ? 0 : h->depths[h->parents[i]] + 1;
+        for (uint child = h->firstChildren[i]; child != NO_TRANSFORM; child = h->nextSiblings[child]) {
+            stack[stackCount++] = child;
+        }
+    }
+    h->needsSort = true;
+    h->levelsChanged = true;
+    return true;
+}
+
+// In place by following the cycles of the permutation, so sorting a big hierarchy
+// doesn't need a second copy of every array. order maps new indices to old ones.
+template<typename T>
+static void
+permuteTransformArray(std::vector<T>* array, const uint* order, unsigned char* done) {
+    uint count = array->size();
+    memset(done, 0, count);
+    for (uint start = 0; start < count; start++) {
+        if (done[start]) continue;
+        T first = (*array)[start];
+        uint i = start;
+        while (order[i] != start) {
+            (*array)[i] = (*array)[order[i]];
+            done[i] = 1;
+            i = order[i];
+        }
+        (*array)[i] = first;
+        done[i] = 1;
+    }
+}
+
+// Counting sort by depth, stable so siblings keep their relative order
+static void
+sortTransforms(TransformHierarchy* h) {
+    uint count = h->handles.size();
+    ScratchScope scratch;
+    MemoryArena* arena = scratch.arena();
+
+    uint maxDepth = 0;
+    for (uint i = 0; i < count; i++) maxDepth = glm::max(maxDepth, h->depths[i]);
+    uint* offsets = pushArray(arena, uint, maxDepth + 2);
+    memset(offsets, 0, (maxDepth + 2) * sizeof(uint));
+    for (uint i = 0; i < count; i++) offsets[h->depths[i] + 1]++;
+    for (uint d = 0; d <= maxDepth; d++) offsets[d + 1] += offsets[d];
+
+    uint* order = pushArray(arena, uint, count);    // New index to old
+    uint* newIndex = pushArray(arena, uint, count); // Old index to new
+    for (uint i = 0; i < count; i++) {
+        uint slot = offsets[h->depths[i]]++;
+        order[slot] = i;
+        newIndex[i] = slot;
+    }
+
+    unsigned char* done = pushArray(arena, unsigned char, count);
+    permuteTransformArray(&h->positions, order, done);
+    permuteTransformArray(&h->rotations, order, done);
+    permuteTransformArray(&h->scales, order, done);
+    permuteTransformArray(&h->parents, order, done);
+    permuteTransformArray(&h->depths, order, done);
+    permuteTransformArray(&h->worlds, order, done);
+    permuteTransformArray(&h->dirty, order, done);
+    permuteTransformArray(&h->handles, order, done);
+
+    // Children are linked in reverse so they come out in depth order when walked
+    for (uint i = 0; i < count; i++) {
+        if (h->parents[i] != NO_TRANSFORM) h->parents[i] = newIndex[h->parents[i]];
+        h->indices[h->handles[i]] = i;
+        h->firstChildren[i] = NO_TRANSFORM;
+    }
+    for (uint i = count; i > 0; i--) {
+        uint parent = h->parents[i - 1];
+        h->nextSiblings[i - 1] = parent == NO_TRANSFORM ? NO_TRANSFORM : h->firstChildren[parent];
+        if (parent != NO_TRANSFORM) h->firstChildren[parent] = i - 1;
+    }
+    for (uint i = 0; i < h->dirtyIndices.size(); i++) {
+        h->dirtyIndices[i] = newIndex[h->dirtyIndices[i]];
+    }
+    h->needsSort = false;
+}
+
+static void
+buildTransformLevels(TransformHierarchy* h) {
+    h->levelStarts.clear();
+    for (uint i = 0; i < h->depths.size(); i++) {
+        while (h->levelStarts.size() <= h->depths[i]) h->levelStarts.push_back(i);
+    }
+    h->levelStarts.push_back(h->depths.size());
+    h->levelsChanged = false;
+}
+
+// Recomputes the world matrices of everything under the dirty transforms
+static void
+updateTransforms(TransformHierarchy* h) {
+    h->updatedCount = 0;
+    if (h->needsSort) sortTransforms(h);
+    if (h->levelsChanged) buildTransformLevels(h);
+    if (h->dirtyIndices.empty()) return;
+
+    uint count = h->handles.size();
+    if (h->dirtyIndices.size() * TRANSFORM_SUBTREE_RATIO < count) {
+        // Ancestors come first in depth order, so a transform that was already
+        // updated through one of them has its flag cleared by then
+        std::sort(h->dirtyIndices.begin(), h->dirtyIndices.end());
+        ScratchScope scratch;
+        uint* stack = pushArray(scratch.arena(), uint, count);
+        for (uint i = 0; i < h->dirtyIndices.size(); i++) {
+            if (!h->dirty[h->dirtyIndices[i]]) continue;
+            uint stackCount = 0;
+            stack[stackCount++] = h->dirtyIndices[i];
+            while (stackCount) {
+                uint index = stack[--stackCount];
+                computeWorld(h, index);
+                h->dirty[index] = 0;
+                h->updatedCount++;
+                for (uint child = h->firstChildren[index]; child != NO_TRANSFORM; child = h->nextSiblings[child]) {
+                    stack[stackCount++] = child;
+                }
+            }
+        }
+    } else {
+        // A dirty parent makes its children dirty, so the flags have to stay set
+        // until the whole pass is done
+        std::atomic<uint> updatedCount(0);
+        for (uint level = 0; level + 1 < h->levelStarts.size(); level++) {
+            uint levelStart = h->levelStarts[level];
+            uint levelCount = h->levelStarts[level + 1] - levelStart;
+            parallelFor(levelCount, TRANSFORM_CHUNK_SIZE, [h, levelStart, &updatedCount](uint first, uint last) {
+                uint updated = 0;
+                for (uint index = levelStart + first; index < levelStart + last; index++) {
+                    uint parent = h->parents[index];
+                    if (!h->dirty[index] && (parent == NO_TRANSFORM || !h->dirty[parent])) continue;
+                    h->dirty[index] = 1;
+                    computeWorld(h, index);
+                    updated++;
+                }
+                updatedCount += updated;
+            });
+        }
+        std::fill(h->dirty.begin(), h->dirty.end(), 0);
+        h->updatedCount = updatedCount;
+    }
+    h->dirtyIndices.clear();
+}